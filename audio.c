@@ -0,0 +1,161 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "audio.h"
+#include "extract.h"
+#include "hash.h"
+#include "mapfile.h"
+#include "progress.h"
+#include "wav.h"
+
+#define WINDOW_SIZE	(32 * 1024 * 1024)
+// Sectors of PCM produced per write, a little over 1 MiB.
+#define CHUNK_SECTORS	448
+
+/* Copy len bytes, swapping the bytes of each 16-bit sample. */
+static void copy_swapped(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 64 <= len; i += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+		a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+		b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+		c = _mm_or_si128(_mm_slli_epi16(c, 8), _mm_srli_epi16(c, 8));
+		d = _mm_or_si128(_mm_slli_epi16(d, 8), _mm_srli_epi16(d, 8));
+		_mm_storeu_si128((__m128i *)(dst + i), a);
+		_mm_storeu_si128((__m128i *)(dst + i + 16), b);
+		_mm_storeu_si128((__m128i *)(dst + i + 32), c);
+		_mm_storeu_si128((__m128i *)(dst + i + 48), d);
+	}
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+		_mm_storeu_si128((__m128i *)(dst + i), a);
+	}
+#endif
+	for (; i + 2 <= len; i += 2) {
+		uint8_t lo = src[i];
+		dst[i] = src[i + 1];
+		dst[i + 1] = lo;
+	}
+}
+
+/*
+ * Pack the payloads of count sectors, stride bytes apart, into dst. The
+ * first sector contributes only its bytes from skip on and the last only
+ * up to tail; the rest contribute len bytes each.
+ */
+static uint8_t *strip_sectors(uint8_t *dst, const uint8_t *src, size_t count, unsigned stride,
+	unsigned len, unsigned skip, unsigned tail, bool swap)
+{
+	for (size_t i = 0; i < count; i++) {
+		unsigned from = i ? 0 : skip;
+		unsigned to = (i == count - 1) ? tail : len;
+
+		if (swap)
+			copy_swapped(dst, src + from, to - from);
+		else
+			memcpy(dst, src + from, to - from);
+		dst += to - from;
+		src += stride;
+	}
+	return dst;
+}
+
+/*
+ * Fill dst with n bytes of the track's PCM stream starting at byte pos,
+ * which may lie before the start or past the end of the track; those
+ * parts are silence.
+ */
+static int read_pcm(const struct extract_job_s *job, struct MappedWindow_s *w, uint8_t *dst,
+	int64_t pos, size_t n, bool swap)
+{
+	const int64_t total = (int64_t)job->numblocks * job->data_len;
+	const uint8_t *src;
+	uint64_t first, last;
+	size_t lead = 0;
+
+	if (pos < 0) {
+		lead = (-pos < (int64_t)n) ? (size_t)-pos : n;
+		memset(dst, 0, lead);
+		dst += lead;
+		n -= lead;
+		pos = 0;
+	}
+	if (pos + (int64_t)n > total) {
+		size_t over = (pos >= total) ? n : (size_t)(pos + n - total);
+		memset(dst + n - over, 0, over);
+		n -= over;
+	}
+	if (!n)
+		return 0;
+
+	first = pos / job->data_len;
+	last = (pos + n - 1) / job->data_len;
+	src = MappedWindow_Get(w, job->in_off + first * job->stride, (last - first + 1) * job->stride);
+	if (!src)
+		return -1;
+	strip_sectors(dst, src + job->data_off, last - first + 1, job->stride, job->data_len,
+		pos % job->data_len, (pos + n - 1) % job->data_len + 1, swap);
+	return 0;
+}
+
+/*
+ * Write an audio track out as a WAV file. offset shifts the audio by that
+ * many samples, later if positive, with silence filling in at either
+ * end, to make up for a drive's read offset. swap byte-swaps every
+ * sample, for images that store audio big-endian.
+ */
+int extract_audio(const struct extract_job_s *job, int32_t offset, bool swap)
+{
+	struct MappedWindow_s w;
+	uint8_t hdr[WAV_HEADER_LEN];
+	uint8_t *buf;
+	const uint64_t total = job->numblocks * job->data_len;
+	const size_t chunk = (size_t)CHUNK_SECTORS * job->data_len;
+	int64_t shift = (int64_t)offset * AUDIO_SAMPLE_LEN;
+	int rc = 0;
+
+	if (total > UINT32_MAX - 36) {
+		errno = EFBIG;
+		return -1;
+	}
+	buf = malloc(chunk);
+	if (!buf)
+		return -1;
+	if (MappedWindow_Init(&w, job->in_fd, WINDOW_SIZE, !job->keep_cache)) {
+		free(buf);
+		return -1;
+	}
+
+	wav_header(hdr, total);
+	if (job->hash)
+		hash_feed(job->hash, hdr, sizeof(hdr));
+	rc = write_full(job->out_fd, hdr, sizeof(hdr));
+	for (uint64_t done = 0; !rc && (done < total); done += chunk) {
+		size_t n = (total - done < chunk) ? total - done : chunk;
+
+		rc = read_pcm(job, &w, buf, (int64_t)done - shift, n, swap);
+		if (!rc && job->hash)
+			hash_feed(job->hash, buf, n);
+		if (!rc)
+			rc = write_full(job->out_fd, buf, n);
+		if (!rc)
+			progress_add(job->progress, n);
+	}
+
+	MappedWindow_Close(&w);
+	free(buf);
+	return rc;
+}
@@ -0,0 +1,14 @@
+#ifndef _AUDIO_H_
+#define _AUDIO_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "extract.h"
+
+// Bytes in one stereo 16-bit sample.
+#define AUDIO_SAMPLE_LEN 4
+
+int extract_audio(const struct extract_job_s *job, int32_t offset, bool swap);
+
+/* _AUDIO_H_ */
+#endif
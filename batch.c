@@ -0,0 +1,897 @@
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "batch.h"
+#include "digest.h"
+#include "extract.h"
+#include "hash.h"
+#include "libmds.h"
+#include "manifest.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * Converts many images at once. Each image starts out as one task that
+ * opens it; that task then splits the copying into chunks of sectors,
+ * so that one big image can keep every thread busy. Each thread has its
+ * own queue: it works from the newest end of its own, and when that runs
+ * dry it steals from the oldest end of the others'. Tasks reading from a
+ * device that already has per_device of them running are passed over.
+ *
+ * With a manifest, images that haven't changed since it was written are
+ * skipped. Each chunk's output is hashed as it's written, and the ISO's
+ * hash is the SHA-1 of those. An image whose .mds file and MDF size
+ * match another's is hashed without writing anything, and if the hash
+ * matches too, it gets a clone of the other's ISO.
+ */
+
+// Sectors copied by one task.
+#define CHUNK_SECTORS	16384
+// The task that opens an image, rather than copying part of it.
+#define OPEN_TASK	UINT64_MAX
+// Sectors read at a time when only hashing.
+#define HASH_BATCH	256
+
+enum batch_mode_e {
+	JOB_CONVERT,
+	JOB_CHECK,		// only hash it, to compare with a copy's ISO
+};
+
+struct batch_job_s {
+	struct batch_result_s *res;
+	unsigned dev;		// index into batch_s.devs
+	struct mds_ctx *ctx;
+	unsigned track;
+	struct mds_track_info_s info;
+	enum batch_mode_e mode;
+	int out_fd;
+	uint64_t numchunks;
+	uint64_t left;		// tasks not finished yet
+	struct timespec start;
+	uint8_t (*chunk_hashes)[MANIFEST_HASH_LEN];	// with a manifest
+	struct manifest_entry_s entry;	// to add to the manifest
+	char *copyof;		// the ISO this may be a copy of
+	uint64_t copy_size;
+	int64_t copy_mtime;
+	uint8_t copy_hash[MANIFEST_HASH_LEN];
+	bool replace;		// its ISO is ours to overwrite
+};
+
+struct batch_task_s {
+	struct batch_job_s *job;
+	uint64_t chunk;
+};
+
+struct batch_deque_s {
+	struct batch_task_s *tasks;
+	size_t n;
+	size_t max;
+};
+
+struct batch_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const struct batch_opts_s *opts;
+	struct batch_result_s *results;
+	unsigned *devidx;	// device of each result
+	size_t numresults;
+	size_t maxresults;
+	dev_t *devs;
+	unsigned numdevs;
+	unsigned *active;	// tasks running per device
+	struct batch_job_s *jobs;
+	struct batch_deque_s *deques;	// one per worker
+	unsigned nworkers;
+	uint64_t pending;	// tasks queued or running
+};
+
+struct batch_worker_s {
+	pthread_t thread;
+	struct batch_s *b;
+	unsigned id;
+};
+
+static const char *basename_of(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+/* foo.mds becomes foo.iso, in outdir or else next to it. */
+static char *iso_name(const char *mdsfile, const char *outdir)
+{
+	const char *base = basename_of(mdsfile);
+	size_t dirlen = outdir ? strlen(outdir) : (size_t)(base - mdsfile);
+	size_t baselen = strlen(base);
+	char *name;
+
+	if ((baselen > 4) && !strcasecmp(base + baselen - 4, ".mds"))
+		baselen -= 4;
+	name = malloc(dirlen + 1 + baselen + sizeof(".iso"));
+	if (!name)
+		return NULL;
+	if (outdir)
+		sprintf(name, "%s/%.*s.iso", outdir, (int)baselen, base);
+	else
+		sprintf(name, "%.*s%.*s.iso", (int)dirlen, mdsfile, (int)baselen, base);
+	return name;
+}
+
+static int deque_reserve(struct batch_deque_s *d, size_t more)
+{
+	struct batch_task_s *tasks;
+	size_t max = d->max ? d->max : 16;
+
+	if (d->n + more <= d->max)
+		return 0;
+	while (max < d->n + more)
+		max *= 2;
+	tasks = realloc(d->tasks, max * sizeof(*tasks));
+	if (!tasks)
+		return -1;
+	d->tasks = tasks;
+	d->max = max;
+	return 0;
+}
+
+static int add_image(struct batch_s *b, const char *mdsfile)
+{
+	struct batch_result_s *r;
+	struct stat sb;
+	unsigned dev;
+
+	if (b->numresults == b->maxresults) {
+		size_t max = b->maxresults ? b->maxresults * 2 : 16;
+		struct batch_result_s *results = realloc(b->results, max * sizeof(*results));
+		unsigned *devidx;
+
+		if (!results)
+			return -1;
+		b->results = results;
+		devidx = realloc(b->devidx, max * sizeof(*devidx));
+		if (!devidx)
+			return -1;
+		b->devidx = devidx;
+		b->maxresults = max;
+	}
+	r = &b->results[b->numresults];
+	*r = (struct batch_result_s){ .mdsfile = strdup(mdsfile) };
+	r->isofile = iso_name(mdsfile, b->opts->outdir);
+	if (!r->mdsfile || !r->isofile) {
+		free(r->mdsfile);
+		free(r->isofile);
+		return -1;
+	}
+	b->devidx[b->numresults++] = 0;
+
+	if (stat(mdsfile, &sb)) {
+		r->what = "couldn't open image";
+		r->err = errno;
+		return 0;
+	}
+	for (size_t i = 0; i < b->numresults - 1; i++) {
+		if (!strcmp(b->results[i].isofile, r->isofile)) {
+			r->what = "same output file as an earlier image";
+			return 0;
+		}
+	}
+	for (dev = 0; (dev < b->numdevs) && (b->devs[dev] != sb.st_dev); dev++)
+		;
+	if (dev == b->numdevs) {
+		dev_t *devs = realloc(b->devs, (b->numdevs + 1) * sizeof(*devs));
+		if (!devs)
+			return -1;
+		b->devs = devs;
+		b->devs[b->numdevs++] = sb.st_dev;
+	}
+	b->devidx[b->numresults - 1] = dev;
+	return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Every .mds file in dir, in order by name. */
+static int read_dir(struct batch_s *b, const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	char **names = NULL;
+	size_t n = 0, max = 0;
+	int rc = 0;
+
+	if (!d)
+		return -1;
+	while ((de = readdir(d))) {
+		size_t len = strlen(de->d_name);
+		char *name;
+
+		if ((len <= 4) || strcasecmp(de->d_name + len - 4, ".mds"))
+			continue;
+		if (n == max) {
+			char **more = realloc(names, (max ? max * 2 : 16) * sizeof(*names));
+			if (!more) {
+				rc = -1;
+				break;
+			}
+			names = more;
+			max = max ? max * 2 : 16;
+		}
+		name = malloc(strlen(dir) + 1 + len + 1);
+		if (!name) {
+			rc = -1;
+			break;
+		}
+		sprintf(name, "%s/%s", dir, de->d_name);
+		names[n++] = name;
+	}
+	closedir(d);
+	if (!rc)
+		qsort(names, n, sizeof(*names), compare_names);
+	for (size_t i = 0; i < n; i++) {
+		if (!rc)
+			rc = add_image(b, names[i]);
+		free(names[i]);
+	}
+	free(names);
+	return rc;
+}
+
+/* A directory, or a file naming one .mds file per line; - is stdin. */
+static int read_list(struct batch_s *b, const char *list)
+{
+	bool is_stdin = !strcmp(list, "-");
+	struct stat sb;
+	FILE *f;
+	char *line = NULL;
+	size_t max = 0;
+	ssize_t len;
+	int rc = 0;
+
+	if (!is_stdin && !stat(list, &sb) && S_ISDIR(sb.st_mode))
+		return read_dir(b, list);
+	f = is_stdin ? stdin : fopen(list, "r");
+	if (!f)
+		return -1;
+	while (!rc && ((len = getline(&line, &max, f)) != -1)) {
+		while (len && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+			line[--len] = '\0';
+		if (!len || (line[0] == '#'))
+			continue;
+		rc = add_image(b, line);
+	}
+	if (!rc && ferror(f))
+		rc = -1;
+	free(line);
+	if (!is_stdin)
+		fclose(f);
+	return rc;
+}
+
+/*
+ * Take a task whose device has room: our own newest first, then the
+ * oldest of everyone else's. Tasks of images that have already failed
+ * are always taken, to be thrown away.
+ */
+static bool take_task(struct batch_s *b, unsigned id, struct batch_task_s *t)
+{
+	for (unsigned i = 0; i < b->nworkers; i++) {
+		struct batch_deque_s *d = &b->deques[(id + i) % b->nworkers];
+
+		for (size_t k = 0; k < d->n; k++) {
+			size_t j = i ? k : d->n - 1 - k;
+			struct batch_task_s *c = &d->tasks[j];
+
+			if (!c->job->res->what && (b->active[c->job->dev] >= b->opts->per_device))
+				continue;
+			*t = *c;
+			memmove(c, c + 1, (d->n - j - 1) * sizeof(*c));
+			d->n--;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Queue the chunks of an image that just opened on worker id. Called locked. */
+static int queue_chunks(struct batch_s *b, unsigned id, struct batch_job_s *job)
+{
+	struct batch_deque_s *d = &b->deques[id];
+	uint64_t n = job->numchunks;
+
+	if (deque_reserve(d, n))
+		return -1;
+	// Last to first, so this worker starts at the front of the image
+	// and thieves take from the back.
+	for (uint64_t c = n; c-- > 0; )
+		d->tasks[d->n++] = (struct batch_task_s){ .job = job, .chunk = c };
+	job->left += n;
+	b->pending += n;
+	return 0;
+}
+
+static int64_t mtime_ns(const struct stat *sb)
+{
+	return (int64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+}
+
+static bool same_file(const char *filename, uint64_t size, int64_t mtime)
+{
+	struct stat sb;
+
+	return !stat(filename, &sb) && ((uint64_t)sb.st_size == size) && (mtime_ns(&sb) == mtime);
+}
+
+static int hash_file(const char *filename, uint8_t *hash)
+{
+	uint8_t buf[65536], out[DIGEST_MAX_LEN];
+	struct digest_s d;
+	ssize_t got;
+	int fd, e;
+
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd == -1)
+		return -1;
+	digest_init(&d, DIGEST_SHA1);
+	while (((got = read(fd, buf, sizeof(buf))) > 0) || ((got == -1) && (errno == EINTR))) {
+		if (got > 0)
+			digest_update(&d, buf, got);
+	}
+	e = errno;
+	close(fd);
+	if (got) {
+		errno = e;
+		return -1;
+	}
+	digest_final(&d, out);
+	memcpy(hash, out, MANIFEST_HASH_LEN);
+	return 0;
+}
+
+/* Fill in what the manifest keeps about the image. */
+static int identify(struct batch_job_s *job, const char **what)
+{
+	struct manifest_entry_s *e = &job->entry;
+	unsigned nfiles = mds_track_num_files(job->ctx, job->track);
+	struct stat sb;
+
+	e->mdsfile = job->res->mdsfile;
+	e->isofile = job->res->isofile;
+	if (stat(e->mdsfile, &sb) || hash_file(e->mdsfile, e->mds_hash)) {
+		*what = "couldn't read image";
+		return -1;
+	}
+	e->mds_size = sb.st_size;
+	e->mds_mtime = mtime_ns(&sb);
+	if (!nfiles) {
+		*what = "couldn't open mdf file";
+		errno = ENOENT;
+		return -1;
+	}
+	for (unsigned i = 0; i < nfiles; i++) {
+		if (stat(mds_track_part_filename(job->ctx, job->track, i), &sb)) {
+			*what = "couldn't open mdf file";
+			return -1;
+		}
+		e->mdf_size += sb.st_size;
+		if (!i || (mtime_ns(&sb) > e->mdf_mtime))
+			e->mdf_mtime = mtime_ns(&sb);
+	}
+	return 0;
+}
+
+/*
+ * Look the image up in the manifest. If neither it nor its ISO has
+ * changed, there is nothing to do, and if only the image has, its old
+ * ISO can be replaced without -f. If it looks like a copy of another
+ * image whose ISO is still as it was, check it against that instead of
+ * converting it.
+ */
+static void check_manifest(struct batch_s *b, struct batch_job_s *job)
+{
+	const struct manifest_entry_s *me = &job->entry;
+	struct manifest_entry_s *e, *copy;
+	uint64_t iso_size = 0;
+	int64_t iso_mtime = 0;
+	bool known = false, same = false;
+
+	pthread_mutex_lock(&b->lock);
+	e = manifest_find(b->opts->manifest, me->mdsfile);
+	if (e && !strcmp(e->isofile, me->isofile)) {
+		known = true;
+		same = (e->mds_size == me->mds_size) && (e->mds_mtime == me->mds_mtime)
+			&& (e->mdf_size == me->mdf_size) && (e->mdf_mtime == me->mdf_mtime)
+			&& !memcmp(e->mds_hash, me->mds_hash, MANIFEST_HASH_LEN);
+		iso_size = e->iso_size;
+		iso_mtime = e->iso_mtime;
+	}
+	pthread_mutex_unlock(&b->lock);
+	if (known && same_file(me->isofile, iso_size, iso_mtime)) {
+		if (same) {
+			job->res->unchanged = true;
+			job->res->bytes = iso_size;
+			return;
+		}
+		job->replace = true;
+	}
+
+	pthread_mutex_lock(&b->lock);
+	copy = manifest_find_copy(b->opts->manifest, me->mds_hash, me->mdf_size, me->isofile);
+	if (copy) {
+		job->copyof = strdup(copy->isofile);
+		job->copy_size = copy->iso_size;
+		job->copy_mtime = copy->iso_mtime;
+		memcpy(job->copy_hash, copy->iso_hash, MANIFEST_HASH_LEN);
+	}
+	pthread_mutex_unlock(&b->lock);
+	if (job->copyof && same_file(job->copyof, job->copy_size, job->copy_mtime)) {
+		job->mode = JOB_CHECK;
+	} else {
+		free(job->copyof);
+		job->copyof = NULL;
+	}
+}
+
+static int open_output(struct batch_s *b, struct batch_job_s *job, const char **what)
+{
+	int flags = O_WRONLY | O_CREAT | O_BINARY | ((b->opts->force || job->replace) ? O_TRUNC : O_EXCL);
+
+	job->out_fd = open(job->res->isofile, flags, 0666);
+	if (job->out_fd == -1) {
+		if (errno == EEXIST) {
+			*what = "output file already exists; use -f to force overwrite";
+			errno = 0;
+		} else {
+			*what = "couldn't open output file";
+		}
+		return -1;
+	}
+	// Chunks finish in any order, so make room for all of them now
+	// rather than have each extend the file and race the others.
+	if (b->opts->sparse && ftruncate(job->out_fd, (uint64_t)job->info.length * job->info.data_len)) {
+		*what = "couldn't extend output file";
+		return -1;
+	}
+	return 0;
+}
+
+static int open_job(struct batch_s *b, struct batch_job_s *job, const char **what)
+{
+	struct batch_result_s *r = job->res;
+	const char *msg;
+	int t;
+
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	job->ctx = mds_open(r->mdsfile, &msg);
+	if (!job->ctx) {
+		*what = msg ? msg : "couldn't open image";
+		if (msg)
+			errno = 0;
+		return -1;
+	}
+	t = mds_find_data_track(job->ctx);
+	if (t == -1) {
+		*what = "no data track found";
+		errno = 0;
+		return -1;
+	}
+	job->track = t;
+	mds_get_track(job->ctx, t, &job->info);
+	if (!job->info.data_len) {
+		*what = "unknown track mode";
+		errno = 0;
+		return -1;
+	}
+	job->numchunks = ((uint64_t)job->info.length + CHUNK_SECTORS - 1) / CHUNK_SECTORS;
+	if (b->opts->manifest) {
+		if (identify(job, what))
+			return -1;
+		check_manifest(b, job);
+		if (r->unchanged) {
+			job->numchunks = 0;
+			return 0;
+		}
+		job->chunk_hashes = calloc(job->numchunks ? job->numchunks : 1, MANIFEST_HASH_LEN);
+		if (!job->chunk_hashes) {
+			*what = "couldn't start hashing";
+			return -1;
+		}
+	}
+	if (mds_open_data(job->ctx, (mds_track_num_files(job->ctx, t) > 1) ? NULL : mds_track_filename(job->ctx, t))) {
+		*what = "couldn't open mdf file";
+		return -1;
+	}
+	if (job->mode == JOB_CONVERT)
+		return open_output(b, job, what);
+	return 0;
+}
+
+/* Hash a chunk's data without writing it, as copy_chunk() would. */
+static int hash_chunk(struct batch_job_s *job, uint64_t chunk, uint64_t first, uint64_t count)
+{
+	uint8_t *buf = malloc((size_t)HASH_BATCH * job->info.data_len);
+	uint8_t out[DIGEST_MAX_LEN];
+	struct digest_s d;
+
+	if (!buf)
+		return -1;
+	digest_init(&d, DIGEST_SHA1);
+	for (uint64_t done = 0; done < count; ) {
+		uint32_t want = (count - done < HASH_BATCH) ? count - done : HASH_BATCH;
+		ssize_t got = mds_read_sectors(job->ctx, job->track, job->info.lba + first + done,
+			want, buf, MDS_READ_COOKED);
+
+		if (got <= 0) {
+			if (!got)
+				errno = EIO;
+			free(buf);
+			return -1;
+		}
+		digest_update(&d, buf, got * job->info.data_len);
+		done += got;
+	}
+	free(buf);
+	digest_final(&d, out);
+	memcpy(job->chunk_hashes[chunk], out, MANIFEST_HASH_LEN);
+	return 0;
+}
+
+static int copy_chunk(struct batch_s *b, struct batch_job_s *job, uint64_t chunk, const char **what)
+{
+	uint64_t first = chunk * CHUNK_SECTORS;
+	struct extract_job_s ej = {
+		.in_fd = -1,
+		.stride = job->info.secsize,
+		.data_off = job->info.data_off,
+		.data_len = job->info.data_len,
+		.numblocks = (job->info.length - first < CHUNK_SECTORS) ? job->info.length - first : CHUNK_SECTORS,
+		.out_fd = job->out_fd,
+		.out_off = first * job->info.data_len,
+		.sparse = b->opts->sparse,
+	};
+	const enum digest_e alg = DIGEST_SHA1;
+	struct hash_result_s hr;
+	int rc, e;
+
+	if (job->mode == JOB_CHECK) {
+		*what = "couldn't read image";
+		return hash_chunk(job, chunk, first, ej.numblocks);
+	}
+	if (job->chunk_hashes) {
+		ej.hash = hash_start(&alg, 1);
+		if (!ej.hash) {
+			*what = "couldn't start hashing";
+			return -1;
+		}
+	}
+	*what = "extraction failed";
+	rc = extract_mds(job->ctx, job->info.lba + first, &ej);
+	e = errno;
+	if (ej.hash) {
+		hash_finish(ej.hash, &hr);
+		memcpy(job->chunk_hashes[chunk], hr.value, MANIFEST_HASH_LEN);
+	}
+	errno = e;
+	return rc;
+}
+
+static void iso_hash(const struct batch_job_s *job, uint8_t *hash)
+{
+	uint8_t out[DIGEST_MAX_LEN];
+	struct digest_s d;
+
+	digest_init(&d, DIGEST_SHA1);
+	digest_update(&d, job->chunk_hashes, job->numchunks * MANIFEST_HASH_LEN);
+	digest_final(&d, out);
+	memcpy(hash, out, MANIFEST_HASH_LEN);
+}
+
+static bool copy_unchanged(struct batch_job_s *job, int fd)
+{
+	struct stat sb;
+
+	return !fstat(fd, &sb) && ((uint64_t)sb.st_size == job->copy_size) && (mtime_ns(&sb) == job->copy_mtime);
+}
+
+/*
+ * Fill the ISO in from its copy's. Returns 1 if the copy's ISO changed
+ * before or while it was read, as it might if that image is also being
+ * converted again.
+ */
+static int clone_output(struct batch_s *b, struct batch_job_s *job, const char **what)
+{
+	int in_fd, e;
+
+	in_fd = open(job->copyof, O_RDONLY | O_BINARY);
+	if (in_fd == -1) {
+		*what = "couldn't open the ISO of its copy";
+		return -1;
+	}
+	if (!copy_unchanged(job, in_fd)) {
+		close(in_fd);
+		return 1;
+	}
+	if (open_output(b, job, what)) {
+		e = errno;
+		close(in_fd);
+		errno = e;
+		return -1;
+	}
+	// copy_range() makes a reflink where the filesystem can.
+	if (copy_range(in_fd, 0, job->out_fd, 0, (uint64_t)job->info.length * job->info.data_len)) {
+		*what = "couldn't clone the ISO of its copy";
+		e = errno;
+		close(in_fd);
+		errno = e;
+		return -1;
+	}
+	if (!copy_unchanged(job, in_fd)) {
+		// Start over on the file we just made.
+		close(in_fd);
+		close(job->out_fd);
+		job->out_fd = -1;
+		job->replace = true;
+		return 1;
+	}
+	close(in_fd);
+	return 0;
+}
+
+/*
+ * Called by whichever task of an image finishes last. An image that
+ * turns out not to be a copy after all is queued again to be converted.
+ */
+static void finish_job(struct batch_s *b, unsigned id, struct batch_job_s *job)
+{
+	struct batch_result_s *r = job->res;
+	struct manifest_entry_s *e = &job->entry;
+	const char *what;
+	struct timespec end;
+	struct stat sb;
+
+	if (!r->what && (job->mode == JOB_CHECK)) {
+		int rc = 1;
+
+		iso_hash(job, e->iso_hash);
+		if (!memcmp(e->iso_hash, job->copy_hash, MANIFEST_HASH_LEN))
+			rc = clone_output(b, job, &what);
+		if (rc < 0) {
+			r->what = what;
+			r->err = errno;
+		} else if (!rc) {
+			r->copyof = job->copyof;
+			job->copyof = NULL;
+		} else {
+			job->mode = JOB_CONVERT;
+			if (open_output(b, job, &what)) {
+				r->what = what;
+				r->err = errno;
+			} else if (job->numchunks) {
+				int rc;
+
+				pthread_mutex_lock(&b->lock);
+				rc = queue_chunks(b, id, job);
+				pthread_mutex_unlock(&b->lock);
+				if (!rc)
+					return;
+				r->what = "couldn't queue image";
+				r->err = errno;
+			}
+		}
+	}
+
+	if ((job->out_fd != -1) && close(job->out_fd) && !r->what) {
+		r->what = "couldn't close output file";
+		r->err = errno;
+	}
+	// Don't leave half an image behind to be mistaken for a whole one.
+	if (r->what && (job->out_fd != -1))
+		unlink(r->isofile);
+
+	// If this can't be recorded, the image is only converted again
+	// next time.
+	if (!r->what && !r->unchanged && b->opts->manifest && !stat(r->isofile, &sb)) {
+		if (job->mode == JOB_CONVERT)
+			iso_hash(job, e->iso_hash);
+		e->iso_size = sb.st_size;
+		e->iso_mtime = mtime_ns(&sb);
+		pthread_mutex_lock(&b->lock);
+		manifest_add(b->opts->manifest, e);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	mds_close(job->ctx);
+	free(job->chunk_hashes);
+	free(job->copyof);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	r->seconds = (end.tv_sec - job->start.tv_sec) + (end.tv_nsec - job->start.tv_nsec) / 1e9;
+	if (!r->what && !r->unchanged)
+		r->bytes = (uint64_t)job->info.length * job->info.data_len;
+}
+
+static void *batch_worker(void *arg)
+{
+	struct batch_worker_s *w = arg;
+	struct batch_s *b = w->b;
+
+	pthread_mutex_lock(&b->lock);
+	for (;;) {
+		struct batch_task_s t;
+		struct batch_job_s *job;
+		const char *what = NULL;
+		bool skip, last;
+		int rc = 0, e = 0;
+
+		while (b->pending && !take_task(b, w->id, &t))
+			pthread_cond_wait(&b->cond, &b->lock);
+		if (!b->pending)
+			break;
+		job = t.job;
+		skip = (job->res->what != NULL);
+		if (!skip)
+			b->active[job->dev]++;
+		pthread_mutex_unlock(&b->lock);
+
+		if (!skip && (t.chunk == OPEN_TASK))
+			rc = open_job(b, job, &what);
+		else if (!skip)
+			rc = copy_chunk(b, job, t.chunk, &what);
+		e = errno;
+
+		pthread_mutex_lock(&b->lock);
+		if (!skip) {
+			b->active[job->dev]--;
+			if (!rc && (t.chunk == OPEN_TASK) && queue_chunks(b, w->id, job)) {
+				rc = -1;
+				what = "couldn't queue image";
+				e = errno;
+			}
+			if (rc && !job->res->what) {
+				job->res->what = what;
+				job->res->err = e;
+			}
+		}
+		last = !--job->left;
+		pthread_mutex_unlock(&b->lock);
+
+		if (last)
+			finish_job(b, w->id, job);
+
+		pthread_mutex_lock(&b->lock);
+		b->pending--;
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+/*
+ * Convert the first data track of every image in list, a directory or
+ * a file of .mds names, to an ISO, on nthreads threads. A result is
+ * handed back for each image, in list order, whether it worked or not;
+ * only trouble with the list itself makes this fail.
+ */
+int batch_convert(const char *list, const struct batch_opts_s *opts,
+	struct batch_result_s **results, size_t *numresults, const char **errmsg)
+{
+	struct batch_opts_s o = *opts;
+	struct batch_s b = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.opts = &o,
+	};
+	struct batch_worker_s *workers = NULL;
+	unsigned started;
+	int e = 0;
+
+	*results = NULL;
+	*numresults = 0;
+	*errmsg = NULL;
+	if (!o.nthreads)
+		o.nthreads = 1;
+	if (!o.per_device)
+		o.per_device = UINT_MAX;
+
+	if (read_list(&b, list))
+		goto out_error;
+	if (!b.numresults) {
+		*errmsg = "no images to convert";
+		errno = ENOENT;
+		goto out_error;
+	}
+	b.nworkers = o.nthreads;
+	b.jobs = calloc(b.numresults, sizeof(*b.jobs));
+	b.deques = calloc(b.nworkers, sizeof(*b.deques));
+	b.active = calloc(b.numdevs ? b.numdevs : 1, sizeof(*b.active));
+	workers = calloc(b.nworkers, sizeof(*workers));
+	if (!b.jobs || !b.deques || !b.active || !workers)
+		goto out_error;
+
+	// Deal the images out to the workers to start with.
+	for (size_t i = 0, k = 0; i < b.numresults; i++) {
+		struct batch_job_s *job = &b.jobs[i];
+		struct batch_deque_s *d = &b.deques[k % b.nworkers];
+
+		job->res = &b.results[i];
+		job->dev = b.devidx[i];
+		job->out_fd = -1;
+		if (job->res->what)
+			continue;
+		if (deque_reserve(d, 1))
+			goto out_error;
+		d->tasks[d->n++] = (struct batch_task_s){ .job = job, .chunk = OPEN_TASK };
+		job->left = 1;
+		b.pending++;
+		k++;
+	}
+
+	// Any one worker can get through all of it, so carry on with
+	// however many started.
+	for (started = 0; started < b.nworkers; started++) {
+		workers[started].b = &b;
+		workers[started].id = started;
+		if (b.nworkers == 1) {
+			batch_worker(&workers[started]);
+			continue;
+		}
+		e = pthread_create(&workers[started].thread, NULL, batch_worker, &workers[started]);
+		if (e)
+			break;
+	}
+	if (!started) {
+		errno = e;
+		goto out_error;
+	}
+	for (unsigned i = 0; (b.nworkers > 1) && (i < started); i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (unsigned i = 0; i < b.nworkers; i++)
+		free(b.deques[i].tasks);
+	free(b.deques);
+	free(b.jobs);
+	free(b.active);
+	free(b.devs);
+	free(b.devidx);
+	free(workers);
+	*results = b.results;
+	*numresults = b.numresults;
+	return 0;
+
+out_error:
+	e = errno;
+	for (unsigned i = 0; b.deques && (i < b.nworkers); i++)
+		free(b.deques[i].tasks);
+	free(b.deques);
+	free(b.jobs);
+	free(b.active);
+	free(b.devs);
+	free(b.devidx);
+	free(workers);
+	batch_free(b.results, b.numresults);
+	errno = e;
+	return -1;
+}
+
+void batch_free(struct batch_result_s *results, size_t numresults)
+{
+	for (size_t i = 0; i < numresults; i++) {
+		free(results[i].mdsfile);
+		free(results[i].isofile);
+		free(results[i].copyof);
+	}
+	free(results);
+}
@@ -0,0 +1,34 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct batch_opts_s {
+	const char *outdir;	// where the ISOs go; NULL for next to each image
+	bool force;		// overwrite existing files
+	bool sparse;		// leave holes for blank sectors
+	unsigned nthreads;
+	unsigned per_device;	// tasks at once reading from any one device
+	struct manifest_s *manifest;	// skip what it has, and add the rest
+};
+
+/* How one image went. */
+struct batch_result_s {
+	char *mdsfile;
+	char *isofile;
+	uint64_t bytes;
+	double seconds;
+	const char *what;	// why it failed, or NULL if it didn't
+	int err;		// errno to go with what, or 0
+	bool unchanged;		// the manifest had it; nothing was done
+	char *copyof;		// the ISO this one was cloned from
+};
+
+int batch_convert(const char *list, const struct batch_opts_s *opts,
+	struct batch_result_s **results, size_t *numresults, const char **errmsg);
+void batch_free(struct batch_result_s *results, size_t numresults);
+
+/* _BATCH_H_ */
+#endif
@@ -0,0 +1,104 @@
+#!/bin/sh
+# Time each way mds2iso can extract an image, on synthetic images from
+# mkmds. Run it through "make bench".
+#
+# MODES	mkmds modes to test (default: all of them)
+# SIZES	mkmds sizes: cd, dvd5, dvd9, or sector counts (default: cd)
+# BENCHDIR	where images and outputs go; images are kept between runs
+#		(default: bench)
+# RUNS	warm runs per path, after the cold one (default: 2)
+#
+# Cold runs drop the page cache first. That needs root; without it, the
+# image's pages are dropped with dd's nocache flag, which is close. The
+# syscalls column needs strace.
+
+set -e
+
+MODES=${MODES:-dvd audio mode1 mode2 form1 form2 mode2sub}
+SIZES=${SIZES:-cd}
+BENCHDIR=${BENCHDIR:-bench}
+RUNS=${RUNS:-2}
+MDS2ISO=${MDS2ISO:-./mds2iso}
+MKMDS=${MKMDS:-./mkmds}
+BENCHRUN=${BENCHRUN:-./benchrun}
+NPROC=$(nproc 2>/dev/null || echo 1)
+HAVE_STRACE=
+command -v strace >/dev/null 2>&1 && HAVE_STRACE=1
+
+mkdir -p "$BENCHDIR"
+report="$BENCHDIR/report"
+
+drop_cache() {
+	sync
+	if ! { echo 3 > /proc/sys/vm/drop_caches; } 2>/dev/null; then
+		for f in "$@"; do
+			dd if="$f" iflag=nocache count=0 status=none
+		done
+	fi
+}
+
+# run <image> <path> <cache> <outfile> <args...>
+run() {
+	image=$1 path=$2 cache=$3 out=$4
+	shift 4
+	rm -f "$out" "$report"
+	if [ "$path" = stream ]; then
+		set -- sh -c 'exec "$0" "$@" > "'"$out"'"' "$MDS2ISO" "$@"
+	else
+		set -- "$MDS2ISO" "$@"
+	fi
+	if ! "$BENCHRUN" "$report" "$@" 2>/dev/null; then
+		printf '%-22s %-8s %-5s %s\n' "$image" "$path" "$cache" failed
+		return
+	fi
+	calls=-
+	if [ -n "$HAVE_STRACE" ]; then
+		rm -f "$out"
+		# The errors column is blank unless some call failed, so find
+		# calls by where the header puts it; "% time" is two words
+		# there but one number below.
+		calls=$(strace -f -c -o /dev/stderr "$@" 2>&1 >/dev/null |
+			awk '$1 == "%" { for (i = 1; i <= NF; i++) if ($i == "calls") col = i - 1 }
+			     col && $NF == "total" { print $col }')
+	fi
+	bytes=$(wc -c < "$out")
+	read wall user sys rss < "$report"
+	mbs=$(awk -v b="$bytes" -v s="$wall" \
+		'BEGIN { printf "%.1f", (s > 0) ? b / s / 1e6 : 0 }')
+	printf '%-22s %-8s %-5s %8s %8s %8s %8s %9s %9s\n' \
+		"$image" "$path" "$cache" "$mbs" "$wall" "$user" "$sys" "$rss" "$calls"
+}
+
+printf '%-22s %-8s %-5s %8s %8s %8s %8s %9s %9s\n' \
+	image path cache MB/s wall user sys rss_kB syscalls
+for size in $SIZES; do
+	for mode in $MODES; do
+		base="$BENCHDIR/$mode-$size"
+		if [ ! -f "$base.mds" ] || [ ! -f "$base.mdf" ]; then
+			"$MKMDS" -m "$mode" -n "$size" "$base"
+		fi
+		out="$BENCHDIR/out.iso"
+		paths="mmap threads uring stream cue"
+		# Without a data track there's only the cue sheet.
+		[ "$mode" = audio ] && paths=cue
+		for path in $paths; do
+			case $path in
+			mmap)	set -- -f -j 1 -b mmap -i "$base.mds" -o "$out" ;;
+			threads) set -- -f -j "$NPROC" -i "$base.mds" -o "$out" ;;
+			uring)	set -- -f -j 1 -b uring -i "$base.mds" -o "$out" ;;
+			stream)	set -- -i "$base.mds" -o - ;;
+			cue)	set -- -f -i "$base.mds" --cue "$BENCHDIR/out.cue" ;;
+			esac
+			[ $path = cue ] && out="$BENCHDIR/out.bin"
+			drop_cache "$base.mdf"
+			run "$mode-$size" $path cold "$out" "$@"
+			i=0
+			while [ $i -lt "$RUNS" ]; do
+				run "$mode-$size" $path warm "$out" "$@"
+				i=$((i + 1))
+			done
+		done
+		rm -f "$BENCHDIR"/out.*
+	done
+done
+rm -f "$report"
@@ -0,0 +1,71 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "err.h"
+#include "progname.h"
+#include "stdnoreturn.h"
+
+/*
+ * benchrun runs a command and appends one line to a report file: wall,
+ * user and system seconds, and peak RSS in KiB. It exits with the
+ * command's status. bench.sh uses it where GNU time might not exist.
+ */
+
+static void noreturn usage(void);
+
+static double tv_seconds(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec start, end;
+	struct rusage ru;
+	FILE *report;
+	pid_t pid;
+	int status;
+
+	progname_init(argc, argv);
+	if (argc < 3)
+		usage();
+
+	report = fopen(argv[1], "a");
+	if (!report)
+		err(1, "couldn't open '%s'", argv[1]);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid == -1)
+		err(1, "couldn't fork");
+	if (pid == 0) {
+		execvp(argv[2], &argv[2]);
+		err(127, "couldn't run '%s'", argv[2]);
+	}
+	while (wait4(pid, &status, 0, &ru) == -1) {
+		if (errno != EINTR)
+			err(1, "couldn't wait for '%s'", argv[2]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	fprintf(report, "%.3f %.3f %.3f %ld\n",
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+		tv_seconds(ru.ru_utime), tv_seconds(ru.ru_stime), ru.ru_maxrss);
+	if (fclose(report))
+		err(1, "couldn't write '%s'", argv[1]);
+
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+static void noreturn usage(void)
+{
+	(void)fprintf(stderr, "usage: %s <report> <command> [args...]\n", __progname);
+	exit(EXIT_FAILURE);
+}
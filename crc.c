@@ -0,0 +1,42 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "crc.h"
+
+void crc32_table_init(crc32_table_t table, uint32_t poly)
+{
+	for (unsigned i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (unsigned k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+		table[0][i] = crc;
+	}
+	for (unsigned i = 0; i < 256; i++) {
+		for (unsigned t = 1; t < 8; t++)
+			table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+	}
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Slice-by-8: eight table lookups fold in eight bytes at a time. */
+uint32_t crc32_update(const crc32_table_t table, uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint32_t a = crc ^ le32(p);
+		uint32_t b = le32(p + 4);
+
+		crc = table[7][a & 0xff] ^ table[6][(a >> 8) & 0xff]
+			^ table[5][(a >> 16) & 0xff] ^ table[4][a >> 24]
+			^ table[3][b & 0xff] ^ table[2][(b >> 8) & 0xff]
+			^ table[1][(b >> 16) & 0xff] ^ table[0][b >> 24];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
@@ -0,0 +1,17 @@
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Table-driven CRC-32 for any reflected polynomial, eight bytes per
+ * step. The caller does any pre- and post-inversion.
+ */
+typedef uint32_t crc32_table_t[8][256];
+
+void crc32_table_init(crc32_table_t table, uint32_t poly);
+uint32_t crc32_update(const crc32_table_t table, uint32_t crc, const void *buf, size_t len);
+
+/* _CRC_H_ */
+#endif
@@ -0,0 +1,326 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "cso.h"
+#include "endian.h"
+#include "extract.h"
+#include "libmds.h"
+#include "progress.h"
+
+/*
+ * CSO (compressed ISO), version 1: a 24-byte header, an index of
+ * numblocks+1 little-endian offsets, then each 2048-byte block of the
+ * ISO as raw deflate data, or stored as is if that came out no smaller.
+ * Offsets are shifted right by align bits, and their top bit marks a
+ * stored block.
+ */
+
+#define CSO_BLOCK		2048
+#define CSO_HEADER_LEN		24
+#define CSO_PLAIN		0x80000000u
+// Blocks handed to a worker at a time.
+#define BATCH_BLOCKS		256
+
+struct cso_batch_s {
+	uint8_t *data;		// compressed blocks back to back
+	uint32_t len[BATCH_BLOCKS];
+	bool plain[BATCH_BLOCKS];
+	unsigned count;
+	bool done;
+};
+
+struct cso_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct mds_ctx *ctx;
+	unsigned track;
+	struct mds_track_info_s info;
+	int level;
+	uint64_t total;		// bytes of ISO
+	uint64_t numblocks;
+	uint64_t numbatches;
+	uint64_t next;		// next batch for a worker to take
+	uint64_t written;	// batches written out so far
+	unsigned nslots;
+	struct cso_batch_s *slots;	// batch n lives in slots[n % nslots]
+	int err;
+};
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	v = htole32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+/* Read the ISO bytes from off on, up to len of them, into buf. */
+static int read_iso(struct cso_s *c, uint8_t *sectors, uint8_t *buf, uint64_t off, size_t len)
+{
+	const unsigned dl = c->info.data_len;
+	uint64_t first = off / dl, last = (off + len - 1) / dl;
+	ssize_t got;
+
+	got = mds_read_sectors(c->ctx, c->track, c->info.lba + first, last - first + 1, sectors, MDS_READ_COOKED);
+	if (got != (ssize_t)(last - first + 1)) {
+		if (got >= 0)
+			errno = EIO;
+		return -1;
+	}
+	memcpy(buf, sectors + off % dl, len);
+	return 0;
+}
+
+static int compress_batch(struct cso_s *c, z_stream *z, uint8_t *sectors, uint8_t *iso,
+	uint64_t batch, struct cso_batch_s *b)
+{
+	uint64_t off = batch * BATCH_BLOCKS * CSO_BLOCK;
+	size_t len = (c->total - off < (uint64_t)BATCH_BLOCKS * CSO_BLOCK) ? c->total - off : BATCH_BLOCKS * CSO_BLOCK;
+	uint8_t *out = b->data;
+
+	if (read_iso(c, sectors, iso, off, len))
+		return -1;
+	b->count = (len + CSO_BLOCK - 1) / CSO_BLOCK;
+	for (unsigned i = 0; i < b->count; i++) {
+		size_t n = (len - i * CSO_BLOCK < CSO_BLOCK) ? len - i * CSO_BLOCK : CSO_BLOCK;
+		int rc;
+
+		if (deflateReset(z) != Z_OK) {
+			errno = ENOMEM;
+			return -1;
+		}
+		z->next_in = iso + i * CSO_BLOCK;
+		z->avail_in = n;
+		z->next_out = out;
+		z->avail_out = n;
+		rc = deflate(z, Z_FINISH);
+		if ((rc == Z_STREAM_END) && (z->total_out < n)) {
+			b->len[i] = z->total_out;
+			b->plain[i] = false;
+		} else {
+			memcpy(out, iso + i * CSO_BLOCK, n);
+			b->len[i] = n;
+			b->plain[i] = true;
+		}
+		out += b->len[i];
+	}
+	return 0;
+}
+
+static void *cso_worker(void *arg)
+{
+	struct cso_s *c = arg;
+	const size_t nsectors = (size_t)BATCH_BLOCKS * CSO_BLOCK / c->info.data_len + 2;
+	uint8_t *sectors = malloc(nsectors * c->info.data_len);
+	uint8_t *iso = malloc((size_t)BATCH_BLOCKS * CSO_BLOCK);
+	z_stream z = { .zalloc = Z_NULL };
+	bool zok = (deflateInit2(&z, c->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+
+	pthread_mutex_lock(&c->lock);
+	if ((!sectors || !iso || !zok) && !c->err)
+		c->err = ENOMEM;
+	for (;;) {
+		uint64_t batch;
+		struct cso_batch_s *b;
+		int rc;
+
+		while (!c->err && (c->next < c->numbatches) && (c->next >= c->written + c->nslots))
+			pthread_cond_wait(&c->cond, &c->lock);
+		if (c->err || (c->next == c->numbatches))
+			break;
+		batch = c->next++;
+		b = &c->slots[batch % c->nslots];
+		pthread_mutex_unlock(&c->lock);
+
+		rc = compress_batch(c, &z, sectors, iso, batch, b);
+
+		pthread_mutex_lock(&c->lock);
+		if (rc && !c->err)
+			c->err = errno;
+		b->done = true;
+		pthread_cond_broadcast(&c->cond);
+	}
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	if (zok)
+		deflateEnd(&z);
+	free(iso);
+	free(sectors);
+	return NULL;
+}
+
+/*
+ * Write a track's ISO to out_fd as CSO, compressing on nthreads threads.
+ * Batches of blocks are compressed in any order but written in order by
+ * the calling thread, at most a couple per thread ahead of the writer.
+ * The index is filled in last. out_fd must be seekable, and
+ * mds_open_data() must have been called. Each batch written is added to
+ * *progress, if given, as bytes of the ISO.
+ */
+int write_cso(struct mds_ctx *ctx, unsigned track, int out_fd, unsigned nthreads, int level,
+	uint64_t *progress)
+{
+	struct cso_s c = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.ctx = ctx,
+		.track = track,
+		.level = level,
+	};
+	pthread_t *threads = NULL;
+	uint32_t *index = NULL;
+	uint8_t hdr[CSO_HEADER_LEN] = { 'C', 'I', 'S', 'O' };
+	uint64_t pos, worst;
+	unsigned align = 0, started = 0;
+	int e = 0;
+
+	if (mds_get_track(ctx, track, &c.info))
+		return -1;
+	if (!c.info.data || !c.info.data_len) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (lseek(out_fd, 0, SEEK_SET) == -1)
+		return -1;
+	c.total = (uint64_t)c.info.length * c.info.data_len;
+	c.numblocks = (c.total + CSO_BLOCK - 1) / CSO_BLOCK;
+	c.numbatches = (c.numblocks + BATCH_BLOCKS - 1) / BATCH_BLOCKS;
+
+	// Offsets have 31 bits; shift them far enough that even an image
+	// that doesn't compress at all fits, padding to match.
+	pos = CSO_HEADER_LEN + (c.numblocks + 1) * 4;
+	for (worst = pos + c.total; (worst + c.numblocks * ((1u << align) - 1)) >> align > 0x7fffffff; )
+		align++;
+	if (align > 12) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (nthreads < 1)
+		nthreads = 1;
+	c.nslots = nthreads * 2;
+	c.slots = calloc(c.nslots, sizeof(*c.slots));
+	index = calloc(c.numblocks + 1, sizeof(*index));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!c.slots || !index || !threads)
+		goto out_error;
+	for (unsigned i = 0; i < c.nslots; i++) {
+		c.slots[i].data = malloc((size_t)BATCH_BLOCKS * CSO_BLOCK);
+		if (!c.slots[i].data)
+			goto out_error;
+	}
+
+	// Room for the header and index, filled in at the end.
+	if (ftruncate(out_fd, pos))
+		goto out_error;
+	for (started = 0; started < nthreads; started++) {
+		e = pthread_create(&threads[started], NULL, cso_worker, &c);
+		if (e) {
+			pthread_mutex_lock(&c.lock);
+			c.err = e;
+			pthread_cond_broadcast(&c.cond);
+			pthread_mutex_unlock(&c.lock);
+			break;
+		}
+	}
+
+	for (uint64_t batch = 0, block = 0; batch < c.numbatches; batch++) {
+		struct cso_batch_s *b = &c.slots[batch % c.nslots];
+		struct gather_s g;
+		uint8_t *p = b->data;
+		static const uint8_t pad[4096];
+
+		pthread_mutex_lock(&c.lock);
+		while (!c.err && !b->done)
+			pthread_cond_wait(&c.cond, &c.lock);
+		e = c.err;
+		pthread_mutex_unlock(&c.lock);
+		if (e)
+			break;
+
+		if (gather_init(&g, out_fd, pos)) {
+			e = errno;
+			break;
+		}
+		for (unsigned i = 0; !e && (i < b->count); i++, block++) {
+			size_t padlen = (-pos) & ((1u << align) - 1);
+
+			if (padlen && gather_add(&g, pad, padlen))
+				e = errno;
+			pos += padlen;
+			index[block] = htole32((uint32_t)(pos >> align) | (b->plain[i] ? CSO_PLAIN : 0));
+			if (!e && gather_add(&g, p, b->len[i]))
+				e = errno;
+			p += b->len[i];
+			pos += b->len[i];
+		}
+		if (!e && gather_flush(&g))
+			e = errno;
+		gather_free(&g);
+		if (!e) {
+			uint64_t end = (block * CSO_BLOCK < c.total) ? block * CSO_BLOCK : c.total;
+			progress_add(progress, end - (block - b->count) * CSO_BLOCK);
+		}
+
+		pthread_mutex_lock(&c.lock);
+		if (e && !c.err)
+			c.err = e;
+		b->done = false;
+		c.written++;
+		pthread_cond_broadcast(&c.cond);
+		pthread_mutex_unlock(&c.lock);
+		if (e)
+			break;
+	}
+
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	if (!e && started < nthreads)
+		e = c.err;
+	if (e) {
+		errno = e;
+		goto out_error;
+	}
+
+	// The last entry marks where the last block ends, padded out
+	// like the rest so the shift doesn't lose its tail.
+	if ((pos & ((1u << align) - 1)) && ftruncate(out_fd, (pos | ((1u << align) - 1)) + 1))
+		goto out_error;
+	pos = (pos + (1u << align) - 1) >> align << align;
+	index[c.numblocks] = htole32((uint32_t)(pos >> align));
+	put_le32(hdr + 4, CSO_HEADER_LEN);
+	put_le32(hdr + 8, c.total);
+	put_le32(hdr + 12, c.total >> 32);
+	put_le32(hdr + 16, CSO_BLOCK);
+	hdr[20] = 1;
+	hdr[21] = align;
+	errno = 0;
+	if ((pwrite(out_fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		|| (pwrite(out_fd, index, (c.numblocks + 1) * 4, CSO_HEADER_LEN) != (ssize_t)((c.numblocks + 1) * 4))) {
+		if (!errno)
+			errno = EIO;
+		goto out_error;
+	}
+
+	for (unsigned i = 0; i < c.nslots; i++)
+		free(c.slots[i].data);
+	free(c.slots);
+	free(index);
+	free(threads);
+	return 0;
+
+out_error:
+	e = errno;
+	for (unsigned i = 0; c.slots && (i < c.nslots); i++)
+		free(c.slots[i].data);
+	free(c.slots);
+	free(index);
+	free(threads);
+	errno = e;
+	return -1;
+}
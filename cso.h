@@ -0,0 +1,11 @@
+#ifndef _CSO_H_
+#define _CSO_H_
+
+#include <stdint.h>
+#include "libmds.h"
+
+int write_cso(struct mds_ctx *ctx, unsigned track, int out_fd, unsigned nthreads, int level,
+	uint64_t *progress);
+
+/* _CSO_H_ */
+#endif
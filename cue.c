@@ -0,0 +1,325 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "cue.h"
+#include "extract.h"
+#include "libmds.h"
+#include "mdsfmt.h"
+#include "subchannel.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// A .bin holds 2352-byte sectors at most; subchannel data goes to --sub.
+#define CD_RAW_SECTOR	2352
+
+/*
+ * Where one track's sectors come from and go to. A track's pregap is
+ * usually stored at the end of the track before it; when it is, it's
+ * counted as part of this track instead, so that each track's .bin
+ * starts at its INDEX 00 as usual.
+ */
+struct cue_track_s {
+	struct mds_track_info_s info;
+	const char *filename;	// MDF holding the track
+	uint64_t in_off;
+	uint32_t count;		// sectors, including the stored pregap
+	uint32_t stored_pregap;
+	unsigned out_secsize;
+	const char *type;
+};
+
+static const char *cue_type(const struct mds_track_info_s *info, unsigned out_secsize)
+{
+	switch (info->mode) {
+	case TM_AUDIO:
+		return (out_secsize == CD_RAW_SECTOR) ? "AUDIO" : NULL;
+	case TM_DVD:
+	case TM_MODE1:
+		if (out_secsize == 2048)
+			return "MODE1/2048";
+		return (out_secsize == CD_RAW_SECTOR) ? "MODE1/2352" : NULL;
+	case TM_MODE2:
+	case TM_MODE2_FORM1:
+	case TM_MODE2_FORM2:
+	case TM_MODE2_SUB:
+		if (out_secsize == 2336)
+			return "MODE2/2336";
+		return (out_secsize == CD_RAW_SECTOR) ? "MODE2/2352" : NULL;
+	default:
+		return NULL;
+	}
+}
+
+static void fprint_msf(FILE *f, uint64_t frames)
+{
+	fprintf(f, "%02u:%02u:%02u",
+		(unsigned)(frames / (60 * 75)),
+		(unsigned)(frames / 75 % 60),
+		(unsigned)(frames % 75)
+	);
+}
+
+static const char *basename_of(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+static int open_output(const char *filename, bool force)
+{
+	int flags = O_WRONLY | O_CREAT | O_BINARY | (force ? O_TRUNC : O_EXCL);
+	return open(filename, flags, 0666);
+}
+
+/* Work out the spans and CUE types of every track. */
+static struct cue_track_s *plan_tracks(struct mds_ctx *ctx, const struct cue_opts_s *opts,
+	unsigned *numtracks, const char **errmsg)
+{
+	unsigned n = mds_num_tracks(ctx);
+	struct cue_track_s *tracks;
+
+	tracks = calloc(n ? n : 1, sizeof(*tracks));
+	if (!tracks)
+		return NULL;
+	for (unsigned t = 0; t < n; t++) {
+		struct cue_track_s *ct = &tracks[t];
+		struct cue_track_s *prev = t ? &tracks[t - 1] : NULL;
+		const struct mds_track_info_s *pi = prev ? &prev->info : NULL;
+
+		mds_get_track(ctx, t, &ct->info);
+		ct->filename = opts->mdffile ? opts->mdffile : mds_track_filename(ctx, t);
+		ct->in_off = ct->info.offset;
+		ct->count = ct->info.length;
+		ct->out_secsize = (ct->info.secsize > CD_RAW_SECTOR) ? CD_RAW_SECTOR : ct->info.secsize;
+		ct->type = cue_type(&ct->info, ct->out_secsize);
+		if (!ct->type || !ct->filename) {
+			free(tracks);
+			*errmsg = ct->type ? "couldn't find mdf file" : "track can't be described in a cue sheet";
+			errno = EINVAL;
+			return NULL;
+		}
+
+		if (prev && (pi->session == ct->info.session)
+			&& !strcmp(prev->filename, ct->filename)
+			&& (pi->secsize == ct->info.secsize)
+			&& (pi->offset + (uint64_t)pi->length * pi->secsize == ct->info.offset)
+			&& (ct->info.pregap < prev->count)) {
+			ct->stored_pregap = ct->info.pregap;
+			ct->in_off -= (uint64_t)ct->stored_pregap * ct->info.secsize;
+			ct->count += ct->stored_pregap;
+			prev->count -= ct->stored_pregap;
+		}
+	}
+	*numtracks = n;
+	return tracks;
+}
+
+static int copy_track(struct mds_ctx *ctx, const struct cue_track_s *ct, int in_fd, int out_fd,
+	uint64_t out_off, int sub_fd, uint64_t sub_off, const struct cue_opts_s *opts)
+{
+	struct extract_job_s job = {
+		.in_fd = in_fd,
+		.in_off = ct->in_off,
+		.stride = ct->info.secsize,
+		.data_off = 0,
+		.data_len = ct->out_secsize,
+		.numblocks = ct->count,
+		.out_fd = out_fd,
+		.out_off = out_off,
+		.keep_cache = opts->keep_cache,
+		.sparse = opts->sparse,
+		.with_sub = (sub_fd != -1),
+		.sub_packed = opts->sub_packed,
+		.sub_fd = sub_fd,
+		.sub_off = sub_off,
+	};
+
+	if (in_fd == -1)
+		return extract_mds(ctx, ct->info.lba - (int32_t)ct->stored_pregap, &job);
+	if (job.data_len == job.stride)
+		return extract_contiguous(&job);
+	return extract_parallel(&job, opts->nthreads);
+}
+
+/*
+ * Write every track of the disc as raw sectors to one .bin (or one per
+ * track) named after cuefile, and a CUE sheet describing them. Tracks go
+ * out in the order they are stored, so the MDF is read once from front
+ * to back. Problems with the image rather than the system are described
+ * in *errmsg.
+ */
+int write_bincue(struct mds_ctx *ctx, const char *cuefile, const struct cue_opts_s *opts,
+	const char **errmsg)
+{
+	__label__ out_error;
+	struct cue_track_s *tracks;
+	unsigned numtracks;
+	size_t baselen = strlen(cuefile);
+	char *binname = NULL;
+	const char *mdfname = NULL;
+	FILE *cue = NULL;
+	int in_fd = -1, out_fd = -1, sub_fd = -1, fd, e;
+	uint64_t binpos = 0;	// in sectors, from the start of the current .bin
+	uint64_t subpos = 0;	// in sectors, from the start of the .sub
+	unsigned session = 0;
+	bool multisession = false;
+
+	*errmsg = NULL;
+	tracks = plan_tracks(ctx, opts, &numtracks, errmsg);
+	if (!tracks)
+		return -1;
+	if (!numtracks) {
+		*errmsg = "no tracks found";
+		errno = EINVAL;
+		goto out_error;
+	}
+	multisession = (tracks[0].info.session != tracks[numtracks - 1].info.session);
+
+	// Positions in a CUE sheet count sectors, so every track in one
+	// .bin has to have sectors of the same size.
+	for (unsigned t = 1; !opts->split && (t < numtracks); t++) {
+		if (tracks[t].out_secsize != tracks[0].out_secsize) {
+			*errmsg = "tracks have different sector sizes; use --split";
+			errno = EINVAL;
+			goto out_error;
+		}
+	}
+	for (unsigned t = 0; opts->subfile && (t < numtracks); t++) {
+		if (!tracks[t].info.numsubchannels || (tracks[t].info.secsize < CD_RAW_SECTOR + SUB_LEN)) {
+			*errmsg = "not every track has subchannel data";
+			errno = EINVAL;
+			goto out_error;
+		}
+	}
+
+	if ((baselen > 4) && !strcasecmp(cuefile + baselen - 4, ".cue"))
+		baselen -= 4;
+	binname = malloc(baselen + sizeof(" (Track 99).bin"));
+	if (!binname)
+		goto out_error;
+
+	fd = open_output(cuefile, opts->force);
+	if (fd == -1)
+		goto out_error;
+	cue = fdopen(fd, "w");
+	if (!cue) {
+		close(fd);
+		goto out_error;
+	}
+
+	if (!opts->split) {
+		sprintf(binname, "%.*s.bin", (int)baselen, cuefile);
+		out_fd = open_output(binname, opts->force);
+		if (out_fd == -1)
+			goto out_error;
+		fprintf(cue, "FILE \"%s\" BINARY\n", basename_of(binname));
+	}
+	if (opts->subfile) {
+		sub_fd = open_output(opts->subfile, opts->force);
+		if (sub_fd == -1)
+			goto out_error;
+	}
+
+	for (unsigned t = 0; t < numtracks; t++) {
+		const struct cue_track_s *ct = &tracks[t];
+
+		if (!opts->mdffile && (mds_track_num_files(ctx, t) > 1)) {
+			// Split across several files; go through libmds.
+			if (in_fd != -1)
+				close(in_fd);
+			in_fd = -1;
+			mdfname = NULL;
+			if (mds_open_data(ctx, NULL))
+				goto out_error;
+		} else if (!mdfname || strcmp(mdfname, ct->filename)) {
+			if (in_fd != -1)
+				close(in_fd);
+			mdfname = ct->filename;
+			in_fd = open(mdfname, O_RDONLY | O_BINARY);
+			if (in_fd == -1)
+				goto out_error;
+		}
+
+		if (opts->split) {
+			if (out_fd != -1 && close(out_fd)) {
+				out_fd = -1;
+				goto out_error;
+			}
+			sprintf(binname, "%.*s (Track %02u).bin", (int)baselen, cuefile, ct->info.point);
+			out_fd = open_output(binname, opts->force);
+			if (out_fd == -1)
+				goto out_error;
+			binpos = 0;
+		}
+
+		if (copy_track(ctx, ct, in_fd, out_fd, binpos * ct->out_secsize,
+			sub_fd, subpos * SUB_LEN, opts))
+			goto out_error;
+
+		if (multisession && (ct->info.session != session))
+			fprintf(cue, "REM SESSION %02u\n", ct->info.session);
+		session = ct->info.session;
+		if (opts->split)
+			fprintf(cue, "FILE \"%s\" BINARY\n", basename_of(binname));
+		fprintf(cue, "  TRACK %02u %s\n", ct->info.point, ct->type);
+		if (ct->stored_pregap) {
+			fprintf(cue, "    INDEX 00 ");
+			fprint_msf(cue, binpos);
+			fprintf(cue, "\n");
+		} else if (ct->info.pregap && (t > 0) && (tracks[t - 1].info.session == ct->info.session)) {
+			// The pregap isn't in the image; have it generated.
+			fprintf(cue, "    PREGAP ");
+			fprint_msf(cue, ct->info.pregap);
+			fprintf(cue, "\n");
+		}
+		fprintf(cue, "    INDEX 01 ");
+		fprint_msf(cue, binpos + ct->stored_pregap);
+		fprintf(cue, "\n");
+
+		binpos += ct->count;
+		subpos += ct->count;
+	}
+
+	if (close(out_fd)) {
+		out_fd = -1;
+		goto out_error;
+	}
+	out_fd = -1;
+	if ((sub_fd != -1) && close(sub_fd)) {
+		sub_fd = -1;
+		goto out_error;
+	}
+	sub_fd = -1;
+	if (fclose(cue)) {
+		cue = NULL;
+		goto out_error;
+	}
+	if (in_fd != -1)
+		close(in_fd);
+	free(binname);
+	free(tracks);
+	return 0;
+
+out_error:
+	e = errno;
+	if (cue)
+		fclose(cue);
+	if (out_fd != -1)
+		close(out_fd);
+	if (sub_fd != -1)
+		close(sub_fd);
+	if (in_fd != -1)
+		close(in_fd);
+	free(binname);
+	free(tracks);
+	errno = e;
+	return -1;
+}
@@ -0,0 +1,22 @@
+#ifndef _CUE_H_
+#define _CUE_H_
+
+#include <stdbool.h>
+#include "libmds.h"
+
+struct cue_opts_s {
+	const char *mdffile;	// read every track from here instead of the named MDF
+	bool split;		// one .bin per track instead of one for the disc
+	bool force;		// overwrite existing files
+	bool keep_cache;
+	unsigned nthreads;
+	const char *subfile;	// write subchannel data here too
+	bool sub_packed;
+	bool sparse;		// leave holes for blank sectors
+};
+
+int write_bincue(struct mds_ctx *ctx, const char *cuefile, const struct cue_opts_s *opts,
+	const char **errmsg);
+
+/* _CUE_H_ */
+#endif
@@ -0,0 +1,311 @@
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include "crc.h"
+#include "digest.h"
+
+/*
+ * The checksums people publish for disc images: the CRC-32 of zip and
+ * Redump, MD5 (RFC 1321), SHA-1 and SHA-256 (FIPS 180-4). The three
+ * hashes share the Merkle-Damgard framing of 64-byte blocks and a
+ * 64-bit length, and differ only in their compression functions and in
+ * the byte order of the length and result.
+ */
+
+#define CRC32_POLY	0xedb88320
+
+static const char *const names[DIGEST_COUNT] = {
+	[DIGEST_CRC32] = "crc32",
+	[DIGEST_MD5] = "md5",
+	[DIGEST_SHA1] = "sha1",
+	[DIGEST_SHA256] = "sha256",
+};
+
+static const size_t lengths[DIGEST_COUNT] = {
+	[DIGEST_CRC32] = 4,
+	[DIGEST_MD5] = 16,
+	[DIGEST_SHA1] = 20,
+	[DIGEST_SHA256] = 32,
+};
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static crc32_table_t crc_table;
+
+static void init_crc(void)
+{
+	crc32_table_init(crc_table, CRC32_POLY);
+}
+
+static uint32_t rol(uint32_t x, unsigned n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static uint32_t ror(uint32_t x, unsigned n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static uint32_t load_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void store_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void md5_block(uint32_t s[4], const uint8_t *p)
+{
+	static const uint32_t k[64] = {
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+	};
+	static const uint8_t r[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+	uint32_t m[16], a = s[0], b = s[1], c = s[2], d = s[3];
+	unsigned i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = load_le32(p + i * 4);
+#define MD5_STEP(f, g) do { \
+		uint32_t t = b + rol(a + (f) + k[i] + m[g], r[(i / 16) * 4 + i % 4]); \
+		a = d; \
+		d = c; \
+		c = b; \
+		b = t; \
+	} while (0)
+	for (i = 0; i < 16; i++)
+		MD5_STEP((b & c) | (~b & d), i);
+	for (; i < 32; i++)
+		MD5_STEP((d & b) | (~d & c), (5 * i + 1) % 16);
+	for (; i < 48; i++)
+		MD5_STEP(b ^ c ^ d, (3 * i + 5) % 16);
+	for (; i < 64; i++)
+		MD5_STEP(c ^ (b | ~d), (7 * i) % 16);
+#undef MD5_STEP
+	s[0] += a;
+	s[1] += b;
+	s[2] += c;
+	s[3] += d;
+}
+
+static void sha1_block(uint32_t s[5], const uint8_t *p)
+{
+	uint32_t w[80], a = s[0], b = s[1], c = s[2], d = s[3], e = s[4];
+	unsigned i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = load_be32(p + i * 4);
+	for (i = 16; i < 80; i++)
+		w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+#define SHA1_STEP(f, k) do { \
+		uint32_t t = rol(a, 5) + (f) + e + (k) + w[i]; \
+		e = d; \
+		d = c; \
+		c = rol(b, 30); \
+		b = a; \
+		a = t; \
+	} while (0)
+	for (i = 0; i < 20; i++)
+		SHA1_STEP((b & c) | (~b & d), 0x5a827999);
+	for (; i < 40; i++)
+		SHA1_STEP(b ^ c ^ d, 0x6ed9eba1);
+	for (; i < 60; i++)
+		SHA1_STEP((b & c) | (b & d) | (c & d), 0x8f1bbcdc);
+	for (; i < 80; i++)
+		SHA1_STEP(b ^ c ^ d, 0xca62c1d6);
+#undef SHA1_STEP
+	s[0] += a;
+	s[1] += b;
+	s[2] += c;
+	s[3] += d;
+	s[4] += e;
+}
+
+static void sha256_block(uint32_t s[8], const uint8_t *p)
+{
+	static const uint32_t k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+	uint32_t w[64], a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+	for (unsigned i = 0; i < 16; i++)
+		w[i] = load_be32(p + i * 4);
+	for (unsigned i = 16; i < 64; i++) {
+		uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	for (unsigned i = 0; i < 64; i++) {
+		uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+		uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	s[0] += a;
+	s[1] += b;
+	s[2] += c;
+	s[3] += d;
+	s[4] += e;
+	s[5] += f;
+	s[6] += g;
+	s[7] += h;
+}
+
+static void compress(struct digest_s *d, const uint8_t *p)
+{
+	switch (d->alg) {
+	case DIGEST_MD5:	md5_block(d->state, p);		break;
+	case DIGEST_SHA1:	sha1_block(d->state, p);	break;
+	case DIGEST_SHA256:	sha256_block(d->state, p);	break;
+	default:		break;
+	}
+}
+
+/* Accepts the names digest_name() gives, in any case. */
+int digest_lookup(const char *name)
+{
+	for (unsigned i = 0; i < DIGEST_COUNT; i++) {
+		if (!strcasecmp(name, names[i]))
+			return i;
+	}
+	return -1;
+}
+
+const char *digest_name(enum digest_e alg)
+{
+	return (alg < DIGEST_COUNT) ? names[alg] : "unknown";
+}
+
+void digest_init(struct digest_s *d, enum digest_e alg)
+{
+	static const uint32_t md5_iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	static const uint32_t sha1_iv[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	static const uint32_t sha256_iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memset(d, 0, sizeof(*d));
+	d->alg = alg;
+	switch (alg) {
+	case DIGEST_CRC32:
+		pthread_once(&crc_once, init_crc);
+		d->state[0] = 0xffffffff;
+		break;
+	case DIGEST_MD5:
+		memcpy(d->state, md5_iv, sizeof(md5_iv));
+		break;
+	case DIGEST_SHA1:
+		memcpy(d->state, sha1_iv, sizeof(sha1_iv));
+		break;
+	case DIGEST_SHA256:
+		memcpy(d->state, sha256_iv, sizeof(sha256_iv));
+		break;
+	default:
+		break;
+	}
+}
+
+void digest_update(struct digest_s *d, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t have = d->bytes % 64;
+
+	d->bytes += len;
+	if (d->alg == DIGEST_CRC32) {
+		d->state[0] = crc32_update(crc_table, d->state[0], p, len);
+		return;
+	}
+
+	if (have) {
+		size_t n = (len < 64 - have) ? len : 64 - have;
+
+		memcpy(d->block + have, p, n);
+		p += n;
+		len -= n;
+		if (have + n < 64)
+			return;
+		compress(d, d->block);
+	}
+	for (; len >= 64; len -= 64, p += 64)
+		compress(d, p);
+	memcpy(d->block, p, len);
+}
+
+/* Write out the result, and return how many bytes long it is. */
+size_t digest_final(struct digest_s *d, uint8_t out[DIGEST_MAX_LEN])
+{
+	uint64_t bits = d->bytes * 8;
+	size_t have = d->bytes % 64;
+
+	if (d->alg == DIGEST_CRC32) {
+		store_be32(out, ~d->state[0]);
+		return lengths[DIGEST_CRC32];
+	}
+
+	// A 1 bit, zeroes up to 8 bytes short of a block boundary, and the
+	// length in bits.
+	d->block[have++] = 0x80;
+	if (have > 56) {
+		memset(d->block + have, 0, 64 - have);
+		compress(d, d->block);
+		have = 0;
+	}
+	memset(d->block + have, 0, 56 - have);
+	if (d->alg == DIGEST_MD5) {
+		store_le32(d->block + 56, bits);
+		store_le32(d->block + 60, bits >> 32);
+	} else {
+		store_be32(d->block + 56, bits >> 32);
+		store_be32(d->block + 60, bits);
+	}
+	compress(d, d->block);
+
+	for (unsigned i = 0; i < lengths[d->alg] / 4; i++) {
+		if (d->alg == DIGEST_MD5)
+			store_le32(out + i * 4, d->state[i]);
+		else
+			store_be32(out + i * 4, d->state[i]);
+	}
+	return lengths[d->alg];
+}
@@ -0,0 +1,31 @@
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum digest_e {
+	DIGEST_CRC32,
+	DIGEST_MD5,
+	DIGEST_SHA1,
+	DIGEST_SHA256,
+	DIGEST_COUNT,
+};
+
+#define DIGEST_MAX_LEN 32
+
+struct digest_s {
+	enum digest_e alg;
+	uint64_t bytes;
+	uint32_t state[8];
+	uint8_t block[64];	// partial block waiting for more input
+};
+
+int digest_lookup(const char *name);
+const char *digest_name(enum digest_e alg);
+void digest_init(struct digest_s *d, enum digest_e alg);
+void digest_update(struct digest_s *d, const void *buf, size_t len);
+size_t digest_final(struct digest_s *d, uint8_t out[DIGEST_MAX_LEN]);
+
+/* _DIGEST_H_ */
+#endif
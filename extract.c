@@ -0,0 +1,970 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#include <sys/uio.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+#include "extract.h"
+#include "hash.h"
+#include "libmds.h"
+#include "mapfile.h"
+#include "progress.h"
+#include "subchannel.h"
+
+#define COPY_CHUNK (1024*1024*1024)
+#define BOUNCE_SIZE (1024*1024)
+#define STREAM_SECTORS 512
+#define WINDOW_SIZE (32*1024*1024)
+// Pieces the kernel copies in, when progress is being shown.
+#define PROGRESS_CHUNK (64*1024*1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+int write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t rc = write(fd, p, len);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+#ifdef __linux__
+/*
+ * Ask the filesystem to share extents between the MDF and the output
+ * (btrfs, XFS, ...). Only whole filesystem blocks can be cloned, so this
+ * handles the aligned prefix of the range and returns how much it did.
+ */
+static uint64_t clone_range(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t len)
+{
+	struct stat sb;
+	struct file_clone_range fcr;
+	uint64_t blksize;
+
+	if (fstat(out_fd, &sb) || !S_ISREG(sb.st_mode))
+		return 0;
+	blksize = sb.st_blksize ? sb.st_blksize : 4096;
+	if ((in_off % blksize) || (out_off % blksize))
+		return 0;
+
+	fcr.src_fd = in_fd;
+	fcr.src_offset = in_off;
+	fcr.src_length = len - (len % blksize);
+	fcr.dest_offset = out_off;
+	if (!fcr.src_length)
+		return 0;
+	if (ioctl(out_fd, FICLONERANGE, &fcr))
+		return 0;
+	return fcr.src_length;
+}
+
+static bool is_unsupported(int e)
+{
+	switch (e) {
+	case ENOSYS:
+	case EXDEV:
+	case EINVAL:
+	case EOPNOTSUPP:
+	case EBADF:
+		return true;
+	default:
+		return false;
+	}
+}
+#endif
+
+/*
+ * Copy len bytes from in_fd at in_off to out_fd at out_off, keeping the
+ * data inside the kernel whenever possible. Tries a reflink, then
+ * copy_file_range(), then sendfile(), and finally a plain read/write
+ * loop. out_fd may be a pipe, in which case out_off is ignored and data
+ * is appended at the current position.
+ */
+int copy_range(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t len)
+{
+	uint8_t *buf;
+
+#ifdef __linux__
+	uint64_t done;
+	ssize_t rc;
+
+	done = clone_range(in_fd, in_off, out_fd, out_off, len);
+	in_off += done;
+	out_off += done;
+	len -= done;
+
+	while (len) {
+		loff_t ioff = in_off, ooff = out_off;
+		rc = copy_file_range(in_fd, &ioff, out_fd, &ooff, len > COPY_CHUNK ? COPY_CHUNK : len, 0);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			if (is_unsupported(errno)) break;
+			return -1;
+		}
+		if (rc == 0) break;
+		in_off += rc;
+		out_off += rc;
+		len -= rc;
+	}
+	if (!len)
+		return 0;
+
+	if ((lseek(out_fd, out_off, SEEK_SET) == -1) && (errno != ESPIPE))
+		return -1;
+
+	while (len) {
+		off_t ioff = in_off;
+		rc = sendfile(out_fd, in_fd, &ioff, len > COPY_CHUNK ? COPY_CHUNK : len);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			if (is_unsupported(errno)) break;
+			return -1;
+		}
+		if (rc == 0) {
+			errno = EIO;
+			return -1;
+		}
+		in_off += rc;
+		len -= rc;
+	}
+	if (!len)
+		return 0;
+#else
+	if ((lseek(out_fd, out_off, SEEK_SET) == -1) && (errno != ESPIPE))
+		return -1;
+#endif
+
+	buf = malloc(BOUNCE_SIZE);
+	if (!buf)
+		return -1;
+	if (lseek(in_fd, in_off, SEEK_SET) == -1)
+		goto out_error;
+	while (len) {
+		ssize_t got = read(in_fd, buf, len > BOUNCE_SIZE ? BOUNCE_SIZE : len);
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			goto out_error;
+		}
+		if (got == 0) {
+			errno = EIO;
+			goto out_error;
+		}
+		if (write_full(out_fd, buf, got))
+			goto out_error;
+		len -= got;
+	}
+	free(buf);
+	return 0;
+
+out_error:
+	free(buf);
+	return -1;
+}
+
+int extract_contiguous(const struct extract_job_s *job)
+{
+	const uint64_t len = job->numblocks * job->data_len;
+	const uint64_t step = job->progress ? PROGRESS_CHUNK : len;
+	int rc = 0;
+
+	// The kernel's copy never lets us see the data.
+	if (job->hash || job->sparse)
+		return extract_strided(job);
+
+	for (uint64_t done = 0; !rc && (done < len); done += step) {
+		uint64_t n = (len - done < step) ? len - done : step;
+
+		rc = copy_range(job->in_fd, job->in_off + done, job->out_fd, job->out_off + done, n);
+		if (!rc)
+			progress_add(job->progress, n);
+	}
+#ifdef POSIX_FADV_DONTNEED
+	if (!rc && !job->keep_cache)
+		posix_fadvise(job->in_fd, job->in_off, len, POSIX_FADV_DONTNEED);
+#endif
+	return rc;
+}
+
+int gather_init(struct gather_s *g, int fd, uint64_t off)
+{
+	g->fd = fd;
+	g->off = off;
+	g->seekable = (lseek(fd, 0, SEEK_CUR) != -1);
+	if (!g->seekable && (errno != ESPIPE))
+		return -1;
+	g->cnt = 0;
+	g->max = IOV_MAX;
+	g->bytes = 0;
+	g->tap = NULL;
+	g->iov = calloc(g->max, sizeof(*g->iov));
+	if (!g->iov)
+		return -1;
+	return 0;
+}
+
+void gather_free(struct gather_s *g)
+{
+	free(g->iov);
+	g->iov = NULL;
+}
+
+/*
+ * Write out everything queued so far. A short write just means the
+ * kernel took less than we offered, so trim the iovecs it did take and
+ * go around again.
+ */
+int gather_flush(struct gather_s *g)
+{
+	struct iovec *iov = g->iov;
+	int cnt = g->cnt;
+
+	for (int i = 0; g->tap && (i < cnt); i++)
+		hash_feed(g->tap, iov[i].iov_base, iov[i].iov_len);
+	while (cnt) {
+		ssize_t rc;
+#ifdef __MINGW32__
+		rc = iov[0].iov_len;
+		if (write_full(g->fd, iov[0].iov_base, iov[0].iov_len))
+			rc = -1;
+#else
+		if (g->seekable)
+			rc = pwritev(g->fd, iov, cnt, g->off);
+		else
+			rc = writev(g->fd, iov, cnt);
+#endif
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (rc == 0) {
+			errno = EIO;
+			return -1;
+		}
+		g->off += rc;
+		g->bytes -= rc;
+		while (cnt && ((size_t)rc >= iov->iov_len)) {
+			rc -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (uint8_t *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	g->cnt = 0;
+	return 0;
+}
+
+/*
+ * Move the output position on by len bytes without writing anything,
+ * leaving a hole in the file. Whatever is hashing the output sees
+ * zeroes.
+ */
+int gather_skip(struct gather_s *g, size_t len)
+{
+	static const uint8_t zeroes[4096];
+
+	if (!g->seekable) {
+		errno = ESPIPE;
+		return -1;
+	}
+	if (gather_flush(g))
+		return -1;
+	for (size_t n = len; g->tap && n; ) {
+		size_t chunk = (n < sizeof(zeroes)) ? n : sizeof(zeroes);
+		hash_feed(g->tap, zeroes, chunk);
+		n -= chunk;
+	}
+	g->off += len;
+	return 0;
+}
+
+/*
+ * Queue len bytes at p to be written after whatever is already queued.
+ * The memory must stay valid until the next flush. Slices that follow
+ * on from the previous one in memory are merged into a single iovec.
+ */
+int gather_add(struct gather_s *g, const void *p, size_t len)
+{
+	if (g->cnt) {
+		struct iovec *last = &g->iov[g->cnt - 1];
+		if ((uint8_t *)last->iov_base + last->iov_len == p) {
+			last->iov_len += len;
+			g->bytes += len;
+			return 0;
+		}
+	}
+	if (g->cnt == g->max) {
+		if (gather_flush(g))
+			return -1;
+	}
+	g->iov[g->cnt].iov_base = (void *)p;
+	g->iov[g->cnt].iov_len = len;
+	g->cnt++;
+	g->bytes += len;
+	return 0;
+}
+
+static bool is_zero(const uint8_t *p, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 64 <= len; i += 64) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 48)));
+		// Most sectors that aren't blank give themselves away at once.
+		if ((i & 1023) == 0 && (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff))
+			return false;
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+		return false;
+#endif
+	for (; i < len; i++) {
+		if (p[i])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * With job->sparse, all-zero payloads are skipped instead of written.
+ * That only works on a regular file, extended up front to its final
+ * length; anything else gets its zeroes written out.
+ */
+static bool prepare_sparse(const struct extract_job_s *job)
+{
+	struct stat sb;
+	uint64_t end = job->out_off + job->numblocks * job->data_len;
+
+	if (!job->sparse || fstat(job->out_fd, &sb) || !S_ISREG(sb.st_mode))
+		return false;
+	if (((uint64_t)sb.st_size < end) && ftruncate(job->out_fd, end))
+		return false;
+	return true;
+}
+
+/* Queue one payload, or skip over it if it's blank and holes are allowed. */
+static int gather_payload(struct gather_s *g, const uint8_t *p, size_t len, bool sparse)
+{
+	if (sparse && is_zero(p, len))
+		return gather_skip(g, len);
+	return gather_add(g, p, len);
+}
+
+/*
+ * Lets workers writing different parts of the output at once still hash
+ * it in order: each waits until everything before its part has been fed
+ * to the hash, feeds its own and passes the turn on.
+ */
+struct hash_turn_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t next;		// output offset the hash has reached
+	bool failed;		// a worker gave up; nobody will get a turn
+};
+
+static void turn_fail(struct hash_turn_s *t)
+{
+	pthread_mutex_lock(&t->lock);
+	t->failed = true;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * Hash the payload of n sectors at p, which land at off in the output,
+ * once it's their turn. The mutex hands the ring from one worker to the
+ * next, so hash_feed() is only ever called by one of them at a time.
+ */
+static int turn_hash(const struct extract_job_s *job, struct hash_turn_s *t, const uint8_t *p,
+	uint64_t n, uint64_t off)
+{
+	bool failed;
+
+	pthread_mutex_lock(&t->lock);
+	while (!t->failed && (t->next != off))
+		pthread_cond_wait(&t->cond, &t->lock);
+	failed = t->failed;
+	pthread_mutex_unlock(&t->lock);
+	if (failed) {
+		errno = ECANCELED;
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		hash_feed(job->hash, p + job->data_off, job->data_len);
+		p += job->stride;
+	}
+
+	pthread_mutex_lock(&t->lock);
+	t->next = off + n * job->data_len;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	return 0;
+}
+
+/*
+ * Pull the payload out of each raw sector, writing up to IOV_MAX
+ * sectors per system call straight from a sliding window over the MDF.
+ * Everything queued must be written before the window moves on. The
+ * subchannel data, if wanted, goes out the same way alongside it. With
+ * a turn, each window is hashed after it's written instead of as it's
+ * queued.
+ */
+static int strided(const struct extract_job_s *job, struct hash_turn_s *turn)
+{
+	struct MappedWindow_s w;
+	struct gather_s g, sg = { .iov = NULL };
+	uint8_t *packed = NULL;
+	uint64_t per_window, block = 0;
+	bool sparse = prepare_sparse(job);
+	int rc = 0;
+
+	per_window = WINDOW_SIZE / job->stride;
+	if (!per_window)
+		per_window = 1;
+	if (job->with_sub) {
+		if (job->stride < SUB_LEN) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (gather_init(&sg, job->sub_fd, job->sub_off))
+			return -1;
+		if (job->sub_packed) {
+			packed = malloc(per_window * SUB_LEN);
+			if (!packed) {
+				gather_free(&sg);
+				return -1;
+			}
+		}
+	}
+	if (MappedWindow_Init(&w, job->in_fd, WINDOW_SIZE, !job->keep_cache))
+		goto out_sub;
+	if (gather_init(&g, job->out_fd, job->out_off)) {
+		MappedWindow_Close(&w);
+		goto out_sub;
+	}
+	g.tap = turn ? NULL : job->hash;
+	while (block < job->numblocks) {
+		uint64_t n = job->numblocks - block;
+		const uint8_t *p, *base;
+
+		if (n > per_window)
+			n = per_window;
+		p = base = MappedWindow_Get(&w, job->in_off + block * job->stride, n * job->stride);
+		if (!p) {
+			rc = -1;
+			break;
+		}
+		for (uint64_t i = 0; !rc && (i < n); i++) {
+			const uint8_t *sub = p + job->stride - SUB_LEN;
+
+			rc = gather_payload(&g, p + job->data_off, job->data_len, sparse);
+			if (!rc && job->with_sub && packed) {
+				sub_deinterleave(packed + i * SUB_LEN, sub);
+				rc = gather_add(&sg, packed + i * SUB_LEN, SUB_LEN);
+			} else if (!rc && job->with_sub) {
+				rc = gather_add(&sg, sub, SUB_LEN);
+			}
+			p += job->stride;
+		}
+		if (!rc)
+			rc = gather_flush(&g);
+		if (!rc && job->with_sub)
+			rc = gather_flush(&sg);
+		if (!rc && turn)
+			rc = turn_hash(job, turn, base, n, job->out_off + block * job->data_len);
+		if (rc)
+			break;
+		block += n;
+		progress_add(job->progress, n * job->data_len);
+	}
+	gather_free(&g);
+	MappedWindow_Close(&w);
+	if (job->with_sub)
+		gather_free(&sg);
+	free(packed);
+	return rc;
+
+out_sub:
+	if (job->with_sub)
+		gather_free(&sg);
+	free(packed);
+	return -1;
+}
+
+int extract_strided(const struct extract_job_s *job)
+{
+	return strided(job, NULL);
+}
+
+struct worker_s {
+	pthread_t thread;
+	struct extract_job_s job;
+	struct hash_turn_s *turn;	// if set, job is the whole track
+	unsigned index;
+	unsigned nthreads;
+	int rc;
+	int err;
+};
+
+/*
+ * Sectors for one window of extract_strided(), dealt out in turn to the
+ * workers when hashing, so they all have something to write at once.
+ */
+static uint64_t stripe_blocks(const struct extract_job_s *job)
+{
+	uint64_t n = WINDOW_SIZE / job->stride;
+
+	return n ? n : 1;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker_s *w = arg;
+	uint64_t stripe, first;
+
+	if (!w->turn) {
+		w->rc = extract_strided(&w->job);
+		w->err = w->rc ? errno : 0;
+		return NULL;
+	}
+
+	stripe = stripe_blocks(&w->job);
+	w->rc = 0;
+	for (first = w->index * stripe; !w->rc && (first < w->job.numblocks); first += w->nthreads * stripe) {
+		struct extract_job_s part = w->job;
+
+		part.in_off += first * part.stride;
+		part.out_off += first * part.data_len;
+		part.sub_off += first * SUB_LEN;
+		part.numblocks = w->job.numblocks - first;
+		if (part.numblocks > stripe)
+			part.numblocks = stripe;
+		w->rc = strided(&part, w->turn);
+	}
+	w->err = w->rc ? errno : 0;
+	if (w->rc)
+		turn_fail(w->turn);
+	return NULL;
+}
+
+/*
+ * Every output block has a fixed home at out_off + n*data_len, so the
+ * track can be cut into nthreads ranges that are compacted and written
+ * independently with pwritev(). The output is allocated up front so the
+ * workers don't race each other to extend the file. When hashing, the
+ * track is cut into window-sized stripes dealt out in turn instead, and
+ * each stripe is hashed in order once it has been written.
+ */
+int extract_parallel(const struct extract_job_s *job, unsigned nthreads)
+{
+	struct worker_s *workers;
+	struct hash_turn_s turn = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.next = job->out_off,
+	};
+	uint64_t per, first = 0;
+	unsigned started;
+	bool sparse;
+	int rc = 0, e = 0;
+
+	if (nthreads > job->numblocks)
+		nthreads = job->numblocks;
+	if (job->hash) {
+		uint64_t stripes = (job->numblocks + stripe_blocks(job) - 1) / stripe_blocks(job);
+		if (nthreads > stripes)
+			nthreads = stripes;
+	}
+	if (nthreads < 2)
+		return extract_strided(job);
+	if (lseek(job->out_fd, 0, SEEK_CUR) == -1) {
+		if (errno != ESPIPE) return -1;
+		return extract_strided(job);
+	}
+	if (job->with_sub && (lseek(job->sub_fd, 0, SEEK_CUR) == -1)) {
+		if (errno != ESPIPE) return -1;
+		return extract_strided(job);
+	}
+
+	// Sparse output is extended to full length here instead, so that no
+	// worker can see the file shorter than its own range.
+	sparse = prepare_sparse(job);
+#ifdef __linux__
+	if (!job->sparse)
+		rc = posix_fallocate(job->out_fd, job->out_off, job->numblocks * job->data_len);
+	if (rc && (rc != EOPNOTSUPP) && (rc != EINVAL)) {
+		errno = rc;
+		return -1;
+	}
+	rc = 0;
+#endif
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	per = job->numblocks / nthreads;
+	for (started = 0; started < nthreads; started++) {
+		struct worker_s *w = &workers[started];
+		uint64_t count = per;
+
+		if (started == nthreads - 1)
+			count = job->numblocks - first;
+		w->job = *job;
+		w->job.sparse = sparse;
+		if (job->hash) {
+			w->turn = &turn;
+			w->index = started;
+			w->nthreads = nthreads;
+		} else {
+			w->job.in_off += first * job->stride;
+			w->job.out_off += first * job->data_len;
+			w->job.sub_off += first * SUB_LEN;
+			w->job.numblocks = count;
+			first += count;
+		}
+
+		e = pthread_create(&w->thread, NULL, worker_main, w);
+		if (e) break;
+	}
+
+	// Those that did start mustn't wait for a turn that won't come.
+	if (started < nthreads) {
+		rc = -1;
+		turn_fail(&turn);
+	}
+	// Workers that only gave up because another failed say ECANCELED;
+	// report the failure itself.
+	for (unsigned i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].rc && (!rc || (e == ECANCELED))) {
+			rc = -1;
+			e = workers[i].err;
+		}
+	}
+	free(workers);
+	if (rc)
+		errno = e;
+	return rc;
+}
+
+struct stream_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	uint64_t remaining;
+	size_t bufsize;
+	uint8_t *buf[2];
+	size_t len[2];
+	bool full[2];
+	bool stop;
+	int err;
+};
+
+/*
+ * Read the whole buffer unless the input runs dry first. Cancellation
+ * is only allowed while blocked in read(), where no lock is held.
+ */
+static ssize_t read_full(int fd, uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t rc;
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		rc = read(fd, buf + done, len - done);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (rc == 0) break;
+		done += rc;
+	}
+	return done;
+}
+
+static void *stream_reader(void *arg)
+{
+	struct stream_s *st = arg;
+	unsigned i = 0;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (st->remaining) {
+		size_t want = st->remaining > st->bufsize ? st->bufsize : st->remaining;
+		ssize_t got;
+
+		bool stop;
+
+		pthread_mutex_lock(&st->lock);
+		while (st->full[i] && !st->stop)
+			pthread_cond_wait(&st->cond, &st->lock);
+		stop = st->stop;
+		pthread_mutex_unlock(&st->lock);
+		if (stop)
+			break;
+
+		got = read_full(st->fd, st->buf[i], want);
+
+		pthread_mutex_lock(&st->lock);
+		if (got < 0) {
+			st->err = errno;
+		} else if ((size_t)got < want) {
+			st->err = EIO;
+		} else {
+			st->len[i] = got;
+			st->full[i] = true;
+			st->remaining -= got;
+		}
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+		if (st->err)
+			break;
+		i ^= 1;
+	}
+	return NULL;
+}
+
+/* Throw away input up to off, for inputs that can't seek. */
+static int skip_input(int fd, uint64_t off)
+{
+	uint8_t *buf;
+
+	if (lseek(fd, off, SEEK_SET) != -1)
+		return 0;
+	if (errno != ESPIPE)
+		return -1;
+
+	buf = malloc(BOUNCE_SIZE);
+	if (!buf)
+		return -1;
+	while (off) {
+		ssize_t rc = read(fd, buf, off > BOUNCE_SIZE ? BOUNCE_SIZE : off);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			free(buf);
+			return -1;
+		}
+		if (rc == 0) {
+			free(buf);
+			errno = EIO;
+			return -1;
+		}
+		off -= rc;
+	}
+	free(buf);
+	return 0;
+}
+
+/*
+ * Convert from an input that is read strictly front to back, such as a
+ * pipe. A reader thread fills one of two fixed-size buffers while the
+ * payloads in the other are written out, so memory use does not depend
+ * on the size of the image.
+ */
+int extract_stream(const struct extract_job_s *job)
+{
+	struct stream_s st = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.fd = job->in_fd,
+		.remaining = job->numblocks * job->stride,
+		.bufsize = (size_t)STREAM_SECTORS * job->stride,
+	};
+	struct gather_s g;
+	pthread_t reader;
+	uint64_t left = job->numblocks;
+	unsigned i = 0;
+	bool sparse = prepare_sparse(job);
+	int rc = 0, e = 0;
+
+	if (skip_input(job->in_fd, job->in_off))
+		return -1;
+	if (gather_init(&g, job->out_fd, job->out_off))
+		return -1;
+	g.tap = job->hash;
+	st.buf[0] = malloc(st.bufsize);
+	st.buf[1] = malloc(st.bufsize);
+	if (!st.buf[0] || !st.buf[1]) {
+		rc = -1;
+		goto out_free;
+	}
+
+	e = pthread_create(&reader, NULL, stream_reader, &st);
+	if (e) {
+		errno = e;
+		rc = -1;
+		goto out_free;
+	}
+
+	while (left) {
+		const uint8_t *p;
+		size_t n;
+
+		pthread_mutex_lock(&st.lock);
+		while (!st.full[i] && !st.err)
+			pthread_cond_wait(&st.cond, &st.lock);
+		e = st.err;
+		pthread_mutex_unlock(&st.lock);
+		if (!st.full[i]) {
+			rc = -1;
+			break;
+		}
+
+		p = st.buf[i] + job->data_off;
+		n = st.len[i] / job->stride;
+		for (size_t block = 0; block < n; block++) {
+			if ((rc = gather_payload(&g, p, job->data_len, sparse)))
+				break;
+			p += job->stride;
+		}
+		if (!rc)
+			rc = gather_flush(&g);
+		if (rc) {
+			e = errno;
+			break;
+		}
+		left -= n;
+		progress_add(job->progress, n * job->data_len);
+
+		pthread_mutex_lock(&st.lock);
+		st.full[i] = false;
+		pthread_cond_broadcast(&st.cond);
+		pthread_mutex_unlock(&st.lock);
+		i ^= 1;
+	}
+
+	pthread_mutex_lock(&st.lock);
+	st.stop = true;
+	pthread_cond_broadcast(&st.cond);
+	pthread_mutex_unlock(&st.lock);
+	if (rc)
+		pthread_cancel(reader);
+	pthread_join(reader, NULL);
+
+out_free:
+	if (rc && e)
+		errno = e;
+	free(st.buf[0]);
+	free(st.buf[1]);
+	gather_free(&g);
+	return rc;
+}
+
+/*
+ * Copy sectors through libmds instead of from an MDF file descriptor,
+ * for images that are split across several files. job->numblocks raw
+ * sectors are read from lba on, crossing into later tracks if need be,
+ * and the data_off/data_len slice of each is written out; job->in_fd
+ * and job->in_off are not used. mds_open_data() must have been called.
+ */
+int extract_mds(struct mds_ctx *ctx, int32_t lba, const struct extract_job_s *job)
+{
+	struct gather_s g, sg = { .iov = NULL };
+	uint8_t *buf, *packed = NULL;
+	uint64_t done = 0;
+	uint32_t chunk = BOUNCE_SIZE / job->stride;
+	bool sparse = prepare_sparse(job);
+	int rc = 0;
+
+	if (!chunk)
+		chunk = 1;
+	if (job->with_sub && (job->stride < SUB_LEN)) {
+		errno = EINVAL;
+		return -1;
+	}
+	buf = malloc((size_t)chunk * job->stride);
+	if (job->with_sub && job->sub_packed)
+		packed = malloc((size_t)chunk * SUB_LEN);
+	if (!buf || (job->with_sub && job->sub_packed && !packed))
+		goto out_free;
+	if (job->with_sub && gather_init(&sg, job->sub_fd, job->sub_off))
+		goto out_free;
+	if (gather_init(&g, job->out_fd, job->out_off))
+		goto out_free;
+	g.tap = job->hash;
+	while (!rc && (done < job->numblocks)) {
+		struct mds_track_info_s info;
+		uint64_t want = job->numblocks - done;
+		int track = mds_track_for_lba(ctx, lba);
+		ssize_t got;
+
+		if ((track == -1) || mds_get_track(ctx, track, &info) || (info.secsize != job->stride)) {
+			errno = EIO;
+			rc = -1;
+			break;
+		}
+		got = mds_read_sectors(ctx, track, lba, (want < chunk) ? want : chunk, buf, MDS_READ_RAW);
+		if (got <= 0) {
+			if (!got)
+				errno = EIO;
+			rc = -1;
+			break;
+		}
+		for (ssize_t i = 0; !rc && (i < got); i++) {
+			const uint8_t *p = buf + i * job->stride;
+			const uint8_t *sub = p + job->stride - SUB_LEN;
+
+			rc = gather_payload(&g, p + job->data_off, job->data_len, sparse);
+			if (!rc && packed) {
+				sub_deinterleave(packed + i * SUB_LEN, sub);
+				rc = gather_add(&sg, packed + i * SUB_LEN, SUB_LEN);
+			} else if (!rc && job->with_sub) {
+				rc = gather_add(&sg, sub, SUB_LEN);
+			}
+		}
+		if (!rc)
+			rc = gather_flush(&g);
+		if (!rc && job->with_sub)
+			rc = gather_flush(&sg);
+		if (!rc)
+			progress_add(job->progress, got * job->data_len);
+		lba += got;
+		done += got;
+	}
+	gather_free(&g);
+	gather_free(&sg);
+	free(packed);
+	free(buf);
+	return rc;
+
+out_free:
+	gather_free(&sg);
+	free(packed);
+	free(buf);
+	return -1;
+}
@@ -0,0 +1,77 @@
+#ifndef _EXTRACT_H_
+#define _EXTRACT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#ifndef __MINGW32__
+#include <sys/uio.h>
+#else
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#endif
+
+struct hash_ring_s;
+
+/*
+ * Describes one track's worth of sectors to be copied out of the MDF.
+ * Sector n of the track lives at in_off + n*stride in the MDF; its
+ * payload is data_len bytes starting data_off bytes into the sector,
+ * and lands at out_off + n*data_len in the output.
+ */
+struct extract_job_s {
+	int in_fd;
+	uint64_t in_off;
+	unsigned stride;
+	unsigned data_off;
+	unsigned data_len;
+	uint64_t numblocks;
+	int out_fd;
+	uint64_t out_off;
+	bool keep_cache;	// leave the MDF in the page cache when done
+	bool with_sub;		// also write the subchannel data at the end of each sector
+	bool sub_packed;	// de-interleaved, one channel after another
+	int sub_fd;
+	uint64_t sub_off;
+	struct hash_ring_s *hash;	// hash the output as it is written, in order
+	bool sparse;		// leave holes for all-zero payloads
+	uint64_t *progress;	// count the payload written here; see progress.h
+};
+
+/*
+ * Collects slices of memory and writes them to fd in as few system
+ * calls as possible, with pwritev() at an explicit offset when fd is
+ * seekable and writev() when it is a pipe.
+ */
+struct gather_s {
+	int fd;
+	uint64_t off;
+	bool seekable;
+	int cnt;
+	int max;
+	size_t bytes;
+	struct iovec *iov;
+	struct hash_ring_s *tap;	// also hash everything written
+};
+
+int gather_init(struct gather_s *g, int fd, uint64_t off);
+int gather_add(struct gather_s *g, const void *p, size_t len);
+int gather_flush(struct gather_s *g);
+int gather_skip(struct gather_s *g, size_t len);
+void gather_free(struct gather_s *g);
+
+int write_full(int fd, const void *buf, size_t len);
+int copy_range(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t len);
+int extract_contiguous(const struct extract_job_s *job);
+int extract_strided(const struct extract_job_s *job);
+int extract_parallel(const struct extract_job_s *job, unsigned nthreads);
+int extract_stream(const struct extract_job_s *job);
+int extract_uring(const struct extract_job_s *job, unsigned qdepth);
+
+struct mds_ctx;
+int extract_mds(struct mds_ctx *ctx, int32_t lba, const struct extract_job_s *job);
+
+/* _EXTRACT_H_ */
+#endif
@@ -0,0 +1,175 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "digest.h"
+#include "hash.h"
+
+#define RING_SLOTS	8
+#define SLOT_SIZE	(1024*1024)
+
+struct hash_worker_s {
+	pthread_t thread;
+	struct hash_ring_s *ring;
+	uint64_t tail;		// slots hashed so far
+	struct digest_s digest;
+};
+
+/*
+ * Slot n of the stream lives in slot[n % RING_SLOTS]. The feeder fills
+ * slot head, and may only move on to the next once every worker's tail
+ * has passed it.
+ */
+struct hash_ring_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t *slot[RING_SLOTS];
+	size_t len[RING_SLOTS];
+	uint64_t head;		// slots handed to the workers
+	size_t fill;		// bytes in the slot being filled
+	bool done;
+	unsigned count;
+	struct hash_worker_s workers[DIGEST_COUNT];
+};
+
+static void *hash_main(void *arg)
+{
+	struct hash_worker_s *w = arg;
+	struct hash_ring_s *r = w->ring;
+
+	for (;;) {
+		unsigned i;
+
+		pthread_mutex_lock(&r->lock);
+		while ((w->tail == r->head) && !r->done)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (w->tail == r->head) {
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		pthread_mutex_unlock(&r->lock);
+
+		i = w->tail % RING_SLOTS;
+		digest_update(&w->digest, r->slot[i], r->len[i]);
+
+		pthread_mutex_lock(&r->lock);
+		w->tail++;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+	return NULL;
+}
+
+static bool slot_free(const struct hash_ring_s *r)
+{
+	for (unsigned i = 0; i < r->count; i++) {
+		if (r->head - r->workers[i].tail >= RING_SLOTS)
+			return false;
+	}
+	return true;
+}
+
+/* Hand the slot being filled to the workers, and wait for the next. */
+static void publish(struct hash_ring_s *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->len[r->head % RING_SLOTS] = r->fill;
+	r->head++;
+	pthread_cond_broadcast(&r->cond);
+	while (!slot_free(r))
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+	r->fill = 0;
+}
+
+static void free_ring(struct hash_ring_s *r)
+{
+	for (unsigned i = 0; i < RING_SLOTS; i++)
+		free(r->slot[i]);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
+
+struct hash_ring_s *hash_start(const enum digest_e *algs, unsigned count)
+{
+	struct hash_ring_s *r;
+	int e = 0;
+
+	if (!count || (count > DIGEST_COUNT)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	for (unsigned i = 0; i < RING_SLOTS; i++) {
+		r->slot[i] = malloc(SLOT_SIZE);
+		if (!r->slot[i]) {
+			free_ring(r);
+			return NULL;
+		}
+	}
+
+	for (r->count = 0; r->count < count; r->count++) {
+		struct hash_worker_s *w = &r->workers[r->count];
+
+		w->ring = r;
+		digest_init(&w->digest, algs[r->count]);
+		e = pthread_create(&w->thread, NULL, hash_main, w);
+		if (e) break;
+	}
+	if (e) {
+		hash_finish(r, NULL);
+		errno = e;
+		return NULL;
+	}
+	return r;
+}
+
+void hash_feed(struct hash_ring_s *r, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		size_t n = (len < SLOT_SIZE - r->fill) ? len : SLOT_SIZE - r->fill;
+
+		memcpy(r->slot[r->head % RING_SLOTS] + r->fill, p, n);
+		r->fill += n;
+		p += n;
+		len -= n;
+		if (r->fill == SLOT_SIZE)
+			publish(r);
+	}
+}
+
+/*
+ * Wait for the workers to catch up and collect one result per algorithm,
+ * in the order they were given to hash_start(). results may be NULL to
+ * throw them away. The ring is freed either way.
+ */
+void hash_finish(struct hash_ring_s *r, struct hash_result_s *results)
+{
+	if (r->fill)
+		publish(r);
+	pthread_mutex_lock(&r->lock);
+	r->done = true;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	for (unsigned i = 0; i < r->count; i++) {
+		struct hash_worker_s *w = &r->workers[i];
+
+		pthread_join(w->thread, NULL);
+		if (results) {
+			results[i].alg = w->digest.alg;
+			results[i].len = digest_final(&w->digest, results[i].value);
+		}
+	}
+	free_ring(r);
+}
@@ -0,0 +1,27 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "digest.h"
+
+/*
+ * Hashes a stream of bytes with several algorithms at once, each on its
+ * own thread. hash_feed() copies the bytes into a ring of large chunks
+ * and returns; it only waits when the slowest hash falls a whole ring
+ * behind.
+ */
+struct hash_ring_s;
+
+struct hash_result_s {
+	enum digest_e alg;
+	size_t len;
+	uint8_t value[DIGEST_MAX_LEN];
+};
+
+struct hash_ring_s *hash_start(const enum digest_e *algs, unsigned count);
+void hash_feed(struct hash_ring_s *r, const void *buf, size_t len);
+void hash_finish(struct hash_ring_s *r, struct hash_result_s *results);
+
+/* _HASH_H_ */
+#endif
@@ -0,0 +1,270 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "endian.h"
+#include "index.h"
+#include "mapfile.h"
+
+struct index_file_s {
+	struct MappedFile_s m;
+	const struct index_image_s *images;
+	const struct index_track_s *tracks;
+	const char *strings;
+	uint32_t numimages;
+	uint32_t numtracks;
+	uint32_t strings_len;
+};
+
+static void image_swap(struct index_image_s *dst, const struct index_image_s *src, bool to_le)
+{
+	*dst = *src;
+#define SWAP(f, bits) dst->f = to_le ? htole##bits(src->f) : le##bits##toh(src->f)
+	SWAP(path_off, 32);
+	SWAP(first_track, 32);
+	SWAP(mds_size, 64);
+	SWAP(mds_mtime, 64);
+	SWAP(mdf_size, 64);
+	SWAP(mediatype, 16);
+	SWAP(numsessions, 16);
+	SWAP(numtracks, 16);
+	SWAP(flags, 16);
+	SWAP(volume_blocks, 32);
+	SWAP(volume_block_size, 16);
+#undef SWAP
+}
+
+static void track_swap(struct index_track_s *dst, const struct index_track_s *src, bool to_le)
+{
+	*dst = *src;
+	dst->secsize = to_le ? htole16(src->secsize) : le16toh(src->secsize);
+	dst->data_len = to_le ? htole16(src->data_len) : le16toh(src->data_len);
+	dst->lba = to_le ? htole32(src->lba) : le32toh(src->lba);
+	dst->length = to_le ? htole32(src->length) : le32toh(src->length);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct index_entry_s *ea = a, *eb = b;
+	return strcmp(ea->path, eb->path);
+}
+
+/*
+ * Write the index, replacing file all at once. The entries are sorted by
+ * path along the way.
+ */
+int index_write(const char *file, struct index_entry_s *entries, size_t n)
+{
+	struct index_header_s hdr = { .magic = INDEX_MAGIC };
+	char *tmp = malloc(strlen(file) + sizeof(".tmp"));
+	uint64_t numtracks = 0, strings_len = 0;
+	uint32_t track = 0, off = 0;
+	FILE *f;
+	int e;
+
+	if (!tmp)
+		return -1;
+	qsort(entries, n, sizeof(*entries), compare_entries);
+	for (size_t i = 0; i < n; i++) {
+		numtracks += entries[i].image.numtracks;
+		strings_len += strlen(entries[i].path) + 1;
+	}
+	if ((n > UINT32_MAX) || (numtracks > UINT32_MAX) || (strings_len > UINT32_MAX)) {
+		errno = EFBIG;
+		goto out_error;
+	}
+	hdr.version = htole32(INDEX_VERSION);
+	hdr.numimages = htole32(n);
+	hdr.numtracks = htole32(numtracks);
+	hdr.strings_len = htole32(strings_len);
+	hdr.images_off = htole64(sizeof(hdr));
+	hdr.tracks_off = htole64(sizeof(hdr) + n * sizeof(struct index_image_s));
+	hdr.strings_off = htole64(sizeof(hdr) + n * sizeof(struct index_image_s)
+		+ numtracks * sizeof(struct index_track_s));
+
+	sprintf(tmp, "%s.tmp", file);
+	f = fopen(tmp, "wb");
+	if (!f)
+		goto out_error;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	for (size_t i = 0; i < n; i++) {
+		struct index_image_s image = entries[i].image;
+
+		image.path_off = off;
+		image.first_track = track;
+		image_swap(&image, &image, true);
+		fwrite(&image, sizeof(image), 1, f);
+		off += strlen(entries[i].path) + 1;
+		track += entries[i].image.numtracks;
+	}
+	for (size_t i = 0; i < n; i++) {
+		for (unsigned t = 0; t < entries[i].image.numtracks; t++) {
+			struct index_track_s tr;
+
+			track_swap(&tr, &entries[i].tracks[t], true);
+			fwrite(&tr, sizeof(tr), 1, f);
+		}
+	}
+	for (size_t i = 0; i < n; i++)
+		fwrite(entries[i].path, strlen(entries[i].path) + 1, 1, f);
+	if (ferror(f)) {
+		fclose(f);
+		errno = EIO;
+		goto out_unlink;
+	}
+	if (fclose(f))
+		goto out_unlink;
+	if (rename(tmp, file))
+		goto out_unlink;
+	free(tmp);
+	return 0;
+
+out_unlink:
+	e = errno;
+	unlink(tmp);
+	errno = e;
+out_error:
+	e = errno;
+	free(tmp);
+	errno = e;
+	return -1;
+}
+
+/* Whether count records of size bytes fit in the file at off. */
+static bool fits(const struct index_file_s *idx, uint64_t off, uint64_t count, size_t size)
+{
+	return (off <= idx->m.size) && (count <= (idx->m.size - off) / size);
+}
+
+/*
+ * Map an index and check that everything in it points somewhere sane,
+ * so the accessors needn't. Problems with the file's contents are
+ * described in *errmsg.
+ */
+struct index_file_s *index_open(const char *file, const char **errmsg)
+{
+	struct index_file_s *idx = calloc(1, sizeof(*idx));
+	struct index_header_s hdr;
+	char *name = strdup(file);
+	int e;
+
+	*errmsg = NULL;
+	if (!idx || !name)
+		goto out_error;
+	idx->m = MappedFile_Open(name, false);
+	free(name);
+	name = NULL;
+	if (!idx->m.data) {
+		// An empty file can't be mapped, but it isn't an index either.
+		if (errno == EINVAL)
+			*errmsg = "not an mds2iso index";
+		goto out_error;
+	}
+	if (idx->m.size < sizeof(hdr)) {
+		*errmsg = "not an mds2iso index";
+		goto out_unmap;
+	}
+	memcpy(&hdr, idx->m.data, sizeof(hdr));
+	if (memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic))) {
+		*errmsg = "not an mds2iso index";
+		goto out_unmap;
+	}
+	if (le32toh(hdr.version) != INDEX_VERSION) {
+		*errmsg = "unknown index version";
+		goto out_unmap;
+	}
+	idx->numimages = le32toh(hdr.numimages);
+	idx->numtracks = le32toh(hdr.numtracks);
+	idx->strings_len = le32toh(hdr.strings_len);
+	if (!fits(idx, le64toh(hdr.images_off), idx->numimages, sizeof(struct index_image_s))
+		|| !fits(idx, le64toh(hdr.tracks_off), idx->numtracks, sizeof(struct index_track_s))
+		|| !fits(idx, le64toh(hdr.strings_off), idx->strings_len, 1))
+		goto out_bad;
+	idx->images = (const void *)((const uint8_t *)idx->m.data + le64toh(hdr.images_off));
+	idx->tracks = (const void *)((const uint8_t *)idx->m.data + le64toh(hdr.tracks_off));
+	idx->strings = (const char *)idx->m.data + le64toh(hdr.strings_off);
+	if (idx->strings_len && idx->strings[idx->strings_len - 1])
+		goto out_bad;
+	for (uint32_t i = 0; i < idx->numimages; i++) {
+		struct index_image_s image;
+
+		index_image(idx, i, &image);
+		if ((image.path_off >= idx->strings_len)
+			|| ((uint64_t)image.first_track + image.numtracks > idx->numtracks))
+			goto out_bad;
+		// Lookups need them in order.
+		if (i && (strcmp(idx->strings + le32toh(idx->images[i - 1].path_off),
+			idx->strings + image.path_off) >= 0))
+			goto out_bad;
+	}
+	return idx;
+
+out_bad:
+	*errmsg = "damaged index";
+out_unmap:
+	MappedFile_Close(idx->m);
+	errno = EINVAL;
+out_error:
+	e = errno;
+	free(name);
+	free(idx);
+	errno = e;
+	return NULL;
+}
+
+void index_close(struct index_file_s *idx)
+{
+	if (!idx)
+		return;
+	MappedFile_Close(idx->m);
+	free(idx);
+}
+
+size_t index_num_images(const struct index_file_s *idx)
+{
+	return idx->numimages;
+}
+
+void index_image(const struct index_file_s *idx, size_t i, struct index_image_s *image)
+{
+	struct index_image_s stored;
+
+	memcpy(&stored, &idx->images[i], sizeof(stored));
+	image_swap(image, &stored, false);
+}
+
+/* The number of the image at path, or -1 if there isn't one. */
+ssize_t index_find(const struct index_file_s *idx, const char *path)
+{
+	size_t lo = 0, hi = idx->numimages;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = strcmp(path, idx->strings + le32toh(idx->images[mid].path_off));
+
+		if (!c)
+			return mid;
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+const char *index_path(const struct index_file_s *idx, const struct index_image_s *image)
+{
+	return idx->strings + image->path_off;
+}
+
+void index_track(const struct index_file_s *idx, const struct index_image_s *image, unsigned n,
+	struct index_track_s *track)
+{
+	struct index_track_s stored;
+
+	memcpy(&stored, &idx->tracks[image->first_track + n], sizeof(stored));
+	track_swap(track, &stored, false);
+}
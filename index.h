@@ -0,0 +1,90 @@
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A catalog of images, made by --scan. The file holds a header, then one
+ * record per image, sorted by path, then one record per track, then the
+ * paths, each ending in a NUL. Everything is little-endian and at fixed
+ * offsets, so the file can be mapped and searched as it is.
+ */
+#define INDEX_MAGIC	"MDSINDEX"
+#define INDEX_VERSION	1
+
+struct index_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t numimages;
+	uint32_t numtracks;
+	uint32_t strings_len;
+	uint64_t images_off;
+	uint64_t tracks_off;
+	uint64_t strings_off;
+} __attribute__((packed));
+
+enum {
+	INDEX_BAD_MDS = 1,	// the .mds file couldn't be read
+	INDEX_NO_MDF = 2,	// the data couldn't be opened
+	INDEX_PVD = 4,		// the first data track has an ISO9660 volume
+};
+
+struct index_image_s {
+	uint32_t path_off;	// into the paths
+	uint32_t first_track;	// into the track records
+	uint64_t mds_size;
+	int64_t mds_mtime;	// in nanoseconds
+	uint64_t mdf_size;	// of every file the data is stored in
+	uint16_t mediatype;
+	uint16_t numsessions;
+	uint16_t numtracks;
+	uint16_t flags;
+	uint32_t volume_blocks;	// from the primary volume descriptor
+	uint16_t volume_block_size;
+	uint16_t _pad;
+	char volume_id[32];	// as stored, padded with spaces
+} __attribute__((packed));
+
+enum {
+	INDEX_TRACK_DATA = 1,
+};
+
+struct index_track_s {
+	uint8_t session;
+	uint8_t point;
+	uint8_t mode;		// MDS track mode, see mds_trackmode_tostring()
+	uint8_t flags;
+	uint16_t secsize;
+	uint16_t data_len;
+	int32_t lba;
+	uint32_t length;	// in sectors
+} __attribute__((packed));
+
+/* An image to write out. */
+struct index_entry_s {
+	char *path;
+	struct index_image_s image;	// path_off and first_track are filled in
+	struct index_track_s *tracks;	// image.numtracks of them
+};
+
+int index_write(const char *file, struct index_entry_s *entries, size_t n);
+
+/*
+ * A mapped index. Records are handed out as copies in host byte order;
+ * images are numbered in path order.
+ */
+struct index_file_s;
+
+struct index_file_s *index_open(const char *file, const char **errmsg);
+void index_close(struct index_file_s *idx);
+size_t index_num_images(const struct index_file_s *idx);
+void index_image(const struct index_file_s *idx, size_t i, struct index_image_s *image);
+ssize_t index_find(const struct index_file_s *idx, const char *path);
+const char *index_path(const struct index_file_s *idx, const struct index_image_s *image);
+void index_track(const struct index_file_s *idx, const struct index_image_s *image, unsigned n,
+	struct index_track_s *track);
+
+/* _INDEX_H_ */
+#endif
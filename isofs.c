@@ -0,0 +1,1412 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "endian.h"
+#include "extract.h"
+#include "isofs.h"
+#include "libmds.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define BLOCK 2048
+// From the start of the track.
+#define ISO_VD_LBA 16
+#define UDF_ANCHOR_LBA 256
+// How far to look through descriptor sequences and chains before
+// deciding the disc is damaged.
+#define MAX_DESCRIPTORS 64
+#define MAX_HOPS 16
+// Directories nested deeper than this are taken to be a loop.
+#define MAX_DEPTH 64
+#define MAX_DIR_SIZE (64*1024*1024)
+#define BOUNCE_BLOCKS 64
+#define COPY_CHUNK (1024*1024)
+// Smaller files aren't worth splitting between threads.
+#define SPLIT_MIN (16*1024*1024)
+
+enum isofs_type_e {
+	FS_ISO9660,
+	FS_JOLIET,
+	FS_ROCKRIDGE,
+	FS_UDF,
+};
+
+struct udf_partition_s {
+	uint16_t number;
+	uint32_t start;		// sector of logical block 0
+	uint32_t length;	// in blocks
+};
+
+struct isofs_s {
+	struct mds_ctx *ctx;
+	enum isofs_type_e type;
+	struct isofs_file_s root;
+	unsigned susp_skip;	// bytes before the SUSP entries of each record
+	struct udf_partition_s *maps;	// one for each partition map
+	unsigned nummaps;
+	char name[16];
+};
+
+static uint16_t get16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+/*
+ * Read count 2048-byte blocks from lba on, wherever on the disc they
+ * are. Mode 2 tracks without a form keep the subheader in front of each.
+ */
+static int read_blocks(struct isofs_s *fs, uint32_t lba, uint32_t count, uint8_t *buf)
+{
+	uint8_t *bounce = NULL;
+	int rc = -1;
+
+	while (count) {
+		struct mds_track_info_s info;
+		int track = (lba > INT32_MAX) ? -1 : mds_track_for_lba(fs->ctx, lba);
+		uint32_t n = count;
+		ssize_t got;
+
+		if ((track == -1) || mds_get_track(fs->ctx, track, &info) || !info.data
+			|| ((info.data_len != BLOCK) && (info.data_len != BLOCK + 288))) {
+			errno = EIO;
+			goto out;
+		}
+		if (info.data_len == BLOCK) {
+			got = mds_read_sectors(fs->ctx, track, lba, n, buf, MDS_READ_COOKED);
+		} else {
+			if (!bounce && !(bounce = malloc(BOUNCE_BLOCKS * (BLOCK + 288))))
+				goto out;
+			if (n > BOUNCE_BLOCKS)
+				n = BOUNCE_BLOCKS;
+			got = mds_read_sectors(fs->ctx, track, lba, n, bounce, MDS_READ_COOKED);
+			for (ssize_t i = 0; i < got; i++)
+				memcpy(buf + i * BLOCK, bounce + i * (BLOCK + 288) + 8, BLOCK);
+		}
+		if (got <= 0) {
+			if (!got)
+				errno = EIO;
+			goto out;
+		}
+		buf += (size_t)got * BLOCK;
+		lba += got;
+		count -= got;
+	}
+	rc = 0;
+out:
+	free(bounce);
+	return rc;
+}
+
+/* Read len bytes from off bytes into the extent starting at block. */
+static int read_span(struct isofs_s *fs, uint32_t block, uint64_t off, uint8_t *dst, size_t len)
+{
+	uint8_t tmp[BLOCK];
+	uint64_t b = block + off / BLOCK;
+	size_t skip = off % BLOCK;
+
+	if (b + (skip + len + BLOCK - 1) / BLOCK > (uint64_t)UINT32_MAX + 1) {
+		errno = EIO;
+		return -1;
+	}
+	if (skip) {
+		size_t n = (len < BLOCK - skip) ? len : BLOCK - skip;
+		if (read_blocks(fs, b, 1, tmp))
+			return -1;
+		memcpy(dst, tmp + skip, n);
+		dst += n;
+		len -= n;
+		b++;
+	}
+	if (len >= BLOCK) {
+		if (read_blocks(fs, b, len / BLOCK, dst))
+			return -1;
+		dst += len / BLOCK * BLOCK;
+		b += len / BLOCK;
+		len %= BLOCK;
+	}
+	if (len) {
+		if (read_blocks(fs, b, 1, tmp))
+			return -1;
+		memcpy(dst, tmp, len);
+	}
+	return 0;
+}
+
+/* Read up to len bytes of a file from off on; short only at the end. */
+ssize_t isofs_read(struct isofs_s *fs, const struct isofs_file_s *file, uint64_t off,
+	void *buf, size_t len)
+{
+	uint8_t *dst = buf;
+	uint64_t pos = 0;
+	size_t done = 0;
+
+	if (off >= file->size)
+		return 0;
+	if (len > file->size - off)
+		len = file->size - off;
+	if (len > SSIZE_MAX)
+		len = SSIZE_MAX;
+	if (file->inline_data) {
+		memcpy(dst, file->inline_data + off, len);
+		return len;
+	}
+	for (unsigned i = 0; (i < file->numextents) && (done < len); i++) {
+		const struct isofs_extent_s *x = &file->extents[i];
+		uint64_t end = pos + x->len;
+
+		if (off + done < end) {
+			uint64_t rel = off + done - pos;
+			size_t n = (len - done < end - (off + done)) ? len - done : end - (off + done);
+
+			if (x->hole)
+				memset(dst + done, 0, n);
+			else if (read_span(fs, x->block, rel, dst + done, n))
+				return -1;
+			done += n;
+		}
+		pos = end;
+	}
+	// The extents don't cover the whole file.
+	if (done < len) {
+		errno = EIO;
+		return -1;
+	}
+	return done;
+}
+
+static int add_extent(struct isofs_file_s *f, uint32_t block, uint32_t len, bool hole)
+{
+	struct isofs_extent_s *x;
+
+	if (!len)
+		return 0;
+	// There is room for 2^n - 1 of them.
+	if (!(f->numextents & (f->numextents + 1))) {
+		x = realloc(f->extents, (f->numextents * 2 + 1) * sizeof(*x));
+		if (!x)
+			return -1;
+		f->extents = x;
+	}
+	f->extents[f->numextents++] = (struct isofs_extent_s){ .block = block, .len = len, .hole = hole };
+	return 0;
+}
+
+void isofs_free_file(struct isofs_file_s *file)
+{
+	free(file->name);
+	free(file->extents);
+	free(file->inline_data);
+	*file = (struct isofs_file_s){ .name = NULL };
+}
+
+void isofs_free_files(struct isofs_file_s *files, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		isofs_free_file(&files[i]);
+	free(files);
+}
+
+static int copy_file(struct isofs_file_s *dst, const struct isofs_file_s *src)
+{
+	*dst = *src;
+	dst->name = strdup(src->name);
+	dst->extents = src->numextents ? malloc(src->numextents * sizeof(*dst->extents)) : NULL;
+	dst->inline_data = src->inline_data ? malloc(src->size ? src->size : 1) : NULL;
+	if (!dst->name || (src->numextents && !dst->extents) || (src->inline_data && !dst->inline_data)) {
+		isofs_free_file(dst);
+		return -1;
+	}
+	if (src->numextents)
+		memcpy(dst->extents, src->extents, src->numextents * sizeof(*dst->extents));
+	if (src->inline_data)
+		memcpy(dst->inline_data, src->inline_data, src->size);
+	return 0;
+}
+
+/* A file's contents, for reading directories. */
+static uint8_t *load(struct isofs_s *fs, const struct isofs_file_s *file, const char **errmsg)
+{
+	uint8_t *data;
+	ssize_t got;
+
+	if (file->size > MAX_DIR_SIZE) {
+		*errmsg = "directory too big";
+		errno = EINVAL;
+		return NULL;
+	}
+	data = malloc(file->size ? file->size : 1);
+	if (!data)
+		return NULL;
+	got = isofs_read(fs, file, 0, data, file->size);
+	if (got != (ssize_t)file->size) {
+		if (got >= 0)
+			errno = EIO;
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+	int64_t era;
+	unsigned yoe, doy;
+
+	y -= (m <= 2);
+	era = ((y >= 0) ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * ((m > 2) ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* Seconds since the epoch, given a local time and its offset in minutes. */
+static int64_t to_epoch(int64_t year, unsigned month, unsigned day, unsigned hour,
+	unsigned minute, unsigned second, int tz)
+{
+	if ((month < 1) || (month > 12) || (day < 1) || (day > 31))
+		return 0;
+	return days_from_civil(year, month, day) * 86400
+		+ hour * 3600 + minute * 60 + second - tz * 60;
+}
+
+static char *put_utf8(char *p, uint32_t c)
+{
+	if (c < 0x80) {
+		*p++ = c;
+	} else if (c < 0x800) {
+		*p++ = 0xc0 | (c >> 6);
+		*p++ = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		*p++ = 0xe0 | (c >> 12);
+		*p++ = 0x80 | ((c >> 6) & 0x3f);
+		*p++ = 0x80 | (c & 0x3f);
+	} else {
+		*p++ = 0xf0 | (c >> 18);
+		*p++ = 0x80 | ((c >> 12) & 0x3f);
+		*p++ = 0x80 | ((c >> 6) & 0x3f);
+		*p++ = 0x80 | (c & 0x3f);
+	}
+	return p;
+}
+
+/*
+ * Turn a name as stored into UTF-8: single bytes, taken as Latin-1, or
+ * big-endian UTF-16. A version number after a ';' is dropped when asked.
+ */
+static char *decode_name(const uint8_t *s, size_t len, bool wide, bool version)
+{
+	char *name = malloc(len * 2 + 1), *p = name;
+
+	if (!name)
+		return NULL;
+	for (size_t i = 0; i < len; ) {
+		uint32_t c;
+
+		if (wide) {
+			if (i + 2 > len)
+				break;
+			c = (s[i] << 8) | s[i + 1];
+			i += 2;
+			if ((c >= 0xd800) && (c < 0xdc00) && (i + 2 <= len)) {
+				uint32_t lo = (s[i] << 8) | s[i + 1];
+				if ((lo >= 0xdc00) && (lo < 0xe000)) {
+					c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+					i += 2;
+				}
+			}
+		} else {
+			c = s[i++];
+		}
+		if (version && (c == ';'))
+			break;
+		// Nothing from the disc gets to name a path of its own.
+		if (!c || (c == '/'))
+			c = '_';
+		p = put_utf8(p, c);
+	}
+	*p = '\0';
+	return name;
+}
+
+/* Whether a name is safe to create in a directory. */
+static bool usable_name(const char *name)
+{
+	return *name && strcmp(name, ".") && strcmp(name, "..");
+}
+
+//
+// ISO9660, with Joliet and Rock Ridge.
+//
+
+static int64_t iso_time(const uint8_t *t)
+{
+	return to_epoch(1900 + t[0], t[1], t[2], t[3], t[4], t[5], (int8_t)t[6] * 15);
+}
+
+/*
+ * Add a directory record's data to f. Interleaved files are stored as
+ * units of several blocks with gaps between them.
+ */
+static int iso_add_section(struct isofs_file_s *f, const uint8_t *rec)
+{
+	uint32_t block = get32(rec + 2) + rec[1];
+	uint32_t len = get32(rec + 10);
+	uint32_t unit = rec[26] * BLOCK, gap = rec[27];
+
+	f->size += len;
+	if (!unit)
+		return add_extent(f, block, len, false);
+	while (len) {
+		uint32_t n = (len < unit) ? len : unit;
+		if (add_extent(f, block, n, false))
+			return -1;
+		block += rec[26] + gap;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * The Rock Ridge name in a system use area, following any continuation
+ * areas. NULL with errno 0 if there isn't one; *dots is set for the
+ * entries that name the directory itself or its parent.
+ */
+static char *rr_name(struct isofs_s *fs, const uint8_t *su, size_t len, bool *dots)
+{
+	uint8_t *ce = NULL;
+	char *name = NULL;
+	size_t namelen = 0;
+	unsigned hops = 0;
+
+	*dots = false;
+	for (;;) {
+		uint32_t ce_block = 0, ce_off = 0, ce_len = 0;
+
+		while (len >= 4) {
+			unsigned elen = su[2];
+
+			if ((elen < 4) || (elen > len) || !memcmp(su, "ST", 2))
+				break;
+			if (!memcmp(su, "NM", 2) && (elen >= 5)) {
+				char *p = realloc(name, namelen + elen - 5 + 1);
+				if (!p)
+					goto out_error;
+				name = p;
+				memcpy(name + namelen, su + 5, elen - 5);
+				namelen += elen - 5;
+				name[namelen] = '\0';
+				if (su[4] & 6)
+					*dots = true;
+			} else if (!memcmp(su, "CE", 2) && (elen >= 28)) {
+				ce_block = get32(su + 4);
+				ce_off = get32(su + 12);
+				ce_len = get32(su + 20);
+			}
+			su += elen;
+			len -= elen;
+		}
+		if (!ce_len || (++hops > MAX_HOPS) || (ce_off >= BLOCK) || (ce_len > BLOCK - ce_off))
+			break;
+		if (!ce && !(ce = malloc(BLOCK)))
+			goto out_error;
+		// A name that can't be read in full falls back to the ISO9660 one.
+		if (read_blocks(fs, ce_block, 1, ce))
+			break;
+		su = ce + ce_off;
+		len = ce_len;
+	}
+	free(ce);
+	if (name) {
+		for (char *p = name; p < name + namelen; p++) {
+			if (!*p || (*p == '/'))
+				*p = '_';
+		}
+	}
+	errno = 0;
+	return name;
+
+out_error:
+	free(ce);
+	free(name);
+	return NULL;
+}
+
+static int iso_readdir(struct isofs_s *fs, const struct isofs_file_s *dir,
+	struct isofs_file_s **files, size_t *n, const char **errmsg)
+{
+	struct isofs_file_s *list = NULL;
+	size_t num = 0, max = 0;
+	uint8_t *data = load(fs, dir, errmsg);
+	bool more = false, skip = false;
+	int e;
+
+	if (!data)
+		return -1;
+	for (uint64_t off = 0; off < dir->size; ) {
+		const uint8_t *rec = data + off;
+		uint64_t left = BLOCK - off % BLOCK;
+		unsigned namelen, flags;
+		struct isofs_file_s f = { .name = NULL };
+		bool dots = false;
+
+		if (left > dir->size - off)
+			left = dir->size - off;
+		// Records don't cross blocks; the rest of a block is padding.
+		if (!rec[0]) {
+			off += left;
+			continue;
+		}
+		if ((rec[0] < 34) || (rec[0] > left) || (33u + rec[32] > rec[0])) {
+			*errmsg = "damaged directory";
+			errno = EINVAL;
+			goto out_error;
+		}
+		off += rec[0];
+		namelen = rec[32];
+		flags = rec[25];
+
+		// The rest of a file too big for one record.
+		if (more) {
+			more = flags & 0x80;
+			if (!skip && iso_add_section(&list[num - 1], rec))
+				goto out_error;
+			continue;
+		}
+		more = flags & 0x80;
+		skip = true;
+		if ((namelen == 1) && (rec[33] <= 1))
+			continue;
+		// Associated files belong to another file on other systems.
+		if (flags & 0x04)
+			continue;
+
+		if (fs->type == FS_ROCKRIDGE) {
+			size_t su = 33 + namelen + !(namelen & 1) + fs->susp_skip;
+			if (su < rec[0])
+				f.name = rr_name(fs, rec + su, rec[0] - su, &dots);
+			if (!f.name && errno)
+				goto out_error;
+		}
+		if (!f.name)
+			f.name = decode_name(rec + 33, namelen, fs->type == FS_JOLIET, true);
+		if (!f.name)
+			goto out_error;
+		// Plain ISO9660 names always have a dot, even with no extension.
+		if ((fs->type == FS_ISO9660) && !(flags & 0x02)) {
+			size_t len = strlen(f.name);
+			if (len && (f.name[len - 1] == '.'))
+				f.name[len - 1] = '\0';
+		}
+		if (dots || !usable_name(f.name)) {
+			free(f.name);
+			continue;
+		}
+		f.dir = flags & 0x02;
+		f.mtime = iso_time(rec + 18);
+		if (iso_add_section(&f, rec)) {
+			isofs_free_file(&f);
+			goto out_error;
+		}
+		if (num == max) {
+			size_t newmax = max ? max * 2 : 16;
+			struct isofs_file_s *p = realloc(list, newmax * sizeof(*p));
+			if (!p) {
+				isofs_free_file(&f);
+				goto out_error;
+			}
+			list = p;
+			max = newmax;
+		}
+		list[num++] = f;
+		skip = false;
+	}
+	free(data);
+	*files = list;
+	*n = num;
+	return 0;
+
+out_error:
+	e = errno;
+	isofs_free_files(list, num);
+	free(data);
+	errno = e;
+	return -1;
+}
+
+/* A file for the root directory record in a volume descriptor. */
+static int iso_root(struct isofs_s *fs, const uint8_t *vd)
+{
+	const uint8_t *rec = vd + 156;
+
+	fs->root = (struct isofs_file_s){ .dir = true, .mtime = iso_time(rec + 18) };
+	fs->root.name = strdup("");
+	if (!fs->root.name)
+		return -1;
+	return iso_add_section(&fs->root, rec);
+}
+
+/* Whether the root directory says Rock Ridge is in use, and how. */
+static void iso_find_susp(struct isofs_s *fs)
+{
+	uint8_t buf[BLOCK];
+	const uint8_t *rec = buf, *su;
+
+	if (!fs->root.numextents || read_blocks(fs, fs->root.extents[0].block, 1, buf))
+		return;
+	if ((rec[0] < 34 + 7) || (rec[32] != 1))
+		return;
+	su = rec + 34;
+	if (!memcmp(su, "SP", 2) && (su[2] == 7) && (su[4] == 0xbe) && (su[5] == 0xef)) {
+		fs->type = FS_ROCKRIDGE;
+		fs->susp_skip = su[6];
+	}
+}
+
+/*
+ * Mount the volume whose descriptors start at lba. Returns 1 if there
+ * isn't one.
+ */
+static int iso_open(struct isofs_s *fs, uint32_t lba, const char **errmsg)
+{
+	uint8_t vd[BLOCK], pvd[BLOCK], svd[BLOCK];
+	bool have_pvd = false, have_svd = false;
+
+	for (unsigned i = 0; i < MAX_DESCRIPTORS; i++) {
+		if (read_blocks(fs, lba + ISO_VD_LBA + i, 1, vd))
+			return (i || (errno != EIO)) ? -1 : 1;
+		if (memcmp(vd + 1, "CD001", 5) || (vd[6] != 1))
+			break;
+		if (vd[0] == 255)
+			break;
+		if ((vd[0] == 1) && !have_pvd) {
+			memcpy(pvd, vd, BLOCK);
+			have_pvd = true;
+		} else if ((vd[0] == 2) && !have_svd && (vd[88] == '%') && (vd[89] == '/')
+			&& ((vd[90] == '@') || (vd[90] == 'C') || (vd[90] == 'E'))) {
+			memcpy(svd, vd, BLOCK);
+			have_svd = true;
+		}
+	}
+	if (!have_pvd)
+		return 1;
+	if (get16(pvd + 128) != BLOCK) {
+		*errmsg = "ISO9660 blocks other than 2048 bytes aren't supported";
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Rock Ridge names are the most faithful, then Joliet's.
+	fs->type = FS_ISO9660;
+	if (iso_root(fs, pvd))
+		return -1;
+	iso_find_susp(fs);
+	if ((fs->type == FS_ISO9660) && have_svd) {
+		isofs_free_file(&fs->root);
+		fs->type = FS_JOLIET;
+		if (iso_root(fs, svd))
+			return -1;
+	}
+	strcpy(fs->name, (fs->type == FS_ROCKRIDGE) ? "Rock Ridge" : (fs->type == FS_JOLIET) ? "Joliet" : "ISO9660");
+	return 0;
+}
+
+//
+// UDF, up to revision 2.01: physical and sparable partitions, but not
+// virtual (VAT) or metadata ones.
+//
+
+enum {
+	UDF_TAG_PD = 5,
+	UDF_TAG_LVD = 6,
+	UDF_TAG_TD = 8,
+	UDF_TAG_FSD = 256,
+	UDF_TAG_FID = 257,
+	UDF_TAG_AED = 258,
+	UDF_TAG_IE = 259,
+	UDF_TAG_FE = 261,
+	UDF_TAG_EFE = 266,
+};
+
+/* Whether b starts with a descriptor tag with a good checksum. */
+static bool udf_tag(const uint8_t *b, uint16_t id)
+{
+	uint8_t sum = 0;
+
+	for (unsigned i = 0; i < 16; i++) {
+		if (i != 4)
+			sum += b[i];
+	}
+	return (sum == b[4]) && (get16(b) == id);
+}
+
+static int64_t udf_time(const uint8_t *t)
+{
+	uint16_t typetz = get16(t);
+	int tz = typetz & 0xfff;
+
+	if (tz & 0x800)
+		tz -= 0x1000;
+	// Times recorded without a zone are taken as UTC.
+	if (((typetz >> 12) != 1) || (tz < -1440) || (tz > 1440))
+		tz = 0;
+	return to_epoch((int16_t)get16(t + 2), t[4], t[5], t[6], t[7], t[8], tz);
+}
+
+/* Where a block of a partition is on the disc, or -1. */
+static int64_t udf_block(const struct isofs_s *fs, uint16_t partref, uint32_t lbn)
+{
+	if ((partref >= fs->nummaps) || (lbn >= fs->maps[partref].length))
+		return -1;
+	return (int64_t)fs->maps[partref].start + lbn;
+}
+
+/*
+ * Read the block at lbn of a partition, expecting a descriptor of type
+ * id, or of any type for 0.
+ */
+static int udf_read(struct isofs_s *fs, uint16_t partref, uint32_t lbn, uint8_t *buf,
+	uint16_t id, const char **errmsg)
+{
+	int64_t block = udf_block(fs, partref, lbn);
+
+	if ((block < 0) || (block > UINT32_MAX)) {
+		*errmsg = "damaged UDF filesystem";
+		errno = EINVAL;
+		return -1;
+	}
+	if (read_blocks(fs, block, 1, buf))
+		return -1;
+	if (!udf_tag(buf, id ? id : get16(buf)) || (get32(buf + 12) != lbn)) {
+		*errmsg = "damaged UDF filesystem";
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Add the extents described by a list of allocation descriptors. */
+static int udf_add_ads(struct isofs_s *fs, struct isofs_file_s *f, uint16_t partref,
+	const uint8_t *ads, uint32_t len, bool long_ad, const char **errmsg)
+{
+	const unsigned adlen = long_ad ? 16 : 8;
+	uint8_t *next = NULL;
+	unsigned hops = 0;
+	int rc = -1;
+
+	for (uint32_t off = 0; off + adlen <= len; ) {
+		const uint8_t *ad = ads + off;
+		uint32_t elen = get32(ad) & 0x3fffffff, type = get32(ad) >> 30;
+		uint32_t lbn = get32(ad + 4);
+		uint16_t ref = long_ad ? get16(ad + 8) : partref;
+		int64_t block;
+
+		if (!elen)
+			break;
+		// The list goes on in another block.
+		if (type == 3) {
+			if (++hops > MAX_DESCRIPTORS) {
+				*errmsg = "damaged UDF filesystem";
+				errno = EINVAL;
+				goto out;
+			}
+			if (!next && !(next = malloc(BLOCK)))
+				goto out;
+			if (udf_read(fs, ref, lbn, next, UDF_TAG_AED, errmsg))
+				goto out;
+			ads = next + 24;
+			len = get32(next + 20);
+			if (len > BLOCK - 24)
+				len = BLOCK - 24;
+			off = 0;
+			continue;
+		}
+		block = udf_block(fs, ref, lbn);
+		if ((type == 0) && ((block < 0) || (block > UINT32_MAX))) {
+			*errmsg = "damaged UDF filesystem";
+			errno = EINVAL;
+			goto out;
+		}
+		if (add_extent(f, (type == 0) ? block : 0, elen, type != 0))
+			goto out;
+		off += adlen;
+	}
+	rc = 0;
+out:
+	free(next);
+	return rc;
+}
+
+/*
+ * The file whose ICB is at lbn of a partition. Returns 1 for things
+ * other than files and directories, which are left out.
+ */
+static int udf_file(struct isofs_s *fs, uint16_t partref, uint32_t lbn, struct isofs_file_s *f,
+	const char **errmsg)
+{
+	uint8_t b[BLOCK];
+	uint32_t lea, lad, base;
+	unsigned hops = 0;
+	uint16_t id;
+
+	*f = (struct isofs_file_s){ .name = NULL };
+	for (;;) {
+		if (udf_read(fs, partref, lbn, b, 0, errmsg))
+			return -1;
+		id = get16(b);
+		if (id != UDF_TAG_IE)
+			break;
+		// Write-once media point from one entry to its replacement.
+		if (++hops > MAX_HOPS) {
+			*errmsg = "damaged UDF filesystem";
+			errno = EINVAL;
+			return -1;
+		}
+		lbn = get32(b + 40);
+		partref = get16(b + 44);
+	}
+	if ((id != UDF_TAG_FE) && (id != UDF_TAG_EFE)) {
+		*errmsg = "damaged UDF filesystem";
+		errno = EINVAL;
+		return -1;
+	}
+	if ((b[27] != 4) && (b[27] != 5))
+		return 1;
+
+	f->dir = (b[27] == 4);
+	f->size = get64(b + 56);
+	f->mtime = udf_time(b + ((id == UDF_TAG_FE) ? 84 : 92));
+	base = (id == UDF_TAG_FE) ? 176 : 216;
+	lea = get32(b + base - 8);
+	lad = get32(b + base - 4);
+	if ((lea > BLOCK - base) || (lad > BLOCK - base - lea)) {
+		*errmsg = "damaged UDF filesystem";
+		errno = EINVAL;
+		return -1;
+	}
+	switch (get16(b + 34) & 7) {
+	case 0:
+	case 1:
+		if (udf_add_ads(fs, f, partref, b + base + lea, lad, get16(b + 34) & 1, errmsg)) {
+			isofs_free_file(f);
+			return -1;
+		}
+		return 0;
+	case 3:
+		if (f->size > lad) {
+			*errmsg = "damaged UDF filesystem";
+			errno = EINVAL;
+			return -1;
+		}
+		f->inline_data = malloc(f->size ? f->size : 1);
+		if (!f->inline_data)
+			return -1;
+		memcpy(f->inline_data, b + base + lea, f->size);
+		return 0;
+	default:
+		*errmsg = "UDF extended allocation descriptors aren't supported";
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/* A file identifier: an OSTA compressed Unicode string. */
+static char *udf_name(const uint8_t *s, size_t len)
+{
+	if (!len)
+		return strdup("");
+	switch (s[0]) {
+	case 8:
+	case 254:
+		return decode_name(s + 1, len - 1, false, false);
+	case 16:
+	case 255:
+		return decode_name(s + 1, len - 1, true, false);
+	default:
+		return strdup("");
+	}
+}
+
+static int udf_readdir(struct isofs_s *fs, const struct isofs_file_s *dir,
+	struct isofs_file_s **files, size_t *n, const char **errmsg)
+{
+	struct isofs_file_s *list = NULL;
+	size_t num = 0, max = 0;
+	uint8_t *data = load(fs, dir, errmsg);
+	int e;
+
+	if (!data)
+		return -1;
+	for (uint64_t off = 0; off + 38 <= dir->size; ) {
+		const uint8_t *fid = data + off;
+		unsigned chars = fid[18], lfi = fid[19], liu = get16(fid + 36);
+		struct isofs_file_s f;
+		int rc;
+
+		if (!udf_tag(fid, UDF_TAG_FID) || (38 + liu + lfi > dir->size - off)) {
+			*errmsg = "damaged directory";
+			errno = EINVAL;
+			goto out_error;
+		}
+		off += (38 + liu + lfi + 3) & ~3u;
+		// Deleted files and the parent directory.
+		if (chars & 0x0c)
+			continue;
+		rc = udf_file(fs, get16(fid + 28), get32(fid + 24), &f, errmsg);
+		if (rc < 0)
+			goto out_error;
+		if (rc)
+			continue;
+		f.name = udf_name(fid + 38 + liu, lfi);
+		if (!f.name) {
+			isofs_free_file(&f);
+			goto out_error;
+		}
+		if (!usable_name(f.name)) {
+			isofs_free_file(&f);
+			continue;
+		}
+		if (num == max) {
+			size_t newmax = max ? max * 2 : 16;
+			struct isofs_file_s *p = realloc(list, newmax * sizeof(*p));
+			if (!p) {
+				isofs_free_file(&f);
+				goto out_error;
+			}
+			list = p;
+			max = newmax;
+		}
+		list[num++] = f;
+	}
+	free(data);
+	*files = list;
+	*n = num;
+	return 0;
+
+out_error:
+	e = errno;
+	isofs_free_files(list, num);
+	free(data);
+	errno = e;
+	return -1;
+}
+
+/* The partition descriptors and logical volume in a descriptor sequence. */
+struct udf_vds_s {
+	struct udf_partition_s parts[8];
+	unsigned numparts;
+	uint8_t lvd[BLOCK];
+	bool have_lvd;
+};
+
+static int udf_read_vds(struct isofs_s *fs, uint32_t lba, uint32_t len, struct udf_vds_s *vds)
+{
+	uint8_t b[BLOCK];
+
+	vds->numparts = 0;
+	vds->have_lvd = false;
+	for (uint32_t i = 0; (i < len / BLOCK) && (i < MAX_DESCRIPTORS); i++) {
+		if (read_blocks(fs, lba + i, 1, b))
+			return -1;
+		if (udf_tag(b, UDF_TAG_TD) || !udf_tag(b, get16(b)) || (get32(b + 12) != lba + i))
+			break;
+		if ((get16(b) == UDF_TAG_PD) && (vds->numparts < 8)) {
+			vds->parts[vds->numparts++] = (struct udf_partition_s){
+				.number = get16(b + 22),
+				.start = get32(b + 188),
+				.length = get32(b + 192),
+			};
+		} else if (get16(b) == UDF_TAG_LVD) {
+			memcpy(vds->lvd, b, BLOCK);
+			vds->have_lvd = true;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Mount the volume whose anchor is at lba + 256. Returns 1 if there
+ * isn't one, or it's of a kind that isn't supported, with *errmsg
+ * saying which.
+ */
+static int udf_open(struct isofs_s *fs, uint32_t lba, const char **errmsg)
+{
+	uint8_t b[BLOCK];
+	struct udf_vds_s vds;
+	const uint8_t *lvd = vds.lvd, *map;
+	uint32_t maplen, nummaps;
+	uint16_t rev;
+	int rc;
+
+	if (read_blocks(fs, lba + UDF_ANCHOR_LBA, 1, b))
+		return (errno == EIO) ? 1 : -1;
+	if (!udf_tag(b, 2) || (get32(b + 12) != lba + UDF_ANCHOR_LBA))
+		return 1;
+	// The main sequence, or else its reserve copy.
+	if (udf_read_vds(fs, get32(b + 20), get32(b + 16), &vds) || !vds.have_lvd || !vds.numparts) {
+		if (udf_read_vds(fs, get32(b + 28), get32(b + 24), &vds))
+			return -1;
+	}
+	if (!vds.have_lvd || !vds.numparts)
+		return 1;
+	if (get32(lvd + 212) != BLOCK) {
+		*errmsg = "UDF blocks other than 2048 bytes aren't supported";
+		return 1;
+	}
+	rev = get16(lvd + 216 + 24);
+
+	maplen = get32(lvd + 264);
+	nummaps = get32(lvd + 268);
+	if ((maplen > BLOCK - 440) || !nummaps || (nummaps > 8))
+		return 1;
+	fs->maps = calloc(nummaps, sizeof(*fs->maps));
+	if (!fs->maps)
+		return -1;
+	map = lvd + 440;
+	for (unsigned i = 0; i < nummaps; i++) {
+		uint16_t number;
+		bool found = false;
+
+		if ((map + 2 > lvd + 440 + maplen) || (map[1] < 6) || (map + map[1] > lvd + 440 + maplen))
+			return 1;
+		if (map[0] == 1) {
+			number = get16(map + 4);
+		} else if ((map[0] == 2) && (map[1] >= 40) && !memcmp(map + 5, "*UDF Sparable Partition", 23)) {
+			// Sparing only moves blocks that went bad on the disc
+			// it was written to; the image has them where they are.
+			number = get16(map + 38);
+		} else {
+			*errmsg = "UDF virtual and metadata partitions aren't supported";
+			return 1;
+		}
+		for (unsigned p = 0; p < vds.numparts; p++) {
+			if (vds.parts[p].number == number) {
+				fs->maps[i] = vds.parts[p];
+				found = true;
+			}
+		}
+		if (!found)
+			return 1;
+		map += map[1];
+	}
+	fs->nummaps = nummaps;
+
+	// The file set descriptor leads to the root directory.
+	if (udf_read(fs, get16(lvd + 256), get32(lvd + 252), b, UDF_TAG_FSD, errmsg))
+		return -1;
+	rc = udf_file(fs, get16(b + 408), get32(b + 404), &fs->root, errmsg);
+	if (rc < 0)
+		return -1;
+	if (rc || !fs->root.dir) {
+		*errmsg = "damaged UDF filesystem";
+		errno = EINVAL;
+		return -1;
+	}
+	fs->root.name = strdup("");
+	if (!fs->root.name)
+		return -1;
+	fs->type = FS_UDF;
+	snprintf(fs->name, sizeof(fs->name), "UDF %x.%02x", rev >> 8, rev & 0xff);
+	return 0;
+}
+
+//
+// Opening, finding and copying out.
+//
+
+/*
+ * Mount the filesystem on a data track; mds_open_data() must have been
+ * called. UDF is preferred where a disc has both, as DVDs usually do.
+ * Problems with the filesystem itself are described in *errmsg.
+ */
+struct isofs_s *isofs_open(struct mds_ctx *ctx, unsigned track, const char **errmsg)
+{
+	struct isofs_s *fs = calloc(1, sizeof(*fs));
+	struct mds_track_info_s info;
+	const char *udfmsg = NULL;
+	int rc, e;
+
+	*errmsg = NULL;
+	if (!fs)
+		return NULL;
+	fs->ctx = ctx;
+	if (mds_get_track(ctx, track, &info))
+		goto out_error;
+	if (!info.data || ((info.data_len != BLOCK) && (info.data_len != BLOCK + 288))) {
+		*errmsg = "no filesystem on a track without 2048-byte blocks";
+		errno = EINVAL;
+		goto out_error;
+	}
+
+	rc = udf_open(fs, info.lba, &udfmsg);
+	if (!rc)
+		return fs;
+	if ((rc < 0) && (errno == ENOMEM))
+		goto out_error;
+	// UDF that can't be read may still have an ISO9660 side, as on
+	// bridge discs; if not, what was wrong with it is the news.
+	e = (rc < 0) ? errno : EINVAL;
+	isofs_free_file(&fs->root);
+	free(fs->maps);
+	fs->maps = NULL;
+	fs->nummaps = 0;
+	rc = iso_open(fs, info.lba, errmsg);
+	if (rc < 0)
+		goto out_error;
+	if (rc) {
+		*errmsg = udfmsg ? udfmsg : "no ISO9660 or UDF filesystem";
+		errno = e;
+		goto out_error;
+	}
+	return fs;
+
+out_error:
+	e = errno;
+	isofs_close(fs);
+	errno = e;
+	return NULL;
+}
+
+void isofs_close(struct isofs_s *fs)
+{
+	if (!fs)
+		return;
+	isofs_free_file(&fs->root);
+	free(fs->maps);
+	free(fs);
+}
+
+/* "ISO9660", "Joliet", "Rock Ridge" or "UDF" and its revision. */
+const char *isofs_type(const struct isofs_s *fs)
+{
+	return fs->name;
+}
+
+/* The files in a directory, in the order they are stored. */
+int isofs_readdir(struct isofs_s *fs, const struct isofs_file_s *dir,
+	struct isofs_file_s **files, size_t *n, const char **errmsg)
+{
+	*errmsg = NULL;
+	if (!dir->dir) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	if (fs->type == FS_UDF)
+		return udf_readdir(fs, dir, files, n, errmsg);
+	return iso_readdir(fs, dir, files, n, errmsg);
+}
+
+/*
+ * Find the file at path, from the root whether or not path starts with
+ * a '/'. Names that differ only in case match if nothing matches
+ * exactly, since ISO9660 names are all in capitals.
+ */
+int isofs_lookup(struct isofs_s *fs, const char *path, struct isofs_file_s *file,
+	const char **errmsg)
+{
+	struct isofs_file_s cur;
+	int e;
+
+	*errmsg = NULL;
+	if (copy_file(&cur, &fs->root))
+		return -1;
+	while (*path) {
+		size_t len = strcspn(path, "/");
+		struct isofs_file_s *files;
+		size_t n, match = SIZE_MAX;
+
+		if (!len || ((len == 1) && (path[0] == '.'))) {
+			path += len + (path[len] == '/');
+			continue;
+		}
+		if (isofs_readdir(fs, &cur, &files, &n, errmsg))
+			goto out_error;
+		for (size_t i = 0; i < n; i++) {
+			if ((strlen(files[i].name) != len) || strncasecmp(files[i].name, path, len))
+				continue;
+			if (!strncmp(files[i].name, path, len)) {
+				match = i;
+				break;
+			}
+			if (match == SIZE_MAX)
+				match = i;
+		}
+		if (match == SIZE_MAX) {
+			isofs_free_files(files, n);
+			errno = ENOENT;
+			goto out_error;
+		}
+		isofs_free_file(&cur);
+		cur = files[match];
+		files[match] = (struct isofs_file_s){ .name = NULL };
+		isofs_free_files(files, n);
+		path += len + (path[len] == '/');
+	}
+	*file = cur;
+	return 0;
+
+out_error:
+	e = errno;
+	isofs_free_file(&cur);
+	errno = e;
+	return -1;
+}
+
+static int pwrite_full(int fd, const uint8_t *p, size_t len, uint64_t off)
+{
+	while (len) {
+		ssize_t rc = pwrite(fd, p, len, off);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += rc;
+		len -= rc;
+		off += rc;
+	}
+	return 0;
+}
+
+/* One thread's share of a file. */
+struct copy_s {
+	pthread_t thread;
+	struct isofs_s *fs;
+	const struct isofs_file_s *file;
+	int fd;
+	bool seekable;
+	uint64_t off;
+	uint64_t len;
+	int rc;
+	int err;
+};
+
+static int copy_part(struct copy_s *c)
+{
+	uint8_t *buf = malloc(COPY_CHUNK);
+	uint64_t off = c->off, left = c->len;
+	int rc = -1;
+
+	if (!buf)
+		return -1;
+	while (left) {
+		size_t n = (left < COPY_CHUNK) ? left : COPY_CHUNK;
+		ssize_t got = isofs_read(c->fs, c->file, off, buf, n);
+
+		if (got != (ssize_t)n) {
+			if (got >= 0)
+				errno = EIO;
+			goto out;
+		}
+		if (c->seekable ? pwrite_full(c->fd, buf, n, off) : write_full(c->fd, buf, n))
+			goto out;
+		off += n;
+		left -= n;
+	}
+	rc = 0;
+out:
+	free(buf);
+	return rc;
+}
+
+static void *copy_worker(void *arg)
+{
+	struct copy_s *c = arg;
+
+	c->rc = copy_part(c);
+	c->err = c->rc ? errno : 0;
+	return NULL;
+}
+
+/*
+ * Copy a file's contents to fd. Big files are cut into a range per
+ * thread, each read and written independently, so that the reads can
+ * be in flight together.
+ */
+static int copy_out(struct isofs_s *fs, const struct isofs_file_s *file, int fd, unsigned nthreads)
+{
+	struct copy_s one = { .fs = fs, .file = file, .fd = fd, .len = file->size };
+	struct copy_s *copies;
+	uint64_t per, off = 0;
+	unsigned started;
+	int rc = 0, e = 0;
+
+	one.seekable = (lseek(fd, 0, SEEK_CUR) != -1);
+	if ((file->size < SPLIT_MIN) || (nthreads < 2) || !one.seekable)
+		return copy_part(&one);
+#ifdef __linux__
+	rc = posix_fallocate(fd, 0, file->size);
+	if (rc && (rc != EOPNOTSUPP) && (rc != EINVAL)) {
+		errno = rc;
+		return -1;
+	}
+	rc = 0;
+#endif
+
+	copies = calloc(nthreads, sizeof(*copies));
+	if (!copies)
+		return -1;
+	// Whole blocks for each, so no two threads read the same one.
+	per = (file->size / nthreads + BLOCK - 1) / BLOCK * BLOCK;
+	for (started = 0; (started < nthreads) && (off < file->size); started++) {
+		struct copy_s *c = &copies[started];
+
+		*c = one;
+		c->off = off;
+		c->len = (file->size - off < per) ? file->size - off : per;
+		off += c->len;
+		e = pthread_create(&c->thread, NULL, copy_worker, c);
+		if (e) break;
+	}
+	for (unsigned i = 0; i < started; i++) {
+		pthread_join(copies[i].thread, NULL);
+		if (copies[i].rc && !rc) {
+			rc = -1;
+			e = copies[i].err;
+		}
+	}
+	if (off < file->size)
+		rc = -1;
+	free(copies);
+	if (rc)
+		errno = e;
+	return rc;
+}
+
+static void set_times(int fd, const char *path, int64_t mtime)
+{
+	const struct timespec times[2] = {
+		{ .tv_sec = mtime },
+		{ .tv_sec = mtime },
+	};
+
+	// The contents are what matter.
+	if (fd != -1)
+		(void)futimens(fd, times);
+	else
+		(void)utimensat(AT_FDCWD, path, times, 0);
+}
+
+static int extract_file(struct isofs_s *fs, const struct isofs_file_s *file, const char *path,
+	const struct isofs_extract_opts_s *opts)
+{
+	int fd, e;
+
+	if (!strcmp(path, "-"))
+		return copy_out(fs, file, STDOUT_FILENO, 1);
+	fd = open(path, O_WRONLY | O_CREAT | O_BINARY | (opts->force ? O_TRUNC : O_EXCL), 0666);
+	if (fd == -1)
+		return -1;
+	if (copy_out(fs, file, fd, opts->nthreads)) {
+		e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	set_times(fd, path, file->mtime);
+	return close(fd);
+}
+
+static int extract_tree(struct isofs_s *fs, const struct isofs_file_s *dir, const char *path,
+	const struct isofs_extract_opts_s *opts, unsigned depth, const char **errmsg)
+{
+	struct isofs_file_s *files;
+	struct stat sb;
+	size_t n, pathlen = strlen(path);
+	int rc = 0, e;
+
+	if (depth > MAX_DEPTH) {
+		*errmsg = "directories nested too deeply";
+		errno = ELOOP;
+		return -1;
+	}
+	// Directories that are already there are filled in.
+	if (mkdir(path, 0777) && ((errno != EEXIST) || stat(path, &sb) || !S_ISDIR(sb.st_mode)))
+		return -1;
+	if (isofs_readdir(fs, dir, &files, &n, errmsg))
+		return -1;
+	for (size_t i = 0; !rc && (i < n); i++) {
+		char *sub = malloc(pathlen + 1 + strlen(files[i].name) + 1);
+
+		if (!sub) {
+			rc = -1;
+			break;
+		}
+		sprintf(sub, "%s%s%s", path, (pathlen && (path[pathlen - 1] == '/')) ? "" : "/", files[i].name);
+		if (files[i].dir)
+			rc = extract_tree(fs, &files[i], sub, opts, depth + 1, errmsg);
+		else
+			rc = extract_file(fs, &files[i], sub, opts);
+		free(sub);
+	}
+	e = errno;
+	isofs_free_files(files, n);
+	if (!rc)
+		set_times(-1, path, dir->mtime);
+	errno = e;
+	return rc;
+}
+
+/*
+ * Copy a file or a whole directory out to dest. As with cp, anything
+ * but the root goes inside dest if that is a directory already. A file
+ * can go to stdout as "-". Files that are already there are only
+ * replaced with opts->force.
+ */
+int isofs_extract(struct isofs_s *fs, const struct isofs_file_s *file, const char *dest,
+	const struct isofs_extract_opts_s *opts, const char **errmsg)
+{
+	struct stat sb;
+	char *path = NULL;
+	int rc, e;
+
+	*errmsg = NULL;
+	if (file->dir && !strcmp(dest, "-")) {
+		*errmsg = "can't write a directory to stdout";
+		errno = EINVAL;
+		return -1;
+	}
+	if (*file->name && strcmp(dest, "-") && !stat(dest, &sb) && S_ISDIR(sb.st_mode)) {
+		size_t len = strlen(dest);
+
+		path = malloc(len + 1 + strlen(file->name) + 1);
+		if (!path)
+			return -1;
+		sprintf(path, "%s%s%s", dest, (len && (dest[len - 1] == '/')) ? "" : "/", file->name);
+		dest = path;
+	}
+	if (file->dir)
+		rc = extract_tree(fs, file, dest, opts, 0, errmsg);
+	else
+		rc = extract_file(fs, file, dest, opts);
+	e = errno;
+	free(path);
+	errno = e;
+	return rc;
+}
@@ -0,0 +1,57 @@
+#ifndef _ISOFS_H_
+#define _ISOFS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Read-only access to the filesystem on a data track, read straight out
+ * of the MDF through libmds: UDF if there is one, or else ISO9660, with
+ * Rock Ridge or Joliet names when it has them. Only the sectors of the
+ * descriptors, directories and files asked for are read.
+ */
+struct isofs_s;
+struct mds_ctx;
+
+/* A run of a file's data on the disc. */
+struct isofs_extent_s {
+	uint32_t block;		// first 2048-byte sector, by LBA
+	uint32_t len;		// in bytes
+	bool hole;		// nothing recorded; reads as zeros
+};
+
+struct isofs_file_s {
+	char *name;		// UTF-8; empty for the root
+	bool dir;
+	uint64_t size;
+	int64_t mtime;		// seconds since the epoch, UTC
+	struct isofs_extent_s *extents;
+	unsigned numextents;
+	uint8_t *inline_data;	// size bytes kept in the UDF file entry itself
+};
+
+struct isofs_extract_opts_s {
+	unsigned nthreads;	// for copying each large file
+	bool force;		// replace files that are already there
+};
+
+struct isofs_s *isofs_open(struct mds_ctx *ctx, unsigned track, const char **errmsg);
+void isofs_close(struct isofs_s *fs);
+const char *isofs_type(const struct isofs_s *fs);
+
+int isofs_lookup(struct isofs_s *fs, const char *path, struct isofs_file_s *file,
+	const char **errmsg);
+int isofs_readdir(struct isofs_s *fs, const struct isofs_file_s *dir,
+	struct isofs_file_s **files, size_t *n, const char **errmsg);
+void isofs_free_file(struct isofs_file_s *file);
+void isofs_free_files(struct isofs_file_s *files, size_t n);
+
+ssize_t isofs_read(struct isofs_s *fs, const struct isofs_file_s *file, uint64_t off,
+	void *buf, size_t len);
+int isofs_extract(struct isofs_s *fs, const struct isofs_file_s *file, const char *dest,
+	const struct isofs_extract_opts_s *opts, const char **errmsg);
+
+/* _ISOFS_H_ */
+#endif
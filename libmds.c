@@ -0,0 +1,680 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "endian.h"
+#include "libmds.h"
+#include "mapfile.h"
+#include "mdsfmt.h"
+
+// Raw sectors read at once for a cooked read, a little over 1 MiB.
+#define READ_BATCH	448
+
+struct trackmode_info_s {
+	enum trackmode_e trackmode;
+	unsigned data_len;
+	unsigned data_off;
+	bool last;
+};
+
+static const struct trackmode_info_s trackmode_infos[] = {
+	{ TM_NONE, 0, 0 },
+	{ TM_DVD, 0x800, 0 },
+	{ TM_AUDIO, 0x930, 0 },
+	{ TM_MODE1, 0x800, 0x10 },
+	{ TM_MODE2, 0x920, 0x10 },
+	{ TM_MODE2_FORM1, 0x800, 0x18 },
+	{ TM_MODE2_FORM2, 0x914, 0x18 },
+	{ TM_MODE2_SUB, 0x800, 0x18 },
+	{ .last = true },
+};
+
+struct track_entry_s {
+	struct mds_track_info_s info;
+	char **filenames;	// the files holding the track, in order
+	unsigned numfiles;
+};
+
+struct mds_ctx {
+	char *mdsfile;
+	struct mds_s header;
+	struct session_s *sessions;
+	unsigned numsessions;
+	struct track_s *blocks;		// every track block of every session, including A0h etc.
+	unsigned numblocks;
+	struct track_entry_s *tracks;	// just the real tracks, sorted by LBA
+	unsigned numtracks;
+	struct MappedConcat_s mdf;
+};
+
+const char *mds_mediatype_tostring(const uint16_t mediatype)
+{
+	switch (mediatype) {
+	case 0: return "CD-ROM";
+	case 1: return "CD-R";
+	case 2: return "CD-RW";
+	case 16: return "DVD-ROM";
+	case 18: return "DVD-R";
+	default: return "(unknown)";
+	}
+}
+
+const char *mds_trackmode_tostring(const unsigned trackmode)
+{
+	switch (trackmode) {
+	case TM_NONE: return "(lead-in)";
+	case TM_DVD: return "DVD";
+	case TM_AUDIO: return "AUDIO";
+	case TM_MODE1: return "MODE1";
+	case TM_MODE2: return "MODE2";
+	case TM_MODE2_FORM1: return "MODE2_FORM1";
+	case TM_MODE2_FORM2: return "MODE2_FORM2";
+	case TM_MODE2_SUB: return "MODE2 (with subchannels)";
+	default: return "(unknown)";
+	}
+}
+
+static struct trackmode_info_s get_info_for_trackmode(const enum trackmode_e trackmode)
+{
+	for (size_t idx = 0; !trackmode_infos[idx].last; idx++) {
+		if (trackmode == trackmode_infos[idx].trackmode)
+			return trackmode_infos[idx];
+	}
+	return (struct trackmode_info_s) { .last = true };
+}
+
+static void mds_ntoh(struct mds_s *mds)
+{
+	mds->mediatype = le16toh(mds->mediatype);
+	mds->numsessions = le16toh(mds->numsessions);
+	mds->bca_len = le16toh(mds->bca_len);
+	mds->bca_off = le32toh(mds->bca_off);
+	mds->discstruct_off = le32toh(mds->discstruct_off);
+	mds->session_off = le32toh(mds->session_off);
+	mds->dpm_off = le32toh(mds->dpm_off);
+}
+
+static void session_ntoh(struct session_s *session)
+{
+	session->sec_first = le32toh(session->sec_first);
+	session->sec_last = le32toh(session->sec_last);
+	session->numsession = le16toh(session->numsession);
+	session->track_first = le16toh(session->track_first);
+	session->track_last = le16toh(session->track_last);
+	session->track_off = le32toh(session->track_off);
+}
+
+static void track_ntoh(struct track_s *track)
+{
+	track->indexblock_off = le32toh(track->indexblock_off);
+	track->secsize = le16toh(track->secsize);
+	track->sec_first = le32toh(track->sec_first);
+	track->sec_off = le64toh(track->sec_off);
+	track->filenames_num = le32toh(track->filenames_num);
+	track->filenames_off = le32toh(track->filenames_off);
+}
+
+static void index_ntoh(struct index_s *index)
+{
+	index->index0_len = le32toh(index->index0_len);
+	index->index1_len = le32toh(index->index1_len);
+}
+
+static void filename_ntoh(struct filename_s *fn)
+{
+	fn->off = le32toh(fn->off);
+}
+
+/* Read the whole MDS file; they're only ever a few kilobytes. */
+static uint8_t *slurp(const char *filename, size_t *len)
+{
+	FILE *f;
+	uint8_t *buf = NULL;
+	size_t cap = 0, got = 0;
+
+	f = fopen(filename, "rb");
+	if (!f)
+		return NULL;
+	for (;;) {
+		if (got == cap) {
+			uint8_t *nbuf;
+			cap = cap ? cap * 2 : 4096;
+			nbuf = realloc(buf, cap + 1);
+			if (!nbuf) goto out_error;
+			buf = nbuf;
+		}
+		got += fread(buf + got, 1, cap - got, f);
+		if (ferror(f)) goto out_error;
+		if (feof(f)) break;
+	}
+	fclose(f);
+	buf[got] = '\0';
+	*len = got;
+	return buf;
+
+out_error:
+	free(buf);
+	fclose(f);
+	return NULL;
+}
+
+/*
+ * Pull a filename out of the MDS. Format 0 names are 8-bit characters;
+ * format 1 names are UTF-16LE, which we turn into UTF-8.
+ */
+static char *read_name(const uint8_t *raw, size_t len, const struct filename_s *fn)
+{
+	const uint8_t *p = raw + fn->off;
+	size_t max = len - fn->off;
+	char *name, *q;
+
+	if (fn->format == 0) {
+		if (strnlen((const char *)p, max) == max)
+			return NULL;
+		return strdup((const char *)p);
+	}
+
+	name = q = malloc(max / 2 * 3 + 1);
+	if (!name)
+		return NULL;
+	for (size_t i = 0; i + 1 < max; i += 2) {
+		uint32_t c = p[i] | (p[i + 1] << 8);
+
+		if (!c) {
+			*q = '\0';
+			return name;
+		}
+		if ((c >= 0xd800) && (c < 0xdc00) && (i + 3 < max)) {
+			uint32_t lo = p[i + 2] | (p[i + 3] << 8);
+			if ((lo >= 0xdc00) && (lo < 0xe000)) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+				i += 2;
+			}
+		}
+		if (c < 0x80) {
+			*q++ = c;
+		} else if (c < 0x800) {
+			*q++ = 0xc0 | (c >> 6);
+			*q++ = 0x80 | (c & 0x3f);
+		} else if (c < 0x10000) {
+			*q++ = 0xe0 | (c >> 12);
+			*q++ = 0x80 | ((c >> 6) & 0x3f);
+			*q++ = 0x80 | (c & 0x3f);
+		} else {
+			*q++ = 0xf0 | (c >> 18);
+			*q++ = 0x80 | ((c >> 12) & 0x3f);
+			*q++ = 0x80 | ((c >> 6) & 0x3f);
+			*q++ = 0x80 | (c & 0x3f);
+		}
+	}
+	free(name);
+	return NULL;
+}
+
+/*
+ * Names in the MDS are relative to the MDS file itself, and a leading
+ * '*' stands for the MDS file's name without its extension, so that
+ * "*.mdf" goes with "disc.mds".
+ */
+static char *resolve_name(const char *mdsfile, const char *name)
+{
+	const char *slash = strrchr(mdsfile, '/');
+	size_t dirlen = slash ? (size_t)(slash - mdsfile) + 1 : 0;
+	const char *stem = mdsfile + dirlen;
+	const char *dot = strrchr(stem, '.');
+	int stemlen = dot ? dot - stem : (int)strlen(stem);
+	char *path;
+
+	if (name[0] == '/')
+		return strdup(name);
+	path = malloc(dirlen + stemlen + strlen(name) + 1);
+	if (!path)
+		return NULL;
+	if (name[0] == '*')
+		sprintf(path, "%.*s%.*s%s", (int)dirlen, mdsfile, stemlen, stem, name + 1);
+	else
+		sprintf(path, "%.*s%s", (int)dirlen, mdsfile, name);
+	return path;
+}
+
+/*
+ * Work out where a track's data lives. We prefer the name recorded in
+ * the MDS file, but images get renamed, so if that doesn't exist we look
+ * for a file named like the MDS file with the extension ".mdf" instead.
+ */
+static char *find_mdf(const char *mdsfile, const char *embedded)
+{
+	char *mdfname;
+	const char *ext;
+
+	if (embedded && !access(embedded, F_OK))
+		return strdup(embedded);
+
+	ext = strrchr(mdsfile, '.');
+	if (!ext || (strcmp(ext, ".mds") && strcmp(ext, ".MDS")))
+		return embedded ? strdup(embedded) : NULL;
+
+	mdfname = strdup(mdsfile);
+	if (!mdfname)
+		return NULL;
+	mdfname[strlen(mdfname) - 1] = (ext[3] == 's') ? 'f' : 'F';
+	return mdfname;
+}
+
+static int compare_tracks(const void *a, const void *b)
+{
+	const struct mds_track_info_s *ta = &((const struct track_entry_s *)a)->info;
+	const struct mds_track_info_s *tb = &((const struct track_entry_s *)b)->info;
+
+	if (ta->lba != tb->lba)
+		return (ta->lba < tb->lba) ? -1 : 1;
+	return (ta->point < tb->point) ? -1 : (ta->point > tb->point);
+}
+
+static bool in_bounds(uint64_t len, uint64_t off, uint64_t size)
+{
+	return (off <= len) && (size <= len - off);
+}
+
+struct mds_ctx *mds_open(const char *mdsfile, const char **errmsg)
+{
+	__label__ out_error, out_bad;
+	struct mds_ctx *ctx;
+	uint8_t *raw = NULL;
+	size_t len = 0;
+	const char *msg = NULL;
+
+	if (errmsg)
+		*errmsg = NULL;
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->mdsfile = strdup(mdsfile);
+	if (!ctx->mdsfile)
+		goto out_error;
+	raw = slurp(mdsfile, &len);
+	if (!raw)
+		goto out_error;
+
+	//
+	// Open up MDS header.
+	//
+
+	if (len < sizeof(ctx->header)) {
+		msg = "truncated mds file";
+		goto out_bad;
+	}
+	memcpy(&ctx->header, raw, sizeof(ctx->header));
+	if (memcmp(ctx->header.magic, "MEDIA DESCRIPTOR", sizeof(ctx->header.magic))) {
+		msg = "not an mds file? bad magic";
+		goto out_bad;
+	}
+	mds_ntoh(&ctx->header);
+	if (ctx->header.version[0] > 1) {
+		msg = "unsupported mds file version";
+		goto out_bad;
+	}
+
+	//
+	// Open session headers. They sit one after another, and each one
+	// points at its own run of track blocks.
+	//
+
+	ctx->numsessions = ctx->header.numsessions ? ctx->header.numsessions : 1;
+	if (!in_bounds(len, ctx->header.session_off, (uint64_t)ctx->numsessions * sizeof(struct session_s))) {
+		msg = "truncated mds file";
+		goto out_bad;
+	}
+	ctx->sessions = calloc(ctx->numsessions, sizeof(struct session_s));
+	if (!ctx->sessions)
+		goto out_error;
+	for (unsigned s = 0; s < ctx->numsessions; s++) {
+		struct session_s *session = &ctx->sessions[s];
+		memcpy(session, raw + ctx->header.session_off + s * sizeof(*session), sizeof(*session));
+		session_ntoh(session);
+		if (!in_bounds(len, session->track_off, (uint64_t)session->numtracks * sizeof(struct track_s))) {
+			msg = "truncated mds file";
+			goto out_bad;
+		}
+		ctx->numblocks += session->numtracks;
+	}
+
+	//
+	// Set up track structs.
+	//
+
+	ctx->blocks = calloc(ctx->numblocks, sizeof(struct track_s));
+	ctx->tracks = calloc(ctx->numblocks, sizeof(struct track_entry_s));
+	if (!ctx->blocks || !ctx->tracks)
+		goto out_error;
+
+	for (unsigned s = 0, first = 0; s < ctx->numsessions; first += ctx->sessions[s++].numtracks) {
+		const struct session_s *session = &ctx->sessions[s];
+		struct track_s *blocks = &ctx->blocks[first];
+
+		for (unsigned b = 0; b < session->numtracks; b++) {
+			memcpy(&blocks[b], raw + session->track_off + b * sizeof(struct track_s), sizeof(struct track_s));
+			track_ntoh(&blocks[b]);
+		}
+
+		for (unsigned b = 0; b < session->numtracks; b++) {
+			const struct track_s *track = &blocks[b];
+			struct track_entry_s *entry = &ctx->tracks[ctx->numtracks];
+			struct mds_track_info_s *info = &entry->info;
+			struct trackmode_info_s ti;
+			char *embedded = NULL;
+
+			if ((track->pointno < 1) || (track->pointno > 0x99))
+				continue;
+
+			// Images too big for one file are split into several,
+			// which are read as if they'd been stuck together.
+			if (!in_bounds(len, track->filenames_off, (uint64_t)track->filenames_num * sizeof(struct filename_s))) {
+				msg = "truncated mds file";
+				goto out_bad;
+			}
+			entry->filenames = calloc(track->filenames_num ? track->filenames_num : 1, sizeof(char *));
+			if (!entry->filenames)
+				goto out_error;
+			for (unsigned f = 0; f < track->filenames_num; f++) {
+				struct filename_s fn;
+				char *name;
+
+				memcpy(&fn, raw + track->filenames_off + f * sizeof(fn), sizeof(fn));
+				filename_ntoh(&fn);
+				if ((fn.off >= len) || !(name = read_name(raw, len, &fn))) {
+					msg = "bad filename in mds file";
+					goto out_bad;
+				}
+				entry->filenames[f] = resolve_name(mdsfile, name);
+				free(name);
+				if (!entry->filenames[f])
+					goto out_error;
+				entry->numfiles++;
+			}
+			if (entry->numfiles < 2) {
+				embedded = entry->filenames[0];
+				entry->filenames[0] = find_mdf(mdsfile, embedded);
+				entry->numfiles = entry->filenames[0] ? 1 : 0;
+				free(embedded);
+			}
+
+			ti = get_info_for_trackmode(track->trackmode);
+			info->session = session->numsession;
+			info->point = track->pointno;
+			info->mode = track->trackmode;
+			info->numsubchannels = track->numsubchannels;
+			info->data = (track->trackmode >= TM_MODE1) || (track->trackmode == TM_DVD);
+			info->lba = (int32_t)track->sec_first;
+			info->offset = track->sec_off;
+			info->secsize = track->secsize;
+			if (!ti.last) {
+				info->data_len = ti.data_len;
+				info->data_off = ti.data_off;
+			}
+			// Sectors that are nothing but payload.
+			if (info->data_len == info->secsize)
+				info->data_off = 0;
+
+			if (track->indexblock_off) {
+				struct index_s index;
+				if (!in_bounds(len, track->indexblock_off, sizeof(index))) {
+					msg = "truncated mds file";
+					goto out_bad;
+				}
+				memcpy(&index, raw + track->indexblock_off, sizeof(index));
+				index_ntoh(&index);
+				info->pregap = index.index0_len;
+			}
+
+			if ((b < session->numtracks - 1) && (blocks[b + 1].pointno <= 0x99))
+				info->length = blocks[b + 1].sec_first - track->sec_first;
+			else
+				info->length = session->sec_last - track->sec_first;
+
+			ctx->numtracks++;
+		}
+	}
+
+	// Tracks are almost always stored in order already, but lookups
+	// depend on it.
+	qsort(ctx->tracks, ctx->numtracks, sizeof(*ctx->tracks), compare_tracks);
+
+	free(raw);
+	return ctx;
+
+out_bad:
+	errno = EINVAL;
+	if (errmsg)
+		*errmsg = msg;
+out_error:
+	free(raw);
+	mds_close(ctx);
+	return NULL;
+}
+
+void mds_close(struct mds_ctx *ctx)
+{
+	int e = errno;
+
+	if (!ctx)
+		return;
+	MappedConcat_Close(&ctx->mdf);
+	// A track that failed halfway through parsing has its names too.
+	for (unsigned i = 0; ctx->tracks && (i <= ctx->numtracks) && (i < ctx->numblocks); i++) {
+		for (unsigned f = 0; f < ctx->tracks[i].numfiles; f++)
+			free(ctx->tracks[i].filenames[f]);
+		free(ctx->tracks[i].filenames);
+	}
+	free(ctx->tracks);
+	free(ctx->blocks);
+	free(ctx->sessions);
+	free(ctx->mdsfile);
+	free(ctx);
+	errno = e;
+}
+
+/*
+ * Open the MDF so that mds_read_sectors() can be used. Pass NULL to use
+ * the files the MDS names (or their stand-in); all tracks are assumed to
+ * live in the same ones.
+ */
+int mds_open_data(struct mds_ctx *ctx, const char *mdffile)
+{
+	char *name;
+	int rc;
+
+	if (ctx->mdf.count)
+		return 0;
+	if (!mdffile && ctx->numtracks && ctx->tracks[0].numfiles)
+		return MappedConcat_Open(&ctx->mdf, ctx->tracks[0].filenames, ctx->tracks[0].numfiles);
+	if (!mdffile) {
+		errno = ENOENT;
+		return -1;
+	}
+	name = strdup(mdffile);
+	if (!name)
+		return -1;
+	rc = MappedConcat_Open(&ctx->mdf, &name, 1);
+	free(name);
+	return rc;
+}
+
+uint16_t mds_mediatype(const struct mds_ctx *ctx)
+{
+	return ctx->header.mediatype;
+}
+
+unsigned mds_num_tracks(const struct mds_ctx *ctx)
+{
+	return ctx->numtracks;
+}
+
+int mds_get_track(const struct mds_ctx *ctx, unsigned track, struct mds_track_info_s *info)
+{
+	if (track >= ctx->numtracks) {
+		errno = EINVAL;
+		return -1;
+	}
+	*info = ctx->tracks[track].info;
+	return 0;
+}
+
+int mds_find_data_track(const struct mds_ctx *ctx)
+{
+	for (unsigned i = 0; i < ctx->numtracks; i++) {
+		if (ctx->tracks[i].info.data)
+			return i;
+	}
+	return -1;
+}
+
+const char *mds_track_filename(const struct mds_ctx *ctx, unsigned track)
+{
+	if (track >= ctx->numtracks)
+		return NULL;
+	if (!ctx->tracks[track].numfiles)
+		return NULL;
+	return ctx->tracks[track].filenames[0];
+}
+
+unsigned mds_track_num_files(const struct mds_ctx *ctx, unsigned track)
+{
+	if (track >= ctx->numtracks)
+		return 0;
+	return ctx->tracks[track].numfiles;
+}
+
+/* The name of the nth of the files the track is split across. */
+const char *mds_track_part_filename(const struct mds_ctx *ctx, unsigned track, unsigned n)
+{
+	if ((track >= ctx->numtracks) || (n >= ctx->tracks[track].numfiles))
+		return NULL;
+	return ctx->tracks[track].filenames[n];
+}
+
+/*
+ * Find the track holding lba, or -1 if it's in a gap between sessions or
+ * off either end of the disc.
+ */
+int mds_track_for_lba(const struct mds_ctx *ctx, int32_t lba)
+{
+	unsigned lo = 0, hi = ctx->numtracks;
+
+	// Find the last track starting at or before lba.
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (ctx->tracks[mid].info.lba <= lba)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return -1;
+	if ((uint64_t)(lba - ctx->tracks[lo - 1].info.lba) >= ctx->tracks[lo - 1].info.length)
+		return -1;
+	return lo - 1;
+}
+
+/*
+ * Copy count sectors of a track, starting at lba, into buf. Cooked reads
+ * produce data_len bytes per sector, raw reads secsize bytes. Reads that
+ * run off the end of the track are cut short; the number of sectors
+ * copied is returned.
+ */
+ssize_t mds_read_sectors(struct mds_ctx *ctx, unsigned track, int32_t lba,
+	uint32_t count, void *buf, enum mds_read_mode_e mode)
+{
+	const struct mds_track_info_s *info;
+	uint8_t *bounce, *dst = buf;
+	uint64_t rel, off;
+	uint32_t batch;
+
+	if (track >= ctx->numtracks) {
+		errno = EINVAL;
+		return -1;
+	}
+	info = &ctx->tracks[track].info;
+	if ((lba < info->lba) || ((uint64_t)(lba - info->lba) > info->length)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!ctx->mdf.count) {
+		errno = EBADF;
+		return -1;
+	}
+	if ((mode == MDS_READ_COOKED) && !info->data_len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	rel = lba - info->lba;
+	if (count > info->length - rel)
+		count = info->length - rel;
+	off = info->offset + rel * info->secsize;
+	if (!in_bounds(ctx->mdf.size, off, (uint64_t)count * info->secsize)) {
+		errno = EIO;
+		return -1;
+	}
+
+	if ((mode == MDS_READ_RAW) || (info->data_len == info->secsize)) {
+		if (MappedConcat_Read(&ctx->mdf, dst, off, (size_t)count * info->secsize))
+			return -1;
+		return count;
+	}
+
+	// Read whole sectors a batch at a time and keep just their payload.
+	if (!count)
+		return 0;
+	batch = (count < READ_BATCH) ? count : READ_BATCH;
+	bounce = malloc((size_t)batch * info->secsize);
+	if (!bounce)
+		return -1;
+	for (uint32_t done = 0; done < count; done += batch) {
+		if (batch > count - done)
+			batch = count - done;
+		if (MappedConcat_Read(&ctx->mdf, bounce, off, (size_t)batch * info->secsize)) {
+			free(bounce);
+			return -1;
+		}
+		for (uint32_t i = 0; i < batch; i++) {
+			memcpy(dst, bounce + (size_t)i * info->secsize + info->data_off, info->data_len);
+			dst += info->data_len;
+		}
+		off += (uint64_t)batch * info->secsize;
+	}
+	free(bounce);
+	return count;
+}
+
+const struct mds_s *mds_raw_header(const struct mds_ctx *ctx)
+{
+	return &ctx->header;
+}
+
+unsigned mds_num_raw_sessions(const struct mds_ctx *ctx)
+{
+	return ctx->numsessions;
+}
+
+const struct session_s *mds_raw_session(const struct mds_ctx *ctx, unsigned idx)
+{
+	if (idx >= ctx->numsessions)
+		return NULL;
+	return &ctx->sessions[idx];
+}
+
+unsigned mds_num_raw_tracks(const struct mds_ctx *ctx)
+{
+	return ctx->numblocks;
+}
+
+const struct track_s *mds_raw_track(const struct mds_ctx *ctx, unsigned idx)
+{
+	if (idx >= ctx->numblocks)
+		return NULL;
+	return &ctx->blocks[idx];
+}
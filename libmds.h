@@ -0,0 +1,59 @@
+#ifndef _LIBMDS_H_
+#define _LIBMDS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * libmds reads MDS+MDF disc images. Everything about one image lives in
+ * a struct mds_ctx; there is no global state, so separate images can be
+ * used from separate threads, and mds_read_sectors() may be called from
+ * several threads at once on the same image.
+ */
+struct mds_ctx;
+
+enum mds_read_mode_e {
+	MDS_READ_COOKED,	// just the user data, e.g. 2048 bytes for Mode 1
+	MDS_READ_RAW,		// the whole sector as stored in the MDF
+};
+
+struct mds_track_info_s {
+	unsigned session;
+	unsigned point;		// track number, 1 to 99
+	unsigned mode;		// MDS track mode, see mds_trackmode_tostring()
+	unsigned numsubchannels;
+	bool data;		// false for audio tracks
+	int32_t lba;		// first sector
+	uint32_t length;	// in sectors
+	uint32_t pregap;	// sectors of index 0 just before lba
+	uint64_t offset;	// bytes from the start of the MDF
+	unsigned secsize;	// bytes per sector in the MDF
+	unsigned data_off;	// where the user data sits within a sector
+	unsigned data_len;	// bytes of user data per sector
+};
+
+struct mds_ctx *mds_open(const char *mdsfile, const char **errmsg);
+void mds_close(struct mds_ctx *ctx);
+int mds_open_data(struct mds_ctx *ctx, const char *mdffile);
+
+uint16_t mds_mediatype(const struct mds_ctx *ctx);
+
+/* The tracks of every session are numbered together, from 0, by LBA. */
+unsigned mds_num_tracks(const struct mds_ctx *ctx);
+int mds_get_track(const struct mds_ctx *ctx, unsigned track, struct mds_track_info_s *info);
+int mds_find_data_track(const struct mds_ctx *ctx);
+int mds_track_for_lba(const struct mds_ctx *ctx, int32_t lba);
+const char *mds_track_filename(const struct mds_ctx *ctx, unsigned track);
+unsigned mds_track_num_files(const struct mds_ctx *ctx, unsigned track);
+const char *mds_track_part_filename(const struct mds_ctx *ctx, unsigned track, unsigned n);
+
+ssize_t mds_read_sectors(struct mds_ctx *ctx, unsigned track, int32_t lba,
+	uint32_t count, void *buf, enum mds_read_mode_e mode);
+
+const char *mds_mediatype_tostring(const uint16_t mediatype);
+const char *mds_trackmode_tostring(const unsigned trackmode);
+
+/* _LIBMDS_H_ */
+#endif
@@ -0,0 +1,276 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "manifest.h"
+
+/*
+ * After a header line, each line holds these fields, separated by tabs:
+ * the .mds file's size, mtime and hash, the MDF's size and mtime, the
+ * ISO's size, mtime and hash, and last the names of the ISO and of the
+ * .mds file.
+ */
+#define MANIFEST_MAGIC	"# mds2iso manifest 1\n"
+#define NUM_FIELDS	10
+
+static int parse_u64(const char *s, uint64_t *v)
+{
+	char *end;
+
+	errno = 0;
+	*v = strtoull(s, &end, 10);
+	return (!*s || *end || errno) ? -1 : 0;
+}
+
+static int parse_i64(const char *s, int64_t *v)
+{
+	char *end;
+
+	errno = 0;
+	*v = strtoll(s, &end, 10);
+	return (!*s || *end || errno) ? -1 : 0;
+}
+
+static int hexval(char c)
+{
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	return -1;
+}
+
+static int parse_hash(const char *s, uint8_t *hash)
+{
+	if (strlen(s) != 2 * MANIFEST_HASH_LEN)
+		return -1;
+	for (unsigned i = 0; i < MANIFEST_HASH_LEN; i++) {
+		int hi = hexval(s[2 * i]), lo = hexval(s[2 * i + 1]);
+		if ((hi < 0) || (lo < 0))
+			return -1;
+		hash[i] = (hi << 4) | lo;
+	}
+	return 0;
+}
+
+/* Fill in e from line, which it then points into. */
+static int parse_line(char *line, struct manifest_entry_s *e)
+{
+	char *field[NUM_FIELDS];
+
+	for (unsigned i = 0; i < NUM_FIELDS; i++) {
+		field[i] = line;
+		if (i == NUM_FIELDS - 1)
+			break;
+		line = strchr(line, '\t');
+		if (!line)
+			return -1;
+		*line++ = '\0';
+	}
+	if (parse_u64(field[0], &e->mds_size) || parse_i64(field[1], &e->mds_mtime)
+		|| parse_hash(field[2], e->mds_hash)
+		|| parse_u64(field[3], &e->mdf_size) || parse_i64(field[4], &e->mdf_mtime)
+		|| parse_u64(field[5], &e->iso_size) || parse_i64(field[6], &e->iso_mtime)
+		|| parse_hash(field[7], e->iso_hash)
+		|| !*field[8] || !*field[9])
+		return -1;
+	e->isofile = field[8];
+	e->mdsfile = field[9];
+	return 0;
+}
+
+static int append(struct manifest_s *m, const struct manifest_entry_s *e)
+{
+	struct manifest_entry_s *n;
+
+	if (m->n == m->max) {
+		size_t max = m->max ? m->max * 2 : 64;
+		struct manifest_entry_s *entries = realloc(m->entries, max * sizeof(*entries));
+		if (!entries)
+			return -1;
+		m->entries = entries;
+		m->max = max;
+	}
+	n = &m->entries[m->n];
+	*n = *e;
+	n->replaced = false;
+	n->mdsfile = strdup(e->mdsfile);
+	n->isofile = strdup(e->isofile);
+	if (!n->mdsfile || !n->isofile) {
+		free(n->mdsfile);
+		free(n->isofile);
+		return -1;
+	}
+	m->n++;
+	return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct manifest_entry_s *ea = a, *eb = b;
+	return strcmp(ea->mdsfile, eb->mdsfile);
+}
+
+/* Read a manifest. One that doesn't exist yet is empty. */
+int manifest_load(struct manifest_s *m, const char *file)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t max = 0;
+	ssize_t len;
+	int rc = 0, e;
+
+	*m = (struct manifest_s){ .entries = NULL };
+	f = fopen(file, "r");
+	if (!f)
+		return (errno == ENOENT) ? 0 : -1;
+	if ((getline(&line, &max, f) == -1) || strcmp(line, MANIFEST_MAGIC)) {
+		if (!ferror(f))
+			errno = EINVAL;
+		rc = -1;
+	}
+	while (!rc && ((len = getline(&line, &max, f)) != -1)) {
+		struct manifest_entry_s entry = { .mdsfile = NULL };
+
+		if (len && (line[len - 1] == '\n'))
+			line[--len] = '\0';
+		// A damaged line only means that image is converted again.
+		if (parse_line(line, &entry))
+			continue;
+		rc = append(m, &entry);
+	}
+	if (!rc && ferror(f))
+		rc = -1;
+	e = errno;
+	free(line);
+	fclose(f);
+	if (rc) {
+		manifest_free(m);
+		errno = e;
+		return -1;
+	}
+	qsort(m->entries, m->n, sizeof(*m->entries), compare_entries);
+	m->nsorted = m->n;
+	return 0;
+}
+
+/* The current entry for mdsfile, or NULL. */
+struct manifest_entry_s *manifest_find(struct manifest_s *m, const char *mdsfile)
+{
+	struct manifest_entry_s key = { .mdsfile = (char *)mdsfile }, *e;
+
+	e = bsearch(&key, m->entries, m->nsorted, sizeof(*m->entries), compare_entries);
+	if (e && !e->replaced)
+		return e;
+	for (size_t i = m->nsorted; i < m->n; i++) {
+		if (!m->entries[i].replaced && !strcmp(m->entries[i].mdsfile, mdsfile))
+			return &m->entries[i];
+	}
+	return NULL;
+}
+
+/*
+ * An entry for an image that looks like a copy of one with these, and
+ * whose ISO isn't isofile.
+ */
+struct manifest_entry_s *manifest_find_copy(struct manifest_s *m, const uint8_t *mds_hash,
+	uint64_t mdf_size, const char *isofile)
+{
+	for (size_t i = 0; i < m->n; i++) {
+		struct manifest_entry_s *e = &m->entries[i];
+
+		if (!e->replaced && (e->mdf_size == mdf_size)
+			&& !memcmp(e->mds_hash, mds_hash, MANIFEST_HASH_LEN)
+			&& strcmp(e->isofile, isofile))
+			return e;
+	}
+	return NULL;
+}
+
+/* Record e, replacing any entry for the same .mds file. */
+int manifest_add(struct manifest_s *m, const struct manifest_entry_s *e)
+{
+	struct manifest_entry_s *old;
+	size_t i;
+
+	// The names have to fit on one line, between tabs.
+	if (strpbrk(e->mdsfile, "\t\n") || strpbrk(e->isofile, "\t\n")) {
+		errno = EINVAL;
+		return -1;
+	}
+	old = manifest_find(m, e->mdsfile);
+	i = old ? (size_t)(old - m->entries) : 0;
+	if (append(m, e))
+		return -1;
+	if (old)
+		m->entries[i].replaced = true;
+	return 0;
+}
+
+static void put_hash(FILE *f, const uint8_t *hash)
+{
+	for (unsigned i = 0; i < MANIFEST_HASH_LEN; i++)
+		fprintf(f, "%02x", hash[i]);
+}
+
+/* Write the manifest out, replacing file all at once. */
+int manifest_save(const struct manifest_s *m, const char *file)
+{
+	char *tmp = malloc(strlen(file) + sizeof(".tmp"));
+	FILE *f;
+	int e;
+
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.tmp", file);
+	f = fopen(tmp, "w");
+	if (!f)
+		goto out_error;
+	fputs(MANIFEST_MAGIC, f);
+	for (size_t i = 0; i < m->n; i++) {
+		const struct manifest_entry_s *en = &m->entries[i];
+
+		if (en->replaced)
+			continue;
+		fprintf(f, "%" PRIu64 "\t%" PRId64 "\t", en->mds_size, en->mds_mtime);
+		put_hash(f, en->mds_hash);
+		fprintf(f, "\t%" PRIu64 "\t%" PRId64 "\t%" PRIu64 "\t%" PRId64 "\t",
+			en->mdf_size, en->mdf_mtime, en->iso_size, en->iso_mtime);
+		put_hash(f, en->iso_hash);
+		fprintf(f, "\t%s\t%s\n", en->isofile, en->mdsfile);
+	}
+	if (ferror(f)) {
+		fclose(f);
+		errno = EIO;
+		goto out_unlink;
+	}
+	if (fclose(f))
+		goto out_unlink;
+	if (rename(tmp, file))
+		goto out_unlink;
+	free(tmp);
+	return 0;
+
+out_unlink:
+	e = errno;
+	unlink(tmp);
+	errno = e;
+out_error:
+	e = errno;
+	free(tmp);
+	errno = e;
+	return -1;
+}
+
+void manifest_free(struct manifest_s *m)
+{
+	for (size_t i = 0; i < m->n; i++) {
+		free(m->entries[i].mdsfile);
+		free(m->entries[i].isofile);
+	}
+	free(m->entries);
+	*m = (struct manifest_s){ .entries = NULL };
+}
@@ -0,0 +1,47 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MANIFEST_HASH_LEN 20
+
+/* What an image looked like when it was converted, and what came out. */
+struct manifest_entry_s {
+	char *mdsfile;
+	char *isofile;
+	uint64_t mds_size;
+	int64_t mds_mtime;	// in nanoseconds
+	uint64_t mdf_size;	// of all the files holding the data track
+	int64_t mdf_mtime;	// the newest of them
+	uint8_t mds_hash[MANIFEST_HASH_LEN];	// SHA-1 of the .mds file
+	uint64_t iso_size;
+	int64_t iso_mtime;
+	uint8_t iso_hash[MANIFEST_HASH_LEN];
+	bool replaced;		// superseded by a later entry
+};
+
+/*
+ * A manifest file, kept as text with one entry per line. Entries loaded
+ * from the file are kept sorted by .mds name; those added since go on
+ * the end. Adding may move the entries, so pointers from the find
+ * functions don't last past the next manifest_add().
+ */
+struct manifest_s {
+	struct manifest_entry_s *entries;
+	size_t n;
+	size_t max;
+	size_t nsorted;
+};
+
+int manifest_load(struct manifest_s *m, const char *file);
+struct manifest_entry_s *manifest_find(struct manifest_s *m, const char *mdsfile);
+struct manifest_entry_s *manifest_find_copy(struct manifest_s *m, const uint8_t *mds_hash,
+	uint64_t mdf_size, const char *isofile);
+int manifest_add(struct manifest_s *m, const struct manifest_entry_s *e);
+int manifest_save(const struct manifest_s *m, const char *file);
+void manifest_free(struct manifest_s *m);
+
+/* _MANIFEST_H_ */
+#endif
@@ -1,7 +1,10 @@
 #ifdef __MINGW32__
 #include <windows.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <io.h>
 #include <stdio.h>
+#include <string.h>
 #include "mapfile.h"
 
 struct MappedFile_s MappedFile_Create(char *filename, size_t size)
@@ -136,7 +139,7 @@ struct MappedFile_s MappedFile_Open(char *filename, bool writable)
 
 	p = MapViewOfFile(
 		m._hMapping,
-		writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_COPY,
+		writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ,
 		0,
 		0,
 		0
@@ -163,9 +166,83 @@ void MappedFile_Close(struct MappedFile_s m)
 	CloseHandle(m._hFile);
 }
 
+int MappedWindow_Init(struct MappedWindow_s *w, int fd, size_t window, bool drop_behind)
+{
+	LARGE_INTEGER liSize;
+	HANDLE hFile = (HANDLE)_get_osfhandle(fd);
+
+	memset(w, 0, sizeof(*w));
+	w->_fd = fd;
+	w->window = window;
+	w->drop_behind = drop_behind;
+	if (hFile == INVALID_HANDLE_VALUE)
+		return -1;
+	if (!GetFileSizeEx(hFile, &liSize))
+		return -1;
+	w->size = (uint64_t) liSize.QuadPart;
+	w->_hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (w->_hMapping == NULL)
+		return -1;
+	return 0;
+}
+
+const uint8_t *MappedWindow_Get(struct MappedWindow_s *w, uint64_t off, size_t len)
+{
+	SYSTEM_INFO si;
+	uint64_t base;
+	size_t maplen;
+	LPVOID p;
+
+	if (w->data && (off >= w->off) && (off + len <= w->off + w->len))
+		return w->data + (off - w->off);
+	if (off + len > w->size) {
+		errno = EIO;
+		return NULL;
+	}
+
+	if (w->data) {
+		UnmapViewOfFile((LPCVOID) w->data);
+		w->data = NULL;
+	}
+
+	GetSystemInfo(&si);
+	base = off - (off % si.dwAllocationGranularity);
+	maplen = w->window;
+	if (maplen < len + (off - base))
+		maplen = len + (off - base);
+	if (base + maplen > w->size)
+		maplen = w->size - base;
+
+	p = MapViewOfFile(
+		w->_hMapping,
+		FILE_MAP_READ,
+		(DWORD)(base >> 32),
+		(DWORD)base,
+		maplen
+	);
+	if (p == NULL)
+		return NULL;
+	w->data = p;
+	w->off = base;
+	w->len = maplen;
+	return w->data + (off - w->off);
+}
+
+void MappedWindow_Close(struct MappedWindow_s *w)
+{
+	if (w->data)
+		UnmapViewOfFile((LPCVOID) w->data);
+	if (w->_hMapping)
+		CloseHandle(w->_hMapping);
+	w->data = NULL;
+	w->_hMapping = NULL;
+}
+
 /* __MINGW32__ */
 #else
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <errno.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -234,8 +311,8 @@ struct MappedFile_s MappedFile_Open(char *filename, bool writable)
 	m.data = mmap(
 		NULL,
 		sb.st_size,
-		PROT_READ|PROT_WRITE,
-		writable ? MAP_SHARED : MAP_PRIVATE,
+		writable ? PROT_READ|PROT_WRITE : PROT_READ,
+		MAP_SHARED,
 		m._fd,
 		0
 	);
@@ -261,5 +338,237 @@ void MappedFile_Close(struct MappedFile_s m)
 	close(m._fd);
 }
 
+int MappedWindow_Init(struct MappedWindow_s *w, int fd, size_t window, bool drop_behind)
+{
+	struct stat sb;
+
+	memset(w, 0, sizeof(*w));
+	w->_fd = fd;
+	w->drop_behind = drop_behind;
+	if (fstat(fd, &sb) == -1)
+		return -1;
+	w->size = sb.st_size;
+	w->window = window;
+	return 0;
+}
+
+/*
+ * Return a pointer to len bytes of the file starting at off, moving the
+ * window if they aren't already mapped. Offsets are expected to mostly
+ * go up: the kernel is told to read ahead of the window, and the window
+ * being left behind is dropped from our address space and, if asked,
+ * from the page cache too.
+ */
+const uint8_t *MappedWindow_Get(struct MappedWindow_s *w, uint64_t off, size_t len)
+{
+	uint64_t base, end;
+	size_t maplen;
+	long pagesize;
+	void *p;
+
+	if (w->data && (off >= w->off) && (off + len <= w->off + w->len))
+		goto out_ok;
+	if (off + len > w->size) {
+		errno = EIO;
+		return NULL;
+	}
+
+	if (w->data) {
+		madvise(w->data, w->len, MADV_DONTNEED);
+		munmap(w->data, w->len);
+		if (w->drop_behind)
+			posix_fadvise(w->_fd, w->off, w->len, POSIX_FADV_DONTNEED);
+		w->data = NULL;
+	}
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	base = off - (off % pagesize);
+	maplen = w->window;
+	if (maplen < len + (off - base))
+		maplen = len + (off - base);
+	if (base + maplen > w->size)
+		maplen = w->size - base;
+
+	p = mmap(NULL, maplen, PROT_READ, MAP_SHARED, w->_fd, base);
+	if (p == MAP_FAILED)
+		return NULL;
+	madvise(p, maplen, MADV_SEQUENTIAL);
+	madvise(p, maplen, MADV_WILLNEED);
+	w->data = p;
+	w->off = base;
+	w->len = maplen;
+	if (w->_hinted < base + maplen)
+		w->_hinted = base + maplen;
+
+out_ok:
+	// Once we're halfway through the window, start the kernel reading
+	// the next one.
+	end = w->off + w->len;
+	if ((off + len > w->off + w->len / 2) && (w->_hinted <= end) && (end < w->size)) {
+		posix_fadvise(w->_fd, end, w->window, POSIX_FADV_WILLNEED);
+		w->_hinted = end + w->window;
+	}
+	return w->data + (off - w->off);
+}
+
+void MappedWindow_Close(struct MappedWindow_s *w)
+{
+	if (w->data) {
+		munmap(w->data, w->len);
+		if (w->drop_behind)
+			posix_fadvise(w->_fd, w->off, w->len, POSIX_FADV_DONTNEED);
+	}
+	w->data = NULL;
+}
+
 /* __MINGW32__ */
 #endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Windows maps each file whole. Elsewhere they're only opened, and read
+ * with pread() as asked, which leaves readahead to the kernel and works
+ * for files bigger than the address space.
+ */
+#ifdef __MINGW32__
+static int MappedConcat_OpenOne(struct MappedFile_s *f, char *filename)
+{
+	*f = MappedFile_Open(filename, false);
+	return f->data ? 0 : -1;
+}
+
+static int MappedConcat_ReadOne(const struct MappedFile_s *f, void *dst, uint64_t off, size_t len)
+{
+	memcpy(dst, (const uint8_t *)f->data + off, len);
+	return 0;
+}
+
+static void MappedConcat_CloseOne(struct MappedFile_s *f)
+{
+	MappedFile_Close(*f);
+}
+#else
+static int MappedConcat_OpenOne(struct MappedFile_s *f, char *filename)
+{
+	struct stat sb;
+	int e;
+
+	f->data = NULL;
+	f->_fd = open(filename, O_RDONLY);
+	if (f->_fd == -1)
+		return -1;
+	if (fstat(f->_fd, &sb) == -1) {
+		e = errno;
+		close(f->_fd);
+		errno = e;
+		return -1;
+	}
+	f->size = sb.st_size;
+	return 0;
+}
+
+static int MappedConcat_ReadOne(const struct MappedFile_s *f, void *dst, uint64_t off, size_t len)
+{
+	uint8_t *p = dst;
+
+	while (len) {
+		ssize_t rc = pread(f->_fd, p, len, off);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (rc == 0) {
+			// The file got shorter since we opened it.
+			errno = EIO;
+			return -1;
+		}
+		p += rc;
+		off += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+static void MappedConcat_CloseOne(struct MappedFile_s *f)
+{
+	close(f->_fd);
+}
+#endif
+
+int MappedConcat_Open(struct MappedConcat_s *mc, char **filenames, unsigned count)
+{
+	int e;
+
+	mc->count = 0;
+	mc->size = 0;
+	mc->files = calloc(count, sizeof(*mc->files));
+	mc->starts = calloc(count + 1, sizeof(*mc->starts));
+	if (!mc->files || !mc->starts)
+		goto out_error;
+	for (unsigned i = 0; i < count; i++) {
+		if (MappedConcat_OpenOne(&mc->files[i], filenames[i]))
+			goto out_error;
+		mc->count++;
+		mc->size += mc->files[i].size;
+		mc->starts[i + 1] = mc->size;
+	}
+	return 0;
+
+out_error:
+	e = errno;
+	MappedConcat_Close(mc);
+	errno = e;
+	return -1;
+}
+
+/* Find the file holding off, which must be less than mc->size. */
+static unsigned MappedConcat_Find(const struct MappedConcat_s *mc, uint64_t off)
+{
+	unsigned lo = 0, hi = mc->count;
+
+	while (hi - lo > 1) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (mc->starts[mid] <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Copy [off, off + len) to dst, straight out of each file it spans. */
+int MappedConcat_Read(const struct MappedConcat_s *mc, void *dst, uint64_t off, size_t len)
+{
+	uint8_t *p = dst;
+
+	if ((off > mc->size) || (len > mc->size - off)) {
+		errno = EIO;
+		return -1;
+	}
+	for (unsigned i = len ? MappedConcat_Find(mc, off) : 0; len; i++) {
+		uint64_t n = mc->starts[i + 1] - off;
+		if (n > len)
+			n = len;
+		if (MappedConcat_ReadOne(&mc->files[i], p, off - mc->starts[i], n))
+			return -1;
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void MappedConcat_Close(struct MappedConcat_s *mc)
+{
+	for (unsigned i = 0; i < mc->count; i++)
+		MappedConcat_CloseOne(&mc->files[i]);
+	free(mc->files);
+	free(mc->starts);
+	mc->files = NULL;
+	mc->starts = NULL;
+	mc->count = 0;
+	mc->size = 0;
+}
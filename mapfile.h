@@ -5,6 +5,7 @@
 #include <windows.h>
 #endif
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct MappedFile_s {
@@ -22,5 +23,43 @@ struct MappedFile_s MappedFile_Create(char *filename, size_t size);
 struct MappedFile_s MappedFile_Open(char *filename, bool writable);
 void MappedFile_Close(struct MappedFile_s m);
 
+/*
+ * A read-only view of part of a file that slides along as it's asked for
+ * later offsets, so that big files can be walked without mapping all of
+ * them at once. The file descriptor belongs to the caller.
+ */
+struct MappedWindow_s {
+	uint8_t *data;		// maps [off, off + len) of the file
+	uint64_t off;
+	size_t len;
+	uint64_t size;		// size of the whole file
+	size_t window;
+	uint64_t _hinted;	// readahead has been requested up to here
+	bool drop_behind;	// evict pages we're done with from the page cache
+	int _fd;
+#ifdef __MINGW32__
+	HANDLE _hMapping;
+#endif
+};
+
+int MappedWindow_Init(struct MappedWindow_s *w, int fd, size_t window, bool drop_behind);
+const uint8_t *MappedWindow_Get(struct MappedWindow_s *w, uint64_t off, size_t len);
+void MappedWindow_Close(struct MappedWindow_s *w);
+
+/*
+ * Several files opened read-only and read as one, as if they had been
+ * concatenated in order.
+ */
+struct MappedConcat_s {
+	struct MappedFile_s *files;	// only mapped on Windows
+	uint64_t *starts;	// where each file begins; starts[count] is the total size
+	unsigned count;
+	uint64_t size;
+};
+
+int MappedConcat_Open(struct MappedConcat_s *mc, char **filenames, unsigned count);
+int MappedConcat_Read(const struct MappedConcat_s *mc, void *dst, uint64_t off, size_t len);
+void MappedConcat_Close(struct MappedConcat_s *mc);
+
 /* _MAPFILE_H_ */
 #endif
@@ -1,226 +1,307 @@
 #define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <iso646.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
-#include "endian.h"
 #include "err.h"
+#include "audio.h"
+#include "batch.h"
+#include "cso.h"
+#include "cue.h"
+#include "digest.h"
+#include "extract.h"
+#include "hash.h"
 #include "hexdump.h"
-#include "mapfile.h"
+#include "index.h"
+#include "isofs.h"
+#include "libmds.h"
+#include "manifest.h"
+#include "mdsfmt.h"
+#include "mount.h"
+#include "nbd.h"
 #include "progname.h"
+#include "progress.h"
+#include "scan.h"
+#include "stats.h"
+#include "subchannel.h"
 #include "stdnoreturn.h"
+#include "verify.h"
 #include "version.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 extern char *__progname;
 static void noreturn usage(void);
 
-enum trackmode_e {
-	TM_NONE = 0,
-	TM_DVD = 2,
-	TM_AUDIO = 0xa9,
-	TM_MODE1,
-	TM_MODE2,
-	TM_MODE2_FORM1,
-	TM_MODE2_FORM2,
-	TM_MODE2_SUB = 0xec
+enum {
+	OPT_MOUNT = 0x100,
+	OPT_NBD,
+	OPT_CUE,
+	OPT_SPLIT,
+	OPT_OFFSET,
+	OPT_SWAP,
+	OPT_SUB,
+	OPT_SUB_PACKED,
+	OPT_VERIFY,
+	OPT_HASH,
+	OPT_HASH_FILE,
+	OPT_SPARSE,
+	OPT_CSO,
+	OPT_BATCH,
+	OPT_PER_DEVICE,
+	OPT_MANIFEST,
+	OPT_STATS,
+	OPT_PROGRESS,
+	OPT_SCAN,
+	OPT_INDEX,
+	OPT_LIST,
+	OPT_EXTRACT,
 };
 
-struct trackmode_info_s {
-	enum trackmode_e trackmode;
-	unsigned data_len;
-	unsigned data_off;
-	unsigned data_stride;
-	bool last;
-} trackmode_infos[] = {
-	{ TM_NONE, 0, 0 },
-	{ TM_DVD, 0x800, 0 },
-	{ TM_AUDIO, 0x930, 0 },
-	{ TM_MODE1, 0x800, 0x10 },
-	{ TM_MODE2, 0x920, 0x10 },
-	{ TM_MODE2_FORM1, 0x800, 0x18 },
-	{ TM_MODE2_FORM2, 0x914, 0x18 },
-	{ TM_MODE2_SUB, 0x800, 0x18 },
-	{ .last = true },
+static const struct option longopts[] = {
+	{ "mount", required_argument, NULL, OPT_MOUNT },
+	{ "nbd", required_argument, NULL, OPT_NBD },
+	{ "cue", required_argument, NULL, OPT_CUE },
+	{ "split", no_argument, NULL, OPT_SPLIT },
+	{ "offset", required_argument, NULL, OPT_OFFSET },
+	{ "swap", no_argument, NULL, OPT_SWAP },
+	{ "sub", required_argument, NULL, OPT_SUB },
+	{ "sub-packed", no_argument, NULL, OPT_SUB_PACKED },
+	{ "verify", no_argument, NULL, OPT_VERIFY },
+	{ "hash", required_argument, NULL, OPT_HASH },
+	{ "hash-file", required_argument, NULL, OPT_HASH_FILE },
+	{ "sparse", no_argument, NULL, OPT_SPARSE },
+	{ "cso", optional_argument, NULL, OPT_CSO },
+	{ "batch", required_argument, NULL, OPT_BATCH },
+	{ "per-device", required_argument, NULL, OPT_PER_DEVICE },
+	{ "manifest", required_argument, NULL, OPT_MANIFEST },
+	{ "stats", required_argument, NULL, OPT_STATS },
+	{ "progress", optional_argument, NULL, OPT_PROGRESS },
+	{ "scan", required_argument, NULL, OPT_SCAN },
+	{ "index", required_argument, NULL, OPT_INDEX },
+	{ "list", required_argument, NULL, OPT_LIST },
+	{ "extract", required_argument, NULL, OPT_EXTRACT },
+	{ NULL, 0, NULL, 0 },
 };
 
-
-const char *mds_mediatype_tostring(const uint16_t mediatype)
+uint8_t xchg4(uint8_t a)
 {
-	switch (mediatype) {
-	case 0: return "CD-ROM";
-	case 1: return "CD-R";
-	case 2: return "CD-RW";
-	case 16: return "DVD-ROM";
-	case 18: return "DVD-R";
-	default: return "(unknown)";
-	}
+	unsigned lsb = a & 0x0f;
+	unsigned msb = (a & 0xf0) >> 4;
+	return (lsb << 4) | msb;
 }
 
-const char *mds_trackmode_tostring(const enum trackmode_e trackmode)
+/* Show everything we know about the MDS file. */
+static void print_mds(const struct mds_ctx *ctx)
 {
-	switch (trackmode) {
-	case TM_NONE: return "(lead-in)";
-	case TM_DVD: return "DVD";
-	case TM_AUDIO: return "AUDIO";
-	case TM_MODE1: return "MODE1";
-	case TM_MODE2: return "MODE2";
-	case TM_MODE2_FORM1: return "MODE2_FORM1";
-	case TM_MODE2_FORM2: return "MODE2_FORM2";
-	case TM_MODE2_SUB: return "MODE2 (with subchannels)";
-	default: return "(unknown)";
-	}
-}
+	const struct mds_s *mds = mds_raw_header(ctx);
+	unsigned tracknum = 0;
 
-bool IsCD(const uint16_t mediatype)
-{
-	switch (mediatype) {
-	case 0:
-	case 1:
-	case 2:
-		return true;
-	default:
-		return false;
-	}
-}
+	printf("%s\n", PROG_VERSION);
+	hexdump(mds, sizeof(*mds));
+	printf("mds version: v%u.%u\n", mds->version[0], mds->version[1]);
+	printf("media: %s\n", mds_mediatype_tostring(mds->mediatype));
+	printf("sessions: %u\n", mds->numsessions);
+	printf("disc off: %08x\n", mds->discstruct_off);
+	printf("session off: %08x\n", mds->session_off);
+	printf("dpm off: %08x\n", mds->dpm_off);
 
-struct trackmode_info_s get_info_for_trackmode(const enum trackmode_e trackmode)
-{
-	for (size_t idx = 0; !trackmode_infos[idx].last; idx++) {
-		if (trackmode == trackmode_infos[idx].trackmode)
-			return trackmode_infos[idx];
+	for (unsigned s = 0; s < mds_num_raw_sessions(ctx); s++) {
+		const struct session_s *session = mds_raw_session(ctx, s);
+
+		hexdump(session, sizeof(*session));
+		printf("sec_first: %d\n", (int32_t)session->sec_first);
+		printf("sec_last: %d\n", (int32_t)session->sec_last);
+		printf("numsession: %u\n", session->numsession);
+		printf("numtracks: %u\n", session->numtracks);
+		printf("numtracks2: %u\n", session->numtracks2);
+		printf("track_first: %u\n", session->track_first);
+		printf("track_last: %u\n", session->track_last);
+		printf("track_off: %08x\n", session->track_off);
+
+		for (unsigned b = 0; b < session->numtracks; b++, tracknum++) {
+			struct track_s track = *mds_raw_track(ctx, tracknum);
+
+			printf("track block %2u:\n", tracknum);
+			printf("\tpointno: %02Xh\n", track.pointno);
+
+			switch (track.pointno) {
+			case 0xA0:
+				printf("\tadr: %02Xh\n", xchg4(track.adr));
+				printf("\tfirst track no: %u\n", track.pmin);
+				printf("\tdisk type: %02xh ", track.psec);
+				switch (track.psec) {
+				case 0x00:	printf("(CD-DA or CD-ROM)\n");	break;
+				case 0x10:	printf("(CD-I)\n");		break;
+				case 0x20:	printf("(CD-ROM XA)\n");	break;
+				default:	printf("(unknown)\n");		break;
+				}
+				break;
+			case 0xA1:
+				printf("\tadr: %02Xh\n", xchg4(track.adr));
+				printf("\tlast track no: %u\n", track.pmin);
+				break;
+			case 0xA2:
+				printf("\tadr: %02Xh\n", xchg4(track.adr));
+				printf("\tend of disc msf: %02u:%02u:%02u\n",
+					track.pmin,
+					track.psec,
+					track.pframe
+				);
+				break;
+			case 0xB0:
+				printf("\tadr: %02Xh\n", xchg4(track.adr));
+				printf("\tnext session area start: %02u:%02u:%02u\n",
+					track.min,
+					track.sec,
+					track.frame
+				);
+				printf("\tnext session area end: %02u:%02u:%02u\n",
+					track.pmin,
+					track.psec,
+					track.pframe
+				);
+				printf("\ttotal number of adr5 pointers: %u\n",
+					track.zero
+				);
+				break;
+			case 0xC0:
+				printf("\tadr: %02Xh\n", xchg4(track.adr));
+				printf("\tstart of first lead-in: %02u:%02u:%02u\n",
+					track.pmin,
+					track.psec,
+					track.pframe
+				);
+				break;
+			case 0x01 ... 0x99:
+				printf("\ttrackmode: %s\n", mds_trackmode_tostring(track.trackmode));
+				printf("\tnumsubchannels: %u\n", track.numsubchannels);
+				printf("\tadr: %02Xh\n", xchg4(track.adr));
+				printf("\ttrackno: %u\n", track.trackno);
+				printf("\tmsf: %02u:%02u:%02u\n", track.pmin, track.psec, track.pframe);
+				printf("\tindexblock_off: %08x\n", track.indexblock_off);
+				printf("\tsecsize: %xh\n", track.secsize);
+				printf("\tsec_first: %u\n", track.sec_first);
+				printf("\tsec_off: %016" PRIx64 "\n", track.sec_off);
+				printf("\tfilenames_num: %u\n", track.filenames_num);
+				printf("\tfilenames_off: %08x\n", track.filenames_off);
+				break;
+			default:
+				printf("\tunknown info\n");
+				break;
+			}
+		}
 	}
-	return (struct trackmode_info_s) { .last = true };
 }
 
-struct mds_s {
-	char magic[16];	// "MEDIA DESCRIPTOR"
-	uint8_t version[2];
-	uint16_t mediatype;
-	uint16_t numsessions;
-	uint32_t _idk16;
-	uint16_t bca_len;
-	char _idk1c[8];
-	uint32_t bca_off;
-	char _idc28[0x18];
-	uint32_t discstruct_off;
-	char _idk44[0x0c];
-	uint32_t session_off;
-	uint32_t dpm_off;
-} __attribute__((packed));
-
-void mds_ntoh(struct mds_s *mds)
+/*
+ * Parse a comma-separated list of hash names into algs, which has room
+ * for one of each. Returns how many there were, or 0 if any name is
+ * unknown or repeated.
+ */
+static unsigned parse_hashes(char *list, enum digest_e *algs)
 {
-	mds->mediatype = le16toh(mds->mediatype);
-	mds->numsessions = le16toh(mds->numsessions);
-	mds->bca_len = le16toh(mds->bca_len);
-	mds->bca_off = le32toh(mds->bca_off);
-	mds->discstruct_off = le32toh(mds->discstruct_off);
-	mds->session_off = le32toh(mds->session_off);
-	mds->dpm_off = le32toh(mds->dpm_off);
-}
+	unsigned n = 0;
 
-struct session_s {
-	uint32_t sec_first;
-	uint32_t sec_last;
-	uint16_t numsession;
-	uint8_t numtracks;
-	uint8_t numtracks2;
-	uint16_t track_first;
-	uint16_t track_last;
-	uint32_t _idk10;
-	uint32_t track_off;
-} __attribute__((packed));
-
-void session_ntoh(struct session_s *session)
-{
-	session->sec_first = le32toh(session->sec_first);
-	session->sec_last = le32toh(session->sec_last);
-	session->numsession = le16toh(session->numsession);
-	session->track_first = le16toh(session->track_first);
-	session->track_last = le16toh(session->track_last);
-	session->track_off = le32toh(session->track_off);
+	for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		int alg = digest_lookup(name);
+
+		if (alg == -1)
+			return 0;
+		for (unsigned i = 0; i < n; i++) {
+			if (algs[i] == (enum digest_e)alg)
+				return 0;
+		}
+		algs[n++] = alg;
+	}
+	return n;
 }
 
-struct track_s {
-	uint8_t trackmode;
-	uint8_t numsubchannels;
-	uint8_t adr;
-	uint8_t trackno;
-	uint8_t pointno;
-	uint8_t min;
-	uint8_t sec;
-	uint8_t frame;
-	uint8_t zero;	// deceptively named
-	uint8_t pmin;
-	uint8_t psec;
-	uint8_t pframe;
-	/* below are zero-filled for point >= 0xA0 */
-	uint32_t indexblock_off;
-	uint16_t secsize;	// bytes
-	uint8_t _idk12;
-	char _idk13[0x11];
-	uint32_t sec_first;
-	uint64_t sec_off;	// bytes from beginning of .mdf file
-	uint32_t filenames_num;
-	uint32_t filenames_off;
-	char _idk38[0x18];
-} __attribute__((packed));
-
-void track_ntoh(struct track_s *track)
+/* One line per hash, in the tagged format of md5sum --tag and friends. */
+static void print_hashes(FILE *f, const char *filename, const struct hash_result_s *results, unsigned n)
 {
-	track->indexblock_off = le32toh(track->indexblock_off);
-	track->secsize = le16toh(track->secsize);
-	track->sec_first = le32toh(track->sec_first);
-	track->sec_off = le64toh(track->sec_off);
-	track->filenames_num = le32toh(track->filenames_num);
-	track->filenames_off = le32toh(track->filenames_off);
+	for (unsigned i = 0; i < n; i++) {
+		for (const char *c = digest_name(results[i].alg); *c; c++)
+			fputc(toupper((unsigned char)*c), f);
+		fprintf(f, " (%s) = ", filename);
+		for (size_t j = 0; j < results[i].len; j++)
+			fprintf(f, "%02x", results[i].value[j]);
+		fprintf(f, "\n");
+	}
 }
 
-struct index_s {
-	uint32_t block_first;
-	uint32_t block_last;
-} __attribute__((packed));
-
-void index_ntoh(struct index_s *index)
+/* One line about an image in an index, and then its tracks if wanted. */
+static void print_index_image(const struct index_file_s *idx, const struct index_image_s *image, bool tracks)
 {
-	index->block_first = le32toh(index->block_first);
-	index->block_last = le32toh(index->block_last);
-}
+	printf("%s: ", index_path(idx, image));
+	if (image->flags & INDEX_BAD_MDS) {
+		printf("unreadable\n");
+		return;
+	}
+	printf("%s, %u session%s, %u track%s, %.1f MiB", mds_mediatype_tostring(image->mediatype),
+		image->numsessions, (image->numsessions == 1) ? "" : "s",
+		image->numtracks, (image->numtracks == 1) ? "" : "s",
+		image->mdf_size / 1048576.0);
+	if (image->flags & INDEX_NO_MDF)
+		printf(", data missing");
+	if (image->flags & INDEX_PVD) {
+		int len = sizeof(image->volume_id);
 
-struct filename_s {
-	uint32_t off;
-	uint8_t format;	// 0: 8-bit chars, 1: 16-bit chars
-	uint8_t _pad5[11];
-} __attribute__((packed));
+		while (len && (image->volume_id[len - 1] == ' '))
+			len--;
+		printf(", volume '%.*s' of %.1f MiB", len, image->volume_id,
+			(double)image->volume_blocks * image->volume_block_size / 1048576.0);
+	}
+	printf("\n");
+	for (unsigned t = 0; tracks && (t < image->numtracks); t++) {
+		struct index_track_s track;
 
-void filename_ntoh(struct filename_s *fn)
-{
-	fn->off = le32toh(fn->off);
+		index_track(idx, image, t, &track);
+		printf("\ttrack %02u (session %u): %s, lba %d, %u sectors of %u bytes\n",
+			track.point, track.session, mds_trackmode_tostring(track.mode),
+			track.lba, track.length, track.secsize);
+	}
 }
 
-uint8_t xchg4(uint8_t a)
+/* One line about a file on a disc, a bit like ls -l. */
+static void print_isofs_file(const struct isofs_file_s *file)
 {
-	unsigned lsb = a & 0x0f;
-	unsigned msb = (a & 0xf0) >> 4;
-	return (lsb << 4) | msb;
-}
+	time_t t = file->mtime;
+	struct tm tm;
+	char date[32] = "?";
 
-struct track_s *tracks = NULL;
-unsigned numtracks = 0;
+	if (gmtime_r(&t, &tm))
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+	printf("%c %12" PRIu64 " %s %s%s\n", file->dir ? 'd' : '-', file->size, date,
+		*file->name ? file->name : "/", (file->dir && *file->name) ? "/" : "");
+}
 
-int GetTrackForPoint(unsigned point)
+/*
+ * Open an MDF for extraction. Anything that isn't a regular file can
+ * only be read from front to back.
+ */
+static int open_mdf(const char *filename, bool *stream)
 {
-	if (!tracks) return -1;
+	struct stat sb;
+	int fd;
 
-	for (unsigned i = 0; i < numtracks; i++) {
-		if (tracks[i].pointno == point) return i;
-	}
-
-	return -1;
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &sb) || !S_ISREG(sb.st_mode))
+		*stream = true;
+	return fd;
 }
 
 int main(int argc, char *argv[])
@@ -228,12 +309,40 @@ int main(int argc, char *argv[])
 	int rc;
 	char *infilename = NULL;
 	char *outfilename = NULL;
+	char *mdffilename = NULL;
+	char *mountpoint = NULL;
+	char *nbdsock = NULL;
+	char *cuefilename = NULL;
+	bool split = false;
+	int32_t sample_offset = 0;
+	bool swap = false;
+	char *subfilename = NULL;
+	bool sub_packed = false;
+	bool verify = false;
+	enum digest_e hash_algs[DIGEST_COUNT];
+	unsigned num_hashes = 0;
+	char *hashfilename = NULL;
+	bool sparse = false;
+	int cso_level = 0;
+	char *batchlist = NULL;
+	unsigned per_device = 0;
+	char *manifestfile = NULL;
+	bool show_stats = false;
+	int progress_fd = -1;
+	char *scandir = NULL;
+	char *indexfile = NULL;
+	char *listpath = NULL;
+	char *extractpath = NULL;
 	bool verbose = false;
 	bool force = false;
+	unsigned nthreads = 0;
+	bool use_uring = false;
+	bool keep_cache = false;
+	unsigned qdepth = 8;
+	unsigned sel_session = 0;
+	unsigned sel_track = 0;
 	struct stat sb = {0,};
 
-	struct trackmode_info_s ti = {0};
-
 	progname_init(argc, argv);
 
 	if (sizeof(struct mds_s) != 0x58)
@@ -245,8 +354,16 @@ int main(int argc, char *argv[])
 	if(sizeof(struct track_s) != 0x50)
 		errx(1, "bad size of struct track_s");
 	
-	while ((rc = getopt(argc, argv, "fi:o:vV")) != -1)
+	while ((rc = getopt_long(argc, argv, "b:fi:j:km:o:q:s:t:vV", longopts, NULL)) != -1)
 		switch (rc) {
+		case 'b':
+			if (!strcmp(optarg, "uring"))
+				use_uring = true;
+			else if (!strcmp(optarg, "mmap"))
+				use_uring = false;
+			else
+				usage();
+			break;
 		case 'f':
 			force = true;
 			break;
@@ -255,11 +372,47 @@ int main(int argc, char *argv[])
 				usage();
 			infilename = optarg;
 			break;
+		case 'j': {
+			char *end;
+			unsigned long n = strtoul(optarg, &end, 10);
+			if (*end || (n < 1) || (n > 256))
+				usage();
+			nthreads = n;
+			break;
+		}
+		case 'k':
+			keep_cache = true;
+			break;
+		case 'm':
+			if (mdffilename)
+				usage();
+			mdffilename = optarg;
+			break;
 		case 'o':
 			if (outfilename)
 				usage();
 			outfilename = optarg;
 			break;
+		case 'q': {
+			char *end;
+			unsigned long n = strtoul(optarg, &end, 10);
+			if (*end || (n < 1) || (n > 4096))
+				usage();
+			qdepth = n;
+			break;
+		}
+		case 's':
+		case 't': {
+			char *end;
+			unsigned long n = strtoul(optarg, &end, 10);
+			if (*end || (n < 1) || (n > 99))
+				usage();
+			if (rc == 's')
+				sel_session = n;
+			else
+				sel_track = n;
+			break;
+		}
 		case 'v':
 			verbose = true;
 			break;
@@ -267,210 +420,463 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "%s\n", PROG_VERSION);
 			exit(EXIT_SUCCESS);
 			break;
+		case OPT_MOUNT:
+			mountpoint = optarg;
+			break;
+		case OPT_NBD:
+			nbdsock = optarg;
+			break;
+		case OPT_CUE:
+			cuefilename = optarg;
+			break;
+		case OPT_SPLIT:
+			split = true;
+			break;
+		case OPT_OFFSET: {
+			char *end;
+			long n = strtol(optarg, &end, 10);
+			if (*end || (n < -100000) || (n > 100000))
+				usage();
+			sample_offset = n;
+			break;
+		}
+		case OPT_SWAP:
+			swap = true;
+			break;
+		case OPT_SUB:
+			subfilename = optarg;
+			break;
+		case OPT_SUB_PACKED:
+			sub_packed = true;
+			break;
+		case OPT_VERIFY:
+			verify = true;
+			break;
+		case OPT_HASH:
+			num_hashes = parse_hashes(optarg, hash_algs);
+			if (!num_hashes)
+				errx(1, "--hash takes a list of crc32, md5, sha1 and sha256");
+			break;
+		case OPT_HASH_FILE:
+			hashfilename = optarg;
+			break;
+		case OPT_SPARSE:
+			sparse = true;
+			break;
+		case OPT_CSO: {
+			char *end;
+			unsigned long n = optarg ? strtoul(optarg, &end, 10) : 9;
+			if ((optarg && *end) || (n < 1) || (n > 9))
+				usage();
+			cso_level = n;
+			break;
+		}
+		case OPT_BATCH:
+			batchlist = optarg;
+			break;
+		case OPT_PER_DEVICE: {
+			char *end;
+			unsigned long n = strtoul(optarg, &end, 10);
+			if (*end || (n < 1) || (n > 256))
+				usage();
+			per_device = n;
+			break;
+		}
+		case OPT_MANIFEST:
+			manifestfile = optarg;
+			break;
+		case OPT_STATS:
+			// JSON is the only format so far.
+			if (strcmp(optarg, "json"))
+				usage();
+			show_stats = true;
+			break;
+		case OPT_PROGRESS: {
+			char *end;
+			unsigned long n = optarg ? strtoul(optarg, &end, 10) : STDERR_FILENO;
+			if ((optarg && *end) || (n > 1024))
+				usage();
+			if (fcntl(n, F_GETFD) == -1)
+				err(1, "can't report progress to fd %lu", n);
+			progress_fd = n;
+			break;
+		}
+		case OPT_SCAN:
+			scandir = optarg;
+			break;
+		case OPT_INDEX:
+			indexfile = optarg;
+			break;
+		case OPT_LIST:
+			listpath = optarg;
+			break;
+		case OPT_EXTRACT:
+			extractpath = optarg;
+			break;
 		default:
 			usage();
 		}
 	argc -= optind;
 	argv += optind;
-	if (not infilename)
+	if (not infilename and not batchlist and not indexfile)
+		usage();
+	if (scandir && (!indexfile || infilename))
+		usage();
+	if (indexfile && (batchlist || mdffilename || outfilename || mountpoint || nbdsock || cuefilename
+		|| verify || subfilename || num_hashes || cso_level || sel_session || sel_track || sparse
+		|| show_stats || (progress_fd != -1)))
+		usage();
+	if (batchlist && (infilename || mdffilename || mountpoint || nbdsock || cuefilename || verify
+		|| subfilename || num_hashes || cso_level || sel_session || sel_track || sample_offset || swap))
 		usage();
 	if (*argv != NULL)
 		usage();
+	if (nbdsock && (outfilename || mountpoint))
+		usage();
+	if (cuefilename && (outfilename || mountpoint || nbdsock || sel_session || sel_track))
+		usage();
+	if ((per_device || manifestfile) && !batchlist)
+		usage();
+	if (split && !cuefilename)
+		usage();
+	if ((subfilename && (nbdsock || mountpoint)) || (sub_packed && !subfilename))
+		usage();
+	if (verify && (outfilename || mountpoint || nbdsock || cuefilename || subfilename))
+		usage();
+	if ((num_hashes && !outfilename) || (hashfilename && !num_hashes))
+		usage();
+	if (sparse && !outfilename && !cuefilename && !batchlist)
+		usage();
+	if (cso_level && (!outfilename || sparse || num_hashes || subfilename))
+		usage();
+	if (show_stats && (!outfilename || batchlist))
+		usage();
+	if ((progress_fd != -1) && (!outfilename || batchlist))
+		usage();
+	if ((listpath || extractpath) && (batchlist || indexfile || mountpoint || nbdsock || cuefilename
+		|| verify || subfilename || num_hashes || cso_level || sparse || show_stats
+		|| (progress_fd != -1) || sample_offset || swap))
+		usage();
+	if ((listpath && (extractpath || outfilename)) || (extractpath && !outfilename))
+		usage();
+#ifndef HAVE_ZLIB
+	if (cso_level)
+		errx(1, "this %s was built without zlib support", __progname);
+#endif
+	if (verbose && outfilename && !strcmp(outfilename, "-"))
+		errx(1, "can't print diagnostics while writing the image to stdout");
 	
-	struct MappedFile_s mds_file;
-	mds_file = MappedFile_Open(infilename, false);
-	if (!mds_file.data) err(1, "couldn't open '%s' for reading", infilename);
+	const char *msg;
 
 	//
-	// Open up MDS header.
+	// Catalog every image under a directory.
 	//
+	if (scandir) {
+		struct scan_result_s res;
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 
-	struct mds_s mds;
-	memcpy(&mds, mds_file.data, sizeof(mds));
-	if (memcmp(mds.magic, "MEDIA DESCRIPTOR", sizeof(mds.magic)))
-		errx(1, "not an mds file? bad magic in '%s'", infilename);
-	mds_ntoh(&mds);
-
-	if (mds.version[0] > 1) {
-		errx(1, "sorry, mds file version %u.%u not supported",
-			mds.version[0],
-			mds.version[1]
-		);
+		// Reading is mostly waiting on the disk, so more threads than
+		// CPUs help.
+		rc = scan_tree(scandir, indexfile, nthreads ? nthreads : (ncpu > 0) ? 4 * ncpu : 4, &res);
+		if (rc) err(1, "couldn't scan '%s' into '%s'", scandir, indexfile);
+		printf("%zu image%s indexed", res.images, (res.images == 1) ? "" : "s");
+		if (res.bad)
+			printf(", %zu unreadable", res.bad);
+		if (res.skipped_dirs)
+			printf(", %zu director%s skipped", res.skipped_dirs, (res.skipped_dirs == 1) ? "y" : "ies");
+		printf("\n");
+		return EXIT_SUCCESS;
 	}
 
-	if (verbose) {
-		printf("%s\n", PROG_VERSION);
-		hexdump(&mds, sizeof(mds));
-		printf("mds version: v%u.%u\n", mds.version[0], mds.version[1]);
-		printf("media: %s\n", mds_mediatype_tostring(mds.mediatype));
-		printf("sessions: %u\n", mds.numsessions);
-		printf("disc off: %08x\n", mds.discstruct_off);
-		printf("session off: %08x\n", mds.session_off);
-		printf("dpm off: %08x\n", mds.dpm_off);
+	//
+	// Show what an index says about every image in it, or about the
+	// one asked for.
+	//
+	if (indexfile) {
+		struct index_file_s *idx = index_open(indexfile, &msg);
+		struct index_image_s image;
+
+		if (!idx && msg) errx(1, "%s in '%s'", msg, indexfile);
+		if (!idx) err(1, "couldn't open '%s'", indexfile);
+		if (infilename) {
+			ssize_t i = index_find(idx, infilename);
+			if (i == -1)
+				errx(1, "'%s' isn't in '%s'", infilename, indexfile);
+			index_image(idx, i, &image);
+			print_index_image(idx, &image, true);
+		} else {
+			for (size_t i = 0; i < index_num_images(idx); i++) {
+				index_image(idx, i, &image);
+				print_index_image(idx, &image, verbose);
+			}
+		}
+		index_close(idx);
+		return EXIT_SUCCESS;
 	}
 
 	//
-	// Open session header.
+	// Convert every image in a list or directory, with -o naming where
+	// the ISOs go.
 	//
+	if (batchlist) {
+		struct batch_opts_s opts = {
+			.outdir = outfilename,
+			.force = force,
+			.sparse = sparse,
+			.per_device = per_device ? per_device : 2,
+		};
+		struct manifest_s manifest;
+		struct batch_result_s *res;
+		size_t n, failed = 0;
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (manifestfile) {
+			if (manifest_load(&manifest, manifestfile))
+				err(1, "couldn't read '%s'", manifestfile);
+			opts.manifest = &manifest;
+		}
+		opts.nthreads = nthreads ? nthreads : (ncpu > 0) ? ncpu : 1;
+		rc = batch_convert(batchlist, &opts, &res, &n, &msg);
+		if (rc && msg) errx(1, "%s in '%s'", msg, batchlist);
+		if (rc) err(1, "couldn't read '%s'", batchlist);
+		for (size_t i = 0; i < n; i++) {
+			if (!res[i].what && res[i].unchanged) {
+				printf("%s -> %s: unchanged\n", res[i].mdsfile, res[i].isofile);
+				continue;
+			} else if (!res[i].what && res[i].copyof) {
+				printf("%s -> %s: copy of %s, cloned in %.1f s\n", res[i].mdsfile, res[i].isofile,
+					res[i].copyof, res[i].seconds);
+				continue;
+			} else if (!res[i].what) {
+				printf("%s -> %s: %.1f MiB in %.1f s\n", res[i].mdsfile, res[i].isofile,
+					res[i].bytes / 1048576.0, res[i].seconds);
+				continue;
+			}
+			if (res[i].err)
+				printf("%s: %s: %s\n", res[i].mdsfile, res[i].what, strerror(res[i].err));
+			else
+				printf("%s: %s\n", res[i].mdsfile, res[i].what);
+			failed++;
+		}
+		batch_free(res, n);
+		fflush(stdout);
+		if (manifestfile) {
+			if (manifest_save(&manifest, manifestfile))
+				err(1, "couldn't write '%s'", manifestfile);
+			manifest_free(&manifest);
+		}
+		if (failed)
+			errx(1, "%zu of %zu image%s failed", failed, n, (n == 1) ? "" : "s");
+		return EXIT_SUCCESS;
+	}
 
-	struct session_s session;
-	memcpy(&session, mds_file.data + mds.session_off, sizeof(session));
-	session_ntoh(&session);
+	struct stats_s stats;
+	stats_init(&stats);
+	stats_phase(&stats, STATS_PARSE);
 
-	if (verbose) {
-		hexdump(&session, sizeof(session));
-		printf("sec_first: %d\n", (int32_t)session.sec_first);
-		printf("sec_last: %d\n", (int32_t)session.sec_last);
-		printf("numsession: %u\n", session.numsession);
-		printf("numtracks: %u\n", session.numtracks);
-		printf("numtracks2: %u\n", session.numtracks2);
-		printf("track_first: %u\n", session.track_first);
-		printf("track_last: %u\n", session.track_last);
-		printf("track_off: %08x\n", session.track_off);
+	struct mds_ctx *ctx = mds_open(infilename, &msg);
+	if (!ctx && msg) errx(1, "%s in '%s'", msg, infilename);
+	if (!ctx) err(1, "couldn't open '%s' for reading", infilename);
+
+	if (verbose)
+		print_mds(ctx);
+
+	if (mountpoint) {
+#ifdef HAVE_FUSE
+		if (mds_open_data(ctx, mdffilename))
+			err(1, "couldn't open mdf file");
+		if (mount_image(ctx, mountpoint))
+			errx(1, "couldn't mount '%s'", mountpoint);
+		mds_close(ctx);
+		return EXIT_SUCCESS;
+#else
+		errx(1, "this %s was built without FUSE support", __progname);
+#endif
 	}
 
 	//
-	// Set up track structs.
+	// Write out every track as BIN/CUE.
 	//
+	if (cuefilename) {
+		struct cue_opts_s opts = {
+			.mdffile = mdffilename,
+			.subfile = subfilename,
+			.sub_packed = sub_packed,
+			.split = split,
+			.force = force,
+			.keep_cache = keep_cache,
+			.nthreads = nthreads ? nthreads : 1,
+			.sparse = sparse,
+		};
+		rc = write_bincue(ctx, cuefilename, &opts, &msg);
+		if (rc && msg) errx(1, "%s", msg);
+		if (rc) err(1, "couldn't write '%s'", cuefilename);
+		mds_close(ctx);
+		return EXIT_SUCCESS;
+	}
 
-	numtracks = session.numtracks;
-	tracks = calloc(sizeof(struct track_s), numtracks);
-	if (!tracks) err(1, "in calloc");
-	char **filenames;
-	filenames = calloc(sizeof(char *), numtracks);
-	if (!filenames) err(1, "in calloc");
-
-	// For each track.
-	for (unsigned tracknum = 0; tracknum < numtracks; tracknum++) {
-		// Make an entry in 'tracks'.
-		memcpy(&tracks[tracknum], mds_file.data + session.track_off + tracknum*sizeof(struct track_s), sizeof(struct track_s));
-		track_ntoh(&tracks[tracknum]);
-		if (tracks[tracknum].filenames_num > 1) {
-			errx(1, "sorry, can't deal with multiple filenames per track (yet).\nthe number of filenames was: %d", tracks[tracknum].filenames_num);
-		}
+	//
+	// Check the EDC and ECC of every raw data sector, or just those of
+	// the session or track asked for.
+	//
+	if (verify) {
+		uint64_t numbad = 0;
+		unsigned checked = 0;
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 
-		// Make an entry in 'filenames'.
-		struct filename_s *fn = (struct filename_s *)(mds_file.data + tracks[tracknum].filenames_off);
-		for (unsigned fn_idx = 0; fn_idx < tracks[tracknum].filenames_num; fn_idx++) {
-			// FIXME: what if there is more than 1 filename for a track?
-			filename_ntoh(&fn[fn_idx]);
-			filenames[tracknum] = strdup(mds_file.data + fn[fn_idx].off);
-		}
-	}
+		if (mds_open_data(ctx, mdffilename))
+			err(1, "couldn't open mdf file");
+		for (unsigned t = 0; t < mds_num_tracks(ctx); t++) {
+			struct mds_track_info_s ti;
+			struct verify_bad_s *bad;
+			size_t n;
 
-	if (verbose) for (unsigned tracknum = 0; tracknum < numtracks; tracknum++) {
-		struct track_s track = tracks[tracknum];
-
-		printf("track block %2u:\n", tracknum);
-		printf("\tpointno: %02Xh\n", track.pointno);
-
-		switch (track.pointno) {
-		case 0xA0:
-			printf("\tadr: %02Xh\n", xchg4(track.adr));
-			printf("\tfirst track no: %u\n", track.pmin);
-			printf("\tdisk type: %02xh ", track.psec);
-			switch (track.psec) {
-			case 0x00:	printf("(CD-DA or CD-ROM)\n");	break;
-			case 0x10:	printf("(CD-I)\n");		break;
-			case 0x20:	printf("(CD-ROM XA)\n");	break;
-			default:	printf("(unknown)\n");		break;
+			mds_get_track(ctx, t, &ti);
+			if ((sel_session && (ti.session != sel_session)) || (sel_track && (ti.point != sel_track)))
+				continue;
+			if (!verify_can_check(&ti)) {
+				if (sel_track)
+					errx(1, "track %u has no EDC or ECC to check", ti.point);
+				continue;
 			}
-			break;
-		case 0xA1:
-			printf("\tadr: %02Xh\n", xchg4(track.adr));
-			printf("\tlast track no: %u\n", track.pmin);
-			break;
-		case 0xA2:
-			printf("\tadr: %02Xh\n", xchg4(track.adr));
-			printf("\tend of disc msf: %02u:%02u:%02u\n",
-				track.pmin,
-				track.psec,
-				track.pframe
-			);
-			break;
-		case 0xB0:
-			printf("\tadr: %02Xh\n", xchg4(track.adr));
-			printf("\tnext session area start: %02u:%02u:%02u\n",
-				track.min,
-				track.sec,
-				track.frame
-			);
-			printf("\tnext session area end: %02u:%02u:%02u\n",
-				track.pmin,
-				track.psec,
-				track.pframe
-			);
-			printf("\ttotal number of adr5 pointers: %u\n",
-				track.zero
-			);
-			break;
-		case 0xC0:
-			printf("\tadr: %02Xh\n", xchg4(track.adr));
-			printf("\tstart of first lead-in: %02u:%02u:%02u\n",
-				track.pmin,
-				track.psec,
-				track.pframe
-			);
-			break;
-		case 0x01 ... 0x99:
-			printf("\ttrackmode: %s\n", mds_trackmode_tostring(track.trackmode));
-			printf("\tnumsubchannels: %u\n", track.numsubchannels);
-			printf("\tadr: %02Xh\n", xchg4(track.adr));
-			printf("\ttrackno: %u\n", track.trackno);
-			printf("\tmsf: %02u:%02u:%02u\n", track.pmin, track.psec, track.pframe);
-			printf("\tindexblock_off: %08x\n", track.indexblock_off);
-			printf("\tsecsize: %xh\n", track.secsize);
-			printf("\tsec_first: %u\n", track.sec_first);
-			printf("\tsec_off: %016" PRIx64 "\n", track.sec_off);
-			printf("\tfilenames_num: %u\n", track.filenames_num);
-			printf("\tfilenames_off: %08x\n", track.filenames_off);
-			break;
-		default:
-			printf("\tunknown info\n");
-			break;
+			if (verify_track(ctx, t, nthreads ? nthreads : (ncpu > 0) ? ncpu : 1, &bad, &n))
+				err(1, "couldn't verify track %u", ti.point);
+			for (size_t i = 0; i < n; i++) {
+				if (bad[i].count == 1)
+					printf("track %02u lba %d: %s\n", ti.point, bad[i].lba,
+						verify_error_tostring(bad[i].what));
+				else
+					printf("track %02u lba %d-%d: %s\n", ti.point, bad[i].lba,
+						bad[i].lba + (int32_t)bad[i].count - 1,
+						verify_error_tostring(bad[i].what));
+				numbad += bad[i].count;
+			}
+			free(bad);
+			checked++;
 		}
+		if (!checked)
+			errx(1, "no tracks with EDC or ECC to check");
+		fflush(stdout);
+		if (numbad)
+			errx(1, "%" PRIu64 " bad sector%s", numbad, (numbad == 1) ? "" : "s");
+		mds_close(ctx);
+		return EXIT_SUCCESS;
 	}
 
 	//
-	// Find the first data track.
+	// Find the track to extract: the one asked for, or else the first
+	// data track, in the session asked for if there is one.
 	//
 
 	int datatrack = -1;
-	for (int i = 0; i < numtracks; i++) {
-		if ((tracks[i].trackmode >= TM_MODE1) || (tracks[i].trackmode == TM_DVD)) {
-			datatrack = i;
-			break;
-		}
+	struct mds_track_info_s info;
+	for (unsigned t = 0; t < mds_num_tracks(ctx); t++) {
+		mds_get_track(ctx, t, &info);
+		if (sel_session && (info.session != sel_session))
+			continue;
+		if (sel_track ? (info.point != sel_track) : !info.data)
+			continue;
+		datatrack = t;
+		break;
 	}
-
 	if (datatrack == -1) {
+		if (sel_track && sel_session)
+			errx(1, "no track %u in session %u", sel_track, sel_session);
+		else if (sel_track)
+			errx(1, "no track %u", sel_track);
+		else if (sel_session)
+			errx(1, "no data track found in session %u", sel_session);
 		errx(1, "no data track found");
 	}
+	if (!info.data && (nbdsock || listpath || extractpath))
+		errx(1, "track %u is an audio track", info.point);
+	if (info.data && (sample_offset || swap))
+		errx(1, "--offset and --swap only apply to audio tracks");
+	if (subfilename && !info.data)
+		errx(1, "--sub only applies to data tracks");
+	if (sparse && !info.data)
+		errx(1, "--sparse only applies to data tracks");
+	if (subfilename && (!info.numsubchannels || (info.secsize < info.data_off + info.data_len + SUB_LEN)))
+		errx(1, "track %u has no subchannel data", info.point);
+	if (!info.data_len) errx(1, "unknown track mode '%02Xh'", info.mode);
+
+	if (verbose) {
+		printf("\n");
+		printf("trackinfo:\n");
+		printf("session: %u\n", info.session);
+		printf("track: %u\n", info.point);
+		printf("data_stride: %xh\n", info.secsize);
+		printf("data_off: %xh\n", info.data_off);
+		printf("data_len: %xh\n", info.data_len);
+	}
 
 	//
-	// Find length of selected data track.
+	// List or copy out files from the filesystem on the track, reading
+	// only their own sectors.
 	//
-	unsigned numblocks = 0;
-	if ((datatrack < (numtracks - 1)) && (tracks[datatrack + 1].pointno <= 0x99)) {
-		numblocks = tracks[datatrack + 1].sec_first - tracks[datatrack].sec_first;
-	} else {
-		numblocks = session.sec_last;
-	}
+	if (listpath || extractpath) {
+		const char *path = listpath ? listpath : extractpath;
+		struct isofs_s *fs;
+		struct isofs_file_s file;
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 
-	ti = get_info_for_trackmode(tracks[datatrack].trackmode);
-	if (ti.last) errx(1, "unknown track mode '%02Xh'", tracks[datatrack].trackmode);
-	ti.data_stride = tracks[datatrack].secsize;
+		if (mds_open_data(ctx, mdffilename))
+			err(1, "couldn't open mdf file");
+		fs = isofs_open(ctx, datatrack, &msg);
+		if (!fs && msg) errx(1, "%s on track %u", msg, info.point);
+		if (!fs) err(1, "couldn't read the filesystem on track %u", info.point);
+		if (verbose)
+			printf("filesystem: %s\n\n", isofs_type(fs));
+		rc = isofs_lookup(fs, path, &file, &msg);
+		if (rc && msg) errx(1, "%s looking up '%s'", msg, path);
+		if (rc) err(1, "couldn't find '%s'", path);
 
-	if (verbose) {
-		printf("\n");
-		printf("trackinfo:\n");
-		printf("data_stride: %xh\n", ti.data_stride);
-		printf("data_off: %xh\n", ti.data_off);
-		printf("data_len: %xh\n", ti.data_len);
+		if (listpath && file.dir) {
+			struct isofs_file_s *files;
+			size_t n;
+
+			rc = isofs_readdir(fs, &file, &files, &n, &msg);
+			if (rc && msg) errx(1, "%s in '%s'", msg, path);
+			if (rc) err(1, "couldn't list '%s'", path);
+			for (size_t i = 0; i < n; i++)
+				print_isofs_file(&files[i]);
+			isofs_free_files(files, n);
+		} else if (listpath) {
+			print_isofs_file(&file);
+		} else {
+			struct isofs_extract_opts_s opts = {
+				.nthreads = nthreads ? nthreads : (ncpu > 0) ? ncpu : 1,
+				.force = force,
+			};
+
+			rc = isofs_extract(fs, &file, outfilename, &opts, &msg);
+			if (rc && msg) errx(1, "couldn't extract '%s': %s", path, msg);
+			if (rc) err(1, "couldn't extract '%s' to '%s'", path, outfilename);
+		}
+		fflush(stdout);
+		isofs_free_file(&file);
+		isofs_close(fs);
+		mds_close(ctx);
+		return EXIT_SUCCESS;
 	}
 
-	MappedFile_Close(mds_file);
-	mds_file.data = NULL;
+	//
+	// Serve the track over NBD instead of converting it.
+	//
+	if (nbdsock) {
+		if (!lstat(nbdsock, &sb)) {
+			if (!force)
+				errx(1, "'%s' already exists; use -f to replace it", nbdsock);
+			if (unlink(nbdsock))
+				err(1, "couldn't remove '%s'", nbdsock);
+		}
+		if (mds_open_data(ctx, mdffilename))
+			err(1, "couldn't open mdf file");
+		if (nbd_serve(ctx, datatrack, nbdsock, nthreads ? nthreads : 4))
+			err(1, "couldn't serve on '%s'", nbdsock);
+		mds_close(ctx);
+		return EXIT_SUCCESS;
+	}
 
 	if (not outfilename) {
 		if (verbose == 0) {
@@ -481,82 +887,248 @@ int main(int argc, char *argv[])
 	}
 
 	//
-	// Open .MDF file, which contains all the disc data.
+	// Open .MDF file, which contains all the disc data. When writing to
+	// stdout, or when the MDF is a pipe, read it front to back instead
+	// of mapping it.
 	//
-	struct MappedFile_s mdf_file = {0,};
+	bool to_stdout = !strcmp(outfilename, "-");
+	bool stream = to_stdout;
+	bool mdf_stream = false;
+	int mdf_fd = -1;
 
-	// First, try the .MDF filename given within the .MDS file (if there is one).
-	if (filenames[datatrack])
-		mdf_file = MappedFile_Open(filenames[datatrack], false);
-	
-	// We failed to open the MDF file by its included filename (or none was given).
-	if (!mdf_file.data) {
-		// Opening the file failed. Maybe it was renamed. We know the
-		// name of the .MDS file, so let's see if there's a file with
-		// the same name but .MDF extension.
-
-		// Verify that our .MDS file has a name ending with ".MDS".
-		char *mdfname = strdup(infilename);
-		if (!mdfname) err(1, "in strdup");
-		char *mdfname_ext = strrchr(infilename, '.');
-		if (!mdfname_ext || (strlen(mdfname_ext) != 4))
-			errx(1, "couldn't find mdf file: bad mds filename");
+	stats_phase(&stats, STATS_OPEN);
 
-		if (strcmp(mdfname_ext, ".mds") && strcmp(mdfname_ext, ".MDS"))
+	if (mdffilename) {
+		// The user told us where it is.
+		if (!strcmp(mdffilename, "-"))
+			mdf_fd = STDIN_FILENO;
+		else
+			mdf_fd = open_mdf(mdffilename, &mdf_stream);
+		if (mdf_fd == -1)
+			err(1, "couldn't open '%s' for reading", mdffilename);
+	}
+
+	// Otherwise use the one named in the .MDS file, or failing that
+	// the one named like it. Images split across several files are
+	// read through libmds instead.
+	bool split_mdf = false;
+	if ((mdf_fd == -1) && (mds_track_num_files(ctx, datatrack) > 1)) {
+		if (!info.data)
+			errx(1, "can't extract audio from a split image (yet)");
+		if (mds_open_data(ctx, NULL))
+			err(1, "couldn't open mdf files");
+		split_mdf = true;
+	} else if (mdf_fd == -1) {
+		const char *mdfname = mds_track_filename(ctx, datatrack);
+		if (!mdfname)
 			errx(1, "couldn't find mdf file: bad mds filename");
+		mdf_fd = open_mdf(mdfname, &mdf_stream);
+		if (mdf_fd == -1)
+			err(1, "couldn't open '%s' for reading", mdfname);
+	}
 
-		switch(mdfname_ext[3]) {
-		case 's':	mdfname[strlen(mdfname)-1] = 'f';	break;
-		case 'S':	mdfname[strlen(mdfname)-1] = 'F';	break;
-		default:
-			errx(1, "bad mdfname '%s'", mdfname);
+	if (mdf_fd == STDIN_FILENO)
+		mdf_stream = true;
+	if (mdf_stream)
+		stream = true;
+	if (mdf_stream && !info.data)
+		errx(1, "can't extract audio from a pipe; give -m a regular file");
+	if (stream && subfilename)
+		errx(1, "can't write subchannel data while streaming");
+	if (to_stdout && num_hashes && !hashfilename)
+		errx(1, "use --hash-file when writing the image to stdout");
+	if (to_stdout && (progress_fd == STDOUT_FILENO))
+		errx(1, "can't report progress on stdout while writing the image there");
+	if (cso_level && !info.data)
+		errx(1, "--cso only applies to data tracks");
+	if (cso_level && stream)
+		errx(1, "can't write CSO while streaming");
+
+	int out = STDOUT_FILENO;
+	if (!to_stdout) {
+		rc = stat(outfilename, &sb);
+		if ((rc == 0) && !force) {
+			errx(1, "output file '%s' already exists; use -f to force overwrite", outfilename);
 		}
+		out = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+		if (out == -1) err(1, "couldn't open file for writing");
+	}
 
-		mdf_file = MappedFile_Open(mdfname, false);
-		if (!mdf_file.data)
-			err(1, "couldn't open '%s' or '%s' for reading", filenames[datatrack], mdfname);
-		free(mdfname);
+	int sub = -1;
+	if (subfilename) {
+		rc = stat(subfilename, &sb);
+		if ((rc == 0) && !force)
+			errx(1, "output file '%s' already exists; use -f to force overwrite", subfilename);
+		sub = open(subfilename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+		if (sub == -1) err(1, "couldn't open '%s' for writing", subfilename);
 	}
-	for (unsigned i = 0; i < numtracks; i++) {
-		free(filenames[i]);
-		filenames[i] = NULL;
+
+	FILE *hashfile = stdout;
+	struct hash_ring_s *hash = NULL;
+	if (hashfilename) {
+		rc = stat(hashfilename, &sb);
+		if ((rc == 0) && !force)
+			errx(1, "output file '%s' already exists; use -f to force overwrite", hashfilename);
+		hashfile = fopen(hashfilename, "w");
+		if (!hashfile) err(1, "couldn't open '%s' for writing", hashfilename);
+	}
+	if (num_hashes) {
+		hash = hash_start(hash_algs, num_hashes);
+		if (!hash) err(1, "couldn't start hashing");
 	}
-	free(filenames);
-	filenames = NULL;
 
-	if (!mdf_file.data)
-		errx(1, "couldn't find mdf file");
-	
-	rc = stat(outfilename, &sb);
-	if ((rc == 0) && !force) {
-		errx(1, "output file '%s' already exists; use -f to force overwrite", outfilename);
+	struct extract_job_s job = {
+		.in_fd = mdf_fd,
+		.in_off = info.offset,
+		.stride = info.secsize,
+		.data_off = info.data_off,
+		.data_len = info.data_len,
+		.numblocks = info.length,
+		.out_fd = out,
+		.out_off = 0,
+		.keep_cache = keep_cache,
+		.with_sub = (sub != -1),
+		.sub_packed = sub_packed,
+		.sub_fd = sub,
+		.sub_off = 0,
+		.hash = hash,
+		.sparse = sparse,
+	};
+	stats_phase(&stats, STATS_EXTRACT);
+	stats.nthreads = 1;
+
+	struct progress_s *progress = NULL;
+	if (progress_fd != -1) {
+		progress = progress_start(progress_fd, (uint64_t)info.length * info.data_len, info.data_len);
+		if (!progress) err(1, "couldn't start reporting progress");
+		job.progress = progress_counter(progress);
 	}
-	FILE *out = fopen(outfilename, "wb");
-	if (!out) err(1, "couldn't open file for writing");
-	if (ti.data_len == ti.data_stride) {
-		// write the whole file in one go, if we can.
-		fwrite(mdf_file.data, numblocks, ti.data_len, out);
-	} else {
-		for (size_t block = 0; block < numblocks; block++) {
-			size_t sRc;
-			sRc = fwrite(mdf_file.data + (size_t)ti.data_stride*block + (size_t)ti.data_off, (size_t)ti.data_len, 1, out);
-			if (sRc != 1) err(1, "in fwrite");
+
+	rc = -1;
+	if (use_uring && !stream && info.data && !split_mdf && !subfilename && !hash && !sparse && !cso_level) {
+		rc = extract_uring(&job, qdepth);
+		stats.backend = "io_uring";
+		if (rc) switch (errno) {
+		case ENOSYS:
+		case EPERM:
+		case EINVAL:
+		case EOPNOTSUPP:
+		case ESPIPE:
+			// No io_uring here, or it can't do this kind of
+			// file. Start over the usual way.
+			warn("io_uring unavailable, using mmap");
+			progress_reset(progress);
+			break;
+		default:
+			err(1, "extraction to '%s' failed", outfilename);
 		}
 	}
-	rc = fclose(out);
+	if (!rc) {
+		// Already done.
+	} else if (cso_level) {
+#ifdef HAVE_ZLIB
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+		stats.backend = "cso";
+		stats.nthreads = nthreads ? nthreads : (ncpu > 0) ? ncpu : 1;
+		rc = mds_open_data(ctx, mdffilename ? mdffilename : mds_track_filename(ctx, datatrack));
+		if (!rc)
+			rc = write_cso(ctx, datatrack, out, stats.nthreads, cso_level, job.progress);
+#endif
+	} else if (split_mdf) {
+		stats.backend = "libmds";
+		rc = extract_mds(ctx, info.lba, &job);
+	} else if (!info.data) {
+		// Audio goes out as a WAV file.
+		stats.backend = "wav";
+		rc = extract_audio(&job, sample_offset, swap);
+	} else if (stream) {
+		stats.backend = "stream";
+		rc = extract_stream(&job);
+	} else if (info.data_len == info.secsize) {
+		// The sectors are nothing but payload, so the track is one
+		// contiguous range of the MDF. Let the kernel copy it.
+		stats.backend = "copy";
+		rc = extract_contiguous(&job);
+	} else {
+		stats.backend = "mmap";
+		stats.nthreads = nthreads ? nthreads : 1;
+		rc = extract_parallel(&job, stats.nthreads);
+	}
+	// Finish the line before any error goes after it.
+	progress_finish(progress);
+	if (rc) err(1, "extraction to '%s' failed", outfilename);
+
+	// Counted as part of extraction, since it waits for the hashing
+	// threads to catch up.
+	struct hash_result_s results[DIGEST_COUNT];
+	if (hash)
+		hash_finish(hash, results);
+
+	stats.bytes_read = (uint64_t)info.length * info.secsize;
+	if (!fstat(out, &sb) && S_ISREG(sb.st_mode))
+		stats.bytes_written = sb.st_size;
+	else
+		stats.bytes_written = (uint64_t)info.length * info.data_len;
+
+	stats_phase(&stats, STATS_CLOSE);
+	if (show_stats) {
+		// Otherwise the close phase only times handing the data to
+		// the page cache, not getting it onto the disk.
+		if (fsync(out) && (errno != EINVAL))
+			err(1, "couldn't sync '%s'", outfilename);
+		if ((sub != -1) && fsync(sub) && (errno != EINVAL))
+			err(1, "couldn't sync '%s'", subfilename);
+	}
+	rc = close(out);
 	if (rc) err(1, "couldn't close file");
-	out = NULL;
+	if ((sub != -1) && close(sub))
+		err(1, "couldn't close '%s'", subfilename);
+	out = -1;
+
+	if (hash) {
+		print_hashes(hashfile, outfilename, results, num_hashes);
+		if (fclose(hashfile))
+			err(1, "couldn't write '%s'", hashfilename ? hashfilename : "hashes");
+	}
 
-	MappedFile_Close(mdf_file);
-	mdf_file.data = NULL;
+	if ((mdf_fd != -1) && (mdf_fd != STDIN_FILENO))
+		close(mdf_fd);
+	mds_close(ctx);
+
+	stats_end(&stats);
+	if (show_stats) {
+		// Not on stdout, which may be the image.
+		stats.mdsfile = infilename;
+		stats.outfile = outfilename;
+		stats_print_json(stderr, &stats);
+	}
 
 	return EXIT_SUCCESS;
 }
 
 static void noreturn usage(void)
 {
-	(void)fprintf(stderr, "usage: %s [-v] -i <mdsfile> -o <isofile>\n",
-		__progname
+	(void)fprintf(stderr, "usage: %s [-fkv] [-b mmap|uring] [-j threads] [-q depth] [-m <mdffile>]\n"
+		"       [-s session] [-t track] [--offset samples] [--swap] [--sparse] [--cso[=level]]\n"
+		"       [--sub <subfile> [--sub-packed]] [--hash <list> [--hash-file <file>]]\n"
+		"       [--progress[=fd]] [--stats=json]\n"
+		"       -i <mdsfile> -o <isofile>\n"
+		"       %s [-m <mdffile>] -i <mdsfile> --mount <dir>\n"
+		"       %s [-f] [-j threads] [-m <mdffile>] [-s session] [-t track]\n"
+		"       -i <mdsfile> --nbd <socket>\n"
+		"       %s [-fk] [-j threads] [-m <mdffile>] -i <mdsfile> --cue <cuefile> [--split]\n"
+		"       [--sparse] [--sub <subfile> [--sub-packed]]\n"
+		"       %s [-j threads] [-m <mdffile>] [-s session] [-t track] -i <mdsfile> --verify\n"
+		"       %s [-f] [-j threads] [--per-device n] [--sparse] [--manifest <file>] [-o <outdir>]\n"
+		"       --batch <list|dir>\n"
+		"       %s [-j threads] --scan <dir> --index <file>\n"
+		"       %s [-v] [-i <mdsfile>] --index <file>\n"
+		"       %s [-v] [-m <mdffile>] [-s session] [-t track] -i <mdsfile> --list <path>\n"
+		"       %s [-f] [-j threads] [-m <mdffile>] [-s session] [-t track] -i <mdsfile>\n"
+		"       --extract <path> -o <dest>\n",
+		__progname, __progname, __progname, __progname, __progname, __progname,
+		__progname, __progname, __progname, __progname
 	);
 	exit(EXIT_FAILURE);
 }
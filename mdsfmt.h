@@ -0,0 +1,100 @@
+#ifndef _MDSFMT_H_
+#define _MDSFMT_H_
+
+/*
+ * On-disk layout of MDS files. Everything is little-endian; libmds
+ * converts to host order when it parses the file.
+ */
+
+#include <stdint.h>
+
+enum trackmode_e {
+	TM_NONE = 0,
+	TM_DVD = 2,
+	TM_AUDIO = 0xa9,
+	TM_MODE1,
+	TM_MODE2,
+	TM_MODE2_FORM1,
+	TM_MODE2_FORM2,
+	TM_MODE2_SUB = 0xec
+};
+
+struct mds_s {
+	char magic[16];	// "MEDIA DESCRIPTOR"
+	uint8_t version[2];
+	uint16_t mediatype;
+	uint16_t numsessions;
+	uint32_t _idk16;
+	uint16_t bca_len;
+	char _idk1c[8];
+	uint32_t bca_off;
+	char _idc28[0x18];
+	uint32_t discstruct_off;
+	char _idk44[0x0c];
+	uint32_t session_off;
+	uint32_t dpm_off;
+} __attribute__((packed));
+
+struct session_s {
+	uint32_t sec_first;
+	uint32_t sec_last;
+	uint16_t numsession;
+	uint8_t numtracks;
+	uint8_t numtracks2;
+	uint16_t track_first;
+	uint16_t track_last;
+	uint32_t _idk10;
+	uint32_t track_off;
+} __attribute__((packed));
+
+struct track_s {
+	uint8_t trackmode;
+	uint8_t numsubchannels;
+	uint8_t adr;
+	uint8_t trackno;
+	uint8_t pointno;
+	uint8_t min;
+	uint8_t sec;
+	uint8_t frame;
+	uint8_t zero;	// deceptively named
+	uint8_t pmin;
+	uint8_t psec;
+	uint8_t pframe;
+	/* below are zero-filled for point >= 0xA0 */
+	uint32_t indexblock_off;
+	uint16_t secsize;	// bytes
+	uint8_t _idk12;
+	char _idk13[0x11];
+	uint32_t sec_first;
+	uint64_t sec_off;	// bytes from beginning of .mdf file
+	uint32_t filenames_num;
+	uint32_t filenames_off;
+	char _idk38[0x18];
+} __attribute__((packed));
+
+/* One per track on CDs; the block at indexblock_off. */
+struct index_s {
+	uint32_t index0_len;	// sectors of pregap before sec_first
+	uint32_t index1_len;	// sectors from sec_first on
+} __attribute__((packed));
+
+struct filename_s {
+	uint32_t off;
+	uint8_t format;	// 0: 8-bit chars, 1: 16-bit chars
+	uint8_t _pad5[11];
+} __attribute__((packed));
+
+/*
+ * The parsed structures, in host byte order, for tools that want to show
+ * exactly what's in the file. Track blocks are numbered across all
+ * sessions, in the order the sessions appear.
+ */
+struct mds_ctx;
+const struct mds_s *mds_raw_header(const struct mds_ctx *ctx);
+unsigned mds_num_raw_sessions(const struct mds_ctx *ctx);
+const struct session_s *mds_raw_session(const struct mds_ctx *ctx, unsigned idx);
+unsigned mds_num_raw_tracks(const struct mds_ctx *ctx);
+const struct track_s *mds_raw_track(const struct mds_ctx *ctx, unsigned idx);
+
+/* _MDSFMT_H_ */
+#endif
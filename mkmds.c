@@ -0,0 +1,250 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "endian.h"
+#include "err.h"
+#include "mdsfmt.h"
+#include "progname.h"
+#include "stdnoreturn.h"
+#include "verify.h"
+
+/*
+ * mkmds writes a synthetic MDS+MDF image holding one track, for testing
+ * and benchmarking. User data is pseudo-random, except that every eighth
+ * sector is blank; raw data sectors get a proper sync pattern, header,
+ * subheader, EDC and ECC, so they pass --verify.
+ */
+
+#define SUB_LEN		96
+// Sectors written at a time.
+#define WRITE_BATCH	256
+
+struct mode_s {
+	const char *name;
+	unsigned trackmode;
+	unsigned secsize;
+	unsigned data_off;
+	unsigned data_len;
+	uint8_t submode;	// Mode 2 forms: the subheader's submode byte
+};
+
+static const struct mode_s modes[] = {
+	{ "dvd", TM_DVD, 0x800, 0, 0x800, 0 },
+	{ "audio", TM_AUDIO, 0x930, 0, 0x930, 0 },
+	{ "mode1", TM_MODE1, 0x930, 0x10, 0x800, 0 },
+	{ "mode2", TM_MODE2, 0x930, 0x10, 0x920, 0 },
+	{ "form1", TM_MODE2_FORM1, 0x930, 0x18, 0x800, 0x08 },
+	{ "form2", TM_MODE2_FORM2, 0x930, 0x18, 0x914, 0x20 },
+	{ "mode2sub", TM_MODE2_SUB, 0x930 + SUB_LEN, 0x18, 0x800, 0x08 },
+};
+
+static const struct {
+	const char *name;
+	uint32_t sectors;
+} sizes[] = {
+	{ "cd", 333000 },	// 74 minutes
+	{ "dvd5", 2295104 },	// single layer
+	{ "dvd9", 4173824 },	// dual layer
+};
+
+static void noreturn usage(void);
+
+static void lba_to_msf(int32_t lba, uint8_t *m, uint8_t *s, uint8_t *f)
+{
+	unsigned frames = lba + 150;
+
+	*m = frames / (60 * 75);
+	*s = frames / 75 % 60;
+	*f = frames % 75;
+}
+
+static void write_mds(const char *filename, const struct mode_s *mode, uint32_t numsectors)
+{
+	struct {
+		struct mds_s header;
+		struct session_s session;
+		struct track_s tracks[4];	// A0h, A1h, A2h and the track
+		struct index_s index;
+		struct filename_s filename;
+		char name[8];
+	} __attribute__((packed)) mds;
+	const bool cd = (mode->trackmode != TM_DVD);
+	const uint8_t adr = (mode->trackmode == TM_AUDIO) ? 0x10 : 0x14;
+	struct track_s *t = &mds.tracks[3];
+	FILE *f;
+
+	memset(&mds, 0, sizeof(mds));
+	memcpy(mds.header.magic, "MEDIA DESCRIPTOR", sizeof(mds.header.magic));
+	mds.header.version[0] = 1;
+	mds.header.version[1] = 5;
+	mds.header.mediatype = htole16(cd ? 0 : 16);
+	mds.header.numsessions = htole16(1);
+	mds.header.session_off = htole32(offsetof(typeof(mds), session));
+
+	mds.session.sec_first = htole32((uint32_t)-150);
+	mds.session.sec_last = htole32(numsectors);
+	mds.session.numsession = htole16(1);
+	mds.session.numtracks = 4;
+	mds.session.numtracks2 = 1;
+	mds.session.track_first = htole16(1);
+	mds.session.track_last = htole16(1);
+	mds.session.track_off = htole32(offsetof(typeof(mds), tracks));
+
+	for (unsigned i = 0; i < 3; i++) {
+		mds.tracks[i].adr = adr;
+		mds.tracks[i].pointno = 0xa0 + i;
+	}
+	mds.tracks[0].pmin = 1;		// first track
+	mds.tracks[0].psec = (mode->trackmode >= TM_MODE2) ? 0x20 : 0;	// disc type
+	mds.tracks[1].pmin = 1;		// last track
+	lba_to_msf(numsectors, &mds.tracks[2].pmin, &mds.tracks[2].psec, &mds.tracks[2].pframe);
+
+	t->trackmode = mode->trackmode;
+	t->numsubchannels = (mode->secsize > 0x930) ? 8 : 0;
+	t->adr = adr;
+	t->trackno = 1;
+	t->pointno = 1;
+	lba_to_msf(0, &t->pmin, &t->psec, &t->pframe);
+	t->indexblock_off = htole32(offsetof(typeof(mds), index));
+	t->secsize = htole16(mode->secsize);
+	t->filenames_num = htole32(1);
+	t->filenames_off = htole32(offsetof(typeof(mds), filename));
+	mds.index.index1_len = htole32(numsectors);
+
+	mds.filename.off = htole32(offsetof(typeof(mds), name));
+	strcpy(mds.name, "*.mdf");
+
+	f = fopen(filename, "wb");
+	if (!f)
+		err(1, "couldn't open '%s' for writing", filename);
+	if ((fwrite(&mds, sizeof(mds), 1, f) != 1) || fclose(f))
+		err(1, "couldn't write '%s'", filename);
+}
+
+/* xorshift64*, seeded per sector so any sector can be made on its own. */
+static void fill_random(uint8_t *p, size_t len, uint64_t seed)
+{
+	uint64_t x = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	for (size_t i = 0; i < len; i += 8) {
+		uint64_t v;
+
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		v = htole64(x * 0x2545f4914f6cdd1dull);
+		memcpy(p + i, &v, (len - i < 8) ? len - i : 8);
+	}
+}
+
+static void make_sector(uint8_t *sector, const struct mode_s *mode, int32_t lba)
+{
+	memset(sector, 0, mode->secsize);
+	if (lba % 8 != 7)
+		fill_random(sector + mode->data_off, mode->data_len, lba);
+	if (mode->submode) {
+		// Two copies of file, channel, submode and coding info.
+		sector[0x12] = sector[0x16] = mode->submode;
+	}
+	if ((mode->trackmode != TM_DVD) && (mode->trackmode != TM_AUDIO))
+		verify_fill_sector(sector, lba, mode->trackmode);
+	if (mode->secsize > 0x930)
+		fill_random(sector + 0x930, SUB_LEN, ~(uint64_t)lba);
+}
+
+static void write_mdf(const char *filename, const struct mode_s *mode, uint32_t numsectors)
+{
+	uint8_t *buf = malloc((size_t)WRITE_BATCH * mode->secsize);
+	FILE *f;
+
+	if (!buf)
+		err(1, "couldn't allocate buffer");
+	f = fopen(filename, "wb");
+	if (!f)
+		err(1, "couldn't open '%s' for writing", filename);
+	for (uint32_t lba = 0; lba < numsectors; ) {
+		uint32_t n = (numsectors - lba < WRITE_BATCH) ? numsectors - lba : WRITE_BATCH;
+
+		for (uint32_t i = 0; i < n; i++)
+			make_sector(buf + i * mode->secsize, mode, lba + i);
+		if (fwrite(buf, mode->secsize, n, f) != n)
+			err(1, "couldn't write '%s'", filename);
+		lba += n;
+	}
+	if (fclose(f))
+		err(1, "couldn't write '%s'", filename);
+	free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct mode_s *mode = &modes[0];
+	uint32_t numsectors = sizes[0].sectors;
+	char *mdsname, *mdfname;
+	int rc;
+
+	progname_init(argc, argv);
+
+	while ((rc = getopt(argc, argv, "m:n:")) != -1)
+		switch (rc) {
+		case 'm':
+			mode = NULL;
+			for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+				if (!strcmp(optarg, modes[i].name))
+					mode = &modes[i];
+			}
+			if (!mode)
+				usage();
+			break;
+		case 'n': {
+			char *end;
+			unsigned long n;
+
+			numsectors = 0;
+			for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+				if (!strcmp(optarg, sizes[i].name))
+					numsectors = sizes[i].sectors;
+			}
+			if (numsectors)
+				break;
+			n = strtoul(optarg, &end, 10);
+			if (*end || (n < 1) || (n > 0x7fffffff - 150))
+				usage();
+			numsectors = n;
+			break;
+		}
+		default:
+			usage();
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	mdsname = malloc(strlen(argv[0]) + sizeof(".mds"));
+	mdfname = malloc(strlen(argv[0]) + sizeof(".mdf"));
+	if (!mdsname || !mdfname)
+		err(1, "couldn't allocate names");
+	sprintf(mdsname, "%s.mds", argv[0]);
+	sprintf(mdfname, "%s.mdf", argv[0]);
+	write_mds(mdsname, mode, numsectors);
+	write_mdf(mdfname, mode, numsectors);
+	free(mdsname);
+	free(mdfname);
+	return EXIT_SUCCESS;
+}
+
+static void noreturn usage(void)
+{
+	(void)fprintf(stderr, "usage: %s [-m dvd|audio|mode1|mode2|form1|form2|mode2sub]\n"
+		"       [-n cd|dvd5|dvd9|sectors] <base>\n",
+		__progname
+	);
+	exit(EXIT_FAILURE);
+}
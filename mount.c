@@ -0,0 +1,304 @@
+#define FUSE_USE_VERSION 31
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "libmds.h"
+#include "mdsfmt.h"
+#include "mount.h"
+#include "wav.h"
+
+#define CACHE_ENTRIES 16
+#define CACHE_SECTORS 64
+
+enum vfile_kind_e {
+	VF_ISO,		// cooked data track
+	VF_BIN,		// raw sectors exactly as stored in the MDF
+	VF_WAV,		// audio track with a WAV header in front
+};
+
+struct vfile_s {
+	char name[32];
+	unsigned track;
+	enum vfile_kind_e kind;
+	unsigned secsize;	// bytes per sector as presented
+	uint64_t size;
+};
+
+/*
+ * A chunk of consecutive sectors from one track. Reads tend to be small
+ * and sequential, so fetching a whole chunk at a time reads ahead of the
+ * caller.
+ */
+struct cache_entry_s {
+	bool valid;
+	unsigned track;
+	enum mds_read_mode_e mode;
+	uint32_t chunk;
+	uint32_t count;
+	uint64_t last_used;
+	uint8_t *data;
+};
+
+struct mount_s {
+	struct mds_ctx *ctx;
+	struct vfile_s *files;
+	unsigned numfiles;
+	pthread_mutex_t lock;
+	struct cache_entry_s cache[CACHE_ENTRIES];
+	uint64_t tick;
+};
+
+static struct mount_s *get_mount(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static struct vfile_s *find_file(struct mount_s *m, const char *path)
+{
+	if (*path++ != '/')
+		return NULL;
+	for (unsigned i = 0; i < m->numfiles; i++) {
+		if (!strcmp(m->files[i].name, path))
+			return &m->files[i];
+	}
+	return NULL;
+}
+
+static void *mds_fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	(void)conn;
+	// The image never changes underneath us.
+	cfg->kernel_cache = 1;
+	return get_mount();
+}
+
+static int mds_fuse_getattr(const char *path, struct stat *sb, struct fuse_file_info *fi)
+{
+	struct mount_s *m = get_mount();
+	struct vfile_s *vf;
+
+	(void)fi;
+	memset(sb, 0, sizeof(*sb));
+	if (!strcmp(path, "/")) {
+		sb->st_mode = S_IFDIR | 0555;
+		sb->st_nlink = 2;
+		return 0;
+	}
+	vf = find_file(m, path);
+	if (!vf)
+		return -ENOENT;
+	sb->st_mode = S_IFREG | 0444;
+	sb->st_nlink = 1;
+	sb->st_size = vf->size;
+	return 0;
+}
+
+static int mds_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+	off_t off, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	struct mount_s *m = get_mount();
+
+	(void)off;
+	(void)fi;
+	(void)flags;
+	if (strcmp(path, "/"))
+		return -ENOENT;
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	for (unsigned i = 0; i < m->numfiles; i++)
+		filler(buf, m->files[i].name, NULL, 0, 0);
+	return 0;
+}
+
+static int mds_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+	struct mount_s *m = get_mount();
+	struct vfile_s *vf;
+
+	vf = find_file(m, path);
+	if (!vf)
+		return -ENOENT;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+	fi->fh = vf - m->files;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+/*
+ * Copy up to len bytes starting at byte off of a track's sector stream
+ * into buf, going through the chunk cache. Called with m->lock held.
+ */
+static ssize_t read_track(struct mount_s *m, const struct vfile_s *vf, uint8_t *buf, size_t len, uint64_t off)
+{
+	struct mds_track_info_s info;
+	enum mds_read_mode_e mode = (vf->kind == VF_BIN) ? MDS_READ_RAW : MDS_READ_COOKED;
+	size_t done = 0;
+
+	mds_get_track(m->ctx, vf->track, &info);
+	while (done < len) {
+		uint64_t sector = (off + done) / vf->secsize;
+		uint32_t chunk = sector / CACHE_SECTORS;
+		struct cache_entry_s *e = NULL, *victim = &m->cache[0];
+		size_t in_chunk, n;
+
+		if (sector >= info.length)
+			break;
+
+		for (unsigned i = 0; i < CACHE_ENTRIES; i++) {
+			struct cache_entry_s *c = &m->cache[i];
+			if (c->valid && (c->track == vf->track) && (c->mode == mode) && (c->chunk == chunk)) {
+				e = c;
+				break;
+			}
+			if (!c->valid || (c->last_used < victim->last_used))
+				victim = c;
+		}
+		if (!e) {
+			ssize_t got;
+			e = victim;
+			e->valid = false;
+			got = mds_read_sectors(m->ctx, vf->track,
+				info.lba + (int32_t)chunk * CACHE_SECTORS,
+				CACHE_SECTORS, e->data, mode);
+			if (got < 0)
+				return done ? (ssize_t)done : -errno;
+			e->valid = true;
+			e->track = vf->track;
+			e->mode = mode;
+			e->chunk = chunk;
+			e->count = got;
+		}
+		e->last_used = ++m->tick;
+
+		in_chunk = (off + done) - (uint64_t)chunk * CACHE_SECTORS * vf->secsize;
+		if (in_chunk >= (size_t)e->count * vf->secsize)
+			break;
+		n = (size_t)e->count * vf->secsize - in_chunk;
+		if (n > len - done)
+			n = len - done;
+		memcpy(buf + done, e->data + in_chunk, n);
+		done += n;
+	}
+	return done;
+}
+
+static int mds_fuse_read(const char *path, char *buf, size_t len, off_t off, struct fuse_file_info *fi)
+{
+	struct mount_s *m = get_mount();
+	struct vfile_s *vf = &m->files[fi->fh];
+	size_t done = 0;
+	ssize_t rc;
+
+	(void)path;
+	if ((uint64_t)off >= vf->size)
+		return 0;
+	if (len > vf->size - off)
+		len = vf->size - off;
+
+	if (vf->kind == VF_WAV) {
+		if (off < WAV_HEADER_LEN) {
+			uint8_t hdr[WAV_HEADER_LEN];
+			size_t n = WAV_HEADER_LEN - off;
+			if (n > len)
+				n = len;
+			wav_header(hdr, vf->size - WAV_HEADER_LEN);
+			memcpy(buf, hdr + off, n);
+			done = n;
+			off += n;
+		}
+		off -= WAV_HEADER_LEN;
+	}
+
+	pthread_mutex_lock(&m->lock);
+	rc = read_track(m, vf, (uint8_t *)buf + done, len - done, off);
+	pthread_mutex_unlock(&m->lock);
+	if (rc < 0)
+		return done ? (int)done : (int)rc;
+	return done + rc;
+}
+
+static const struct fuse_operations mds_fuse_ops = {
+	.init = mds_fuse_init,
+	.getattr = mds_fuse_getattr,
+	.readdir = mds_fuse_readdir,
+	.open = mds_fuse_open,
+	.read = mds_fuse_read,
+};
+
+static void add_file(struct mount_s *m, unsigned track, const char *fmt, unsigned point,
+	enum vfile_kind_e kind, unsigned secsize, uint64_t size)
+{
+	struct vfile_s *vf = &m->files[m->numfiles++];
+
+	snprintf(vf->name, sizeof(vf->name), fmt, point);
+	vf->track = track;
+	vf->kind = kind;
+	vf->secsize = secsize;
+	vf->size = size;
+}
+
+/*
+ * Serve the image as a read-only filesystem at mountpoint: trackNN.iso
+ * for each data track, trackNN.wav for each audio track, and trackNN.bin
+ * with the raw sectors of every track. Runs in the background until
+ * unmounted.
+ */
+int mount_image(struct mds_ctx *ctx, const char *mountpoint)
+{
+	struct mount_s m = {
+		.ctx = ctx,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	unsigned maxsec = 0;
+	char *argv[5];
+	int argc = 0;
+	int rc = -1;
+
+	m.files = calloc(2 * mds_num_tracks(ctx), sizeof(*m.files));
+	if (!m.files)
+		return -1;
+	for (unsigned t = 0; t < mds_num_tracks(ctx); t++) {
+		struct mds_track_info_s info;
+		mds_get_track(ctx, t, &info);
+
+		if (info.data) {
+			add_file(&m, t, "track%02u.iso", info.point, VF_ISO,
+				info.data_len, (uint64_t)info.length * info.data_len);
+		} else if (info.mode == TM_AUDIO) {
+			add_file(&m, t, "track%02u.wav", info.point, VF_WAV,
+				info.data_len, WAV_HEADER_LEN + (uint64_t)info.length * info.data_len);
+		}
+		add_file(&m, t, "track%02u.bin", info.point, VF_BIN,
+			info.secsize, (uint64_t)info.length * info.secsize);
+		if (info.secsize > maxsec)
+			maxsec = info.secsize;
+	}
+
+	for (unsigned i = 0; i < CACHE_ENTRIES; i++) {
+		m.cache[i].data = malloc((size_t)CACHE_SECTORS * maxsec);
+		if (!m.cache[i].data)
+			goto out_free;
+	}
+
+	argv[argc++] = "mds2iso";
+	argv[argc++] = "-o";
+	argv[argc++] = "ro,fsname=mds2iso,subtype=mds";
+	argv[argc++] = (char *)mountpoint;
+	argv[argc] = NULL;
+	rc = fuse_main(argc, argv, &mds_fuse_ops, &m) ? -1 : 0;
+
+out_free:
+	for (unsigned i = 0; i < CACHE_ENTRIES; i++)
+		free(m.cache[i].data);
+	free(m.files);
+	return rc;
+}
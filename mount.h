@@ -0,0 +1,9 @@
+#ifndef _MOUNT_H_
+#define _MOUNT_H_
+
+#include "libmds.h"
+
+int mount_image(struct mds_ctx *ctx, const char *mountpoint);
+
+/* _MOUNT_H_ */
+#endif
@@ -0,0 +1,498 @@
+#ifndef __MINGW32__
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "endian.h"
+#include "extract.h"
+#include "libmds.h"
+#include "nbd.h"
+
+/*
+ * A read-only NBD server for the cooked view of one data track, speaking
+ * the fixed newstyle handshake. See doc/proto.md in the nbd project.
+ */
+
+#define NBD_MAGIC		0x4e42444d41474943ULL	// "NBDMAGIC"
+#define NBD_IHAVEOPT		0x49484156454f5054ULL	// "IHAVEOPT"
+#define NBD_REP_MAGIC		0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_REPLY_MAGIC		0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define NBD_FLAG_NO_ZEROES	(1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS	(1 << 0)
+#define NBD_FLAG_READ_ONLY	(1 << 1)
+#define NBD_FLAG_CAN_MULTI_CONN	(1 << 8)
+
+enum {
+	NBD_OPT_EXPORT_NAME = 1,
+	NBD_OPT_ABORT = 2,
+	NBD_OPT_LIST = 3,
+	NBD_OPT_INFO = 6,
+	NBD_OPT_GO = 7,
+};
+
+enum {
+	NBD_REP_ACK = 1,
+	NBD_REP_SERVER = 2,
+	NBD_REP_INFO = 3,
+	NBD_REP_ERR_UNSUP = 0x80000001,
+	NBD_REP_ERR_INVALID = 0x80000003,
+};
+
+enum {
+	NBD_INFO_EXPORT = 0,
+	NBD_INFO_BLOCK_SIZE = 3,
+};
+
+enum {
+	NBD_CMD_READ = 0,
+	NBD_CMD_WRITE = 1,
+	NBD_CMD_DISC = 2,
+	NBD_CMD_FLUSH = 3,
+	NBD_CMD_TRIM = 4,
+	NBD_CMD_WRITE_ZEROES = 6,
+};
+
+enum {
+	NBD_EPERM = 1,
+	NBD_EIO = 5,
+	NBD_EINVAL = 22,
+};
+
+// The most a single read pulls out of the MDF before sending it on.
+#define CHUNK_BYTES	(4 * 1024 * 1024)
+#define REPLY_LEN	16
+
+struct nbd_s {
+	struct mds_ctx *ctx;
+	unsigned track;
+	struct mds_track_info_s info;
+	uint64_t size;
+	uint32_t chunk_sectors;
+	int listen_fd;
+};
+
+struct worker_s {
+	struct nbd_s *n;
+	pthread_t thread;
+	uint8_t *buf;
+	int client_fd;
+};
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t rc = read(fd, p, len);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (rc == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		p += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+static int discard(int fd, uint64_t len, uint8_t *scratch, size_t scratch_len)
+{
+	while (len) {
+		size_t n = (len < scratch_len) ? len : scratch_len;
+		if (read_full(fd, scratch, n))
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static void put16(uint8_t *p, uint16_t v) { v = htobe16(v); memcpy(p, &v, 2); }
+static void put32(uint8_t *p, uint32_t v) { v = htobe32(v); memcpy(p, &v, 4); }
+static void put64(uint8_t *p, uint64_t v) { v = htobe64(v); memcpy(p, &v, 8); }
+static uint16_t get16(const uint8_t *p) { uint16_t v; memcpy(&v, p, 2); return be16toh(v); }
+static uint32_t get32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return be32toh(v); }
+static uint64_t get64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return be64toh(v); }
+
+static int send_opt_reply(int fd, uint32_t opt, uint32_t type, const void *data, uint32_t len)
+{
+	uint8_t hdr[20];
+
+	put64(hdr, NBD_REP_MAGIC);
+	put32(hdr + 8, opt);
+	put32(hdr + 12, type);
+	put32(hdr + 16, len);
+	if (write_full(fd, hdr, sizeof(hdr)))
+		return -1;
+	return len ? write_full(fd, data, len) : 0;
+}
+
+static uint16_t transmission_flags(void)
+{
+	return NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_CAN_MULTI_CONN;
+}
+
+/* Answer NBD_OPT_INFO or NBD_OPT_GO. */
+static int send_info(struct nbd_s *n, int fd, uint32_t opt)
+{
+	uint8_t export[12], blocksize[14];
+
+	put16(export, NBD_INFO_EXPORT);
+	put64(export + 2, n->size);
+	put16(export + 10, transmission_flags());
+	put16(blocksize, NBD_INFO_BLOCK_SIZE);
+	put32(blocksize + 2, 1);
+	put32(blocksize + 6, n->info.data_len);
+	put32(blocksize + 10, CHUNK_BYTES);
+	if (send_opt_reply(fd, opt, NBD_REP_INFO, export, sizeof(export)))
+		return -1;
+	if (send_opt_reply(fd, opt, NBD_REP_INFO, blocksize, sizeof(blocksize)))
+		return -1;
+	return send_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/*
+ * Haggle over options until the client picks the export. Returns 0 to
+ * go on to transmission, -1 to hang up.
+ */
+static int handshake(struct nbd_s *n, int fd, uint8_t *scratch)
+{
+	uint8_t buf[18];
+	uint32_t cflags;
+
+	put64(buf, NBD_MAGIC);
+	put64(buf + 8, NBD_IHAVEOPT);
+	put16(buf + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (write_full(fd, buf, 18))
+		return -1;
+	if (read_full(fd, buf, 4))
+		return -1;
+	cflags = get32(buf);
+	if (cflags & ~(uint32_t)(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES))
+		return -1;
+
+	for (;;) {
+		uint32_t opt, len;
+
+		if (read_full(fd, buf, 16))
+			return -1;
+		if (get64(buf) != NBD_IHAVEOPT)
+			return -1;
+		opt = get32(buf + 8);
+		len = get32(buf + 12);
+		if (len > CHUNK_BYTES)
+			return -1;
+		if (read_full(fd, scratch, len))
+			return -1;
+
+		switch (opt) {
+		case NBD_OPT_EXPORT_NAME: {
+			// There's only the one export, whatever it's called.
+			uint8_t reply[10 + 124] = {0,};
+			put64(reply, n->size);
+			put16(reply + 8, transmission_flags());
+			return write_full(fd, reply, (cflags & NBD_FLAG_NO_ZEROES) ? 10 : sizeof(reply));
+		}
+		case NBD_OPT_ABORT:
+			send_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0);
+			return -1;
+		case NBD_OPT_LIST: {
+			uint8_t name[4] = {0,};
+			if (len) {
+				if (send_opt_reply(fd, opt, NBD_REP_ERR_INVALID, NULL, 0))
+					return -1;
+				break;
+			}
+			if (send_opt_reply(fd, opt, NBD_REP_SERVER, name, sizeof(name)))
+				return -1;
+			if (send_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0))
+				return -1;
+			break;
+		}
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO: {
+			// The name and the count of info requests that follow it
+			// have to fit in what the client sent, exactly.
+			uint32_t namelen = (len < 6) ? 0 : get32(scratch);
+			if ((len < 6) || (namelen > len - 6) ||
+			    (len != 6 + namelen + 2 * (uint64_t)get16(scratch + 4 + namelen))) {
+				if (send_opt_reply(fd, opt, NBD_REP_ERR_INVALID, NULL, 0))
+					return -1;
+				break;
+			}
+			if (send_info(n, fd, opt))
+				return -1;
+			if (opt == NBD_OPT_GO)
+				return 0;
+			break;
+		}
+		default:
+			if (send_opt_reply(fd, opt, NBD_REP_ERR_UNSUP, NULL, 0))
+				return -1;
+			break;
+		}
+	}
+}
+
+static int send_simple_reply(int fd, uint32_t error, uint64_t handle)
+{
+	uint8_t reply[REPLY_LEN];
+
+	put32(reply, NBD_REPLY_MAGIC);
+	put32(reply + 4, error);
+	put64(reply + 8, handle);
+	return write_full(fd, reply, sizeof(reply));
+}
+
+/*
+ * Answer a read. The request becomes one mds_read_sectors() call per
+ * chunk of up to CHUNK_BYTES, however many sectors that spans, and each
+ * chunk goes out in one write with the reply header in front of it.
+ */
+static int do_read(struct nbd_s *n, int fd, uint8_t *buf, uint64_t handle, uint64_t off, uint32_t len)
+{
+	const unsigned dl = n->info.data_len;
+	uint64_t sector = off / dl;
+	unsigned skip = off % dl;
+	bool first = true;
+
+	while (len) {
+		uint64_t want = ((uint64_t)skip + len + dl - 1) / dl;
+		uint32_t count = (want < n->chunk_sectors) ? want : n->chunk_sectors;
+		uint8_t *data = buf + REPLY_LEN;
+		uint8_t *out = data + skip;
+		size_t payload = (size_t)count * dl - skip;
+		size_t outlen;
+		ssize_t got;
+
+		if (payload > len)
+			payload = len;
+		outlen = payload;
+		got = mds_read_sectors(n->ctx, n->track, n->info.lba + (int32_t)sector,
+			count, data, MDS_READ_COOKED);
+		if (got != (ssize_t)count) {
+			// Once data has gone out the only way to signal an
+			// error is to drop the connection.
+			if (!first)
+				return -1;
+			return send_simple_reply(fd, NBD_EIO, handle);
+		}
+		if (first) {
+			// The header overwrites the part of the first sector
+			// that wasn't asked for.
+			out -= REPLY_LEN;
+			put32(out, NBD_REPLY_MAGIC);
+			put32(out + 4, 0);
+			put64(out + 8, handle);
+			outlen += REPLY_LEN;
+			first = false;
+		}
+		if (write_full(fd, out, outlen))
+			return -1;
+		len -= payload;
+		sector += count;
+		skip = 0;
+	}
+	return 0;
+}
+
+static void serve_client(struct nbd_s *n, int fd, uint8_t *buf)
+{
+	if (handshake(n, fd, buf))
+		return;
+
+	for (;;) {
+		uint8_t req[28];
+		uint16_t type;
+		uint64_t handle, off;
+		uint32_t len;
+		int rc;
+
+		if (read_full(fd, req, sizeof(req)))
+			return;
+		if (get32(req) != NBD_REQUEST_MAGIC)
+			return;
+		type = get16(req + 6);
+		handle = get64(req + 8);
+		off = get64(req + 16);
+		len = get32(req + 24);
+
+		switch (type) {
+		case NBD_CMD_READ:
+			if ((off > n->size) || (len > n->size - off))
+				rc = send_simple_reply(fd, NBD_EINVAL, handle);
+			else if (!len)
+				rc = send_simple_reply(fd, 0, handle);
+			else
+				rc = do_read(n, fd, buf, handle, off, len);
+			break;
+		case NBD_CMD_WRITE:
+			if (discard(fd, len, buf, CHUNK_BYTES))
+				return;
+			/* fallthrough */
+		case NBD_CMD_TRIM:
+		case NBD_CMD_WRITE_ZEROES:
+			rc = send_simple_reply(fd, NBD_EPERM, handle);
+			break;
+		case NBD_CMD_FLUSH:
+			rc = send_simple_reply(fd, 0, handle);
+			break;
+		case NBD_CMD_DISC:
+			return;
+		default:
+			rc = send_simple_reply(fd, NBD_EINVAL, handle);
+			break;
+		}
+		if (rc)
+			return;
+	}
+}
+
+static void close_client(void *arg)
+{
+	struct worker_s *w = arg;
+
+	if (w->client_fd != -1)
+		close(w->client_fd);
+	w->client_fd = -1;
+}
+
+/* Each worker takes one connection at a time off the listening socket. */
+static void *worker(void *arg)
+{
+	struct worker_s *w = arg;
+
+	pthread_cleanup_push(close_client, w);
+	for (;;) {
+		w->client_fd = accept(w->n->listen_fd, NULL, NULL);
+		if (w->client_fd == -1) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			break;
+		}
+		serve_client(w->n, w->client_fd, w->buf);
+		close_client(w);
+	}
+	pthread_cleanup_pop(0);
+	return NULL;
+}
+
+/*
+ * Serve the cooked sectors of one track at sockpath until SIGINT,
+ * SIGTERM or SIGHUP. Up to nthreads clients are served at once; more
+ * wait in the listen queue.
+ */
+int nbd_serve(struct mds_ctx *ctx, unsigned track, const char *sockpath, unsigned nthreads)
+{
+	struct nbd_s n = {
+		.ctx = ctx,
+		.track = track,
+		.listen_fd = -1,
+	};
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct worker_s *workers;
+	sigset_t sigs, oldsigs;
+	unsigned started = 0;
+	int sig, rc = -1;
+
+	if (mds_get_track(ctx, track, &n.info))
+		return -1;
+	if (!n.info.data_len) {
+		errno = EINVAL;
+		return -1;
+	}
+	n.size = (uint64_t)n.info.length * n.info.data_len;
+	n.chunk_sectors = CHUNK_BYTES / n.info.data_len;
+
+	if (strlen(sockpath) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sa.sun_path, sockpath);
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	n.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (n.listen_fd == -1)
+		goto out_free;
+	if (bind(n.listen_fd, (struct sockaddr *)&sa, sizeof(sa)))
+		goto out_close;
+	if (listen(n.listen_fd, SOMAXCONN))
+		goto out_unlink;
+
+	// Clients that hang up mid-reply shouldn't take the server down.
+	signal(SIGPIPE, SIG_IGN);
+
+	// Only this thread waits for the signals that stop the server.
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+
+	for (started = 0; started < nthreads; started++) {
+		struct worker_s *w = &workers[started];
+		w->n = &n;
+		w->client_fd = -1;
+		w->buf = malloc(REPLY_LEN + (size_t)n.chunk_sectors * n.info.data_len);
+		if (!w->buf)
+			goto out_stop;
+		errno = pthread_create(&w->thread, NULL, worker, w);
+		if (errno) {
+			free(w->buf);
+			goto out_stop;
+		}
+	}
+
+	sigwait(&sigs, &sig);
+	rc = 0;
+
+out_stop:
+	for (unsigned i = 0; i < started; i++)
+		pthread_cancel(workers[i].thread);
+	for (unsigned i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].buf);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+out_unlink:
+	unlink(sockpath);
+out_close:
+	close(n.listen_fd);
+out_free:
+	free(workers);
+	return rc;
+}
+
+/* __MINGW32__ */
+#else
+#include <errno.h>
+#include "nbd.h"
+
+int nbd_serve(struct mds_ctx *ctx, unsigned track, const char *sockpath, unsigned nthreads)
+{
+	(void)ctx;
+	(void)track;
+	(void)sockpath;
+	(void)nthreads;
+	errno = ENOSYS;
+	return -1;
+}
+
+/* __MINGW32__ */
+#endif
@@ -0,0 +1,9 @@
+#ifndef _NBD_H_
+#define _NBD_H_
+
+#include "libmds.h"
+
+int nbd_serve(struct mds_ctx *ctx, unsigned track, const char *sockpath, unsigned nthreads);
+
+/* _NBD_H_ */
+#endif
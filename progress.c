@@ -0,0 +1,172 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "extract.h"
+#include "progress.h"
+
+#define TICK_NS 1000000000L
+
+struct progress_s {
+	uint64_t done;		// bytes of payload written; see progress_add()
+	uint64_t total;
+	unsigned sector_len;
+	int fd;
+	bool tty;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	double start;
+	double rate;		// bytes per second, smoothed
+	uint64_t last_done;
+	double last_time;
+	size_t last_len;	// of the line on the terminal
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(struct progress_s *p, bool last)
+{
+	const uint64_t done = __atomic_load_n(&p->done, __ATOMIC_RELAXED);
+	const double t = now();
+	char line[160], eta[32] = "--:--:--";
+	int len;
+
+	if (last) {
+		// The average over the whole run, for the final line.
+		p->rate = (t > p->start) ? done / (t - p->start) : 0;
+	} else if (t > p->last_time) {
+		double r = (done - p->last_done) / (t - p->last_time);
+		p->rate = p->last_done ? 0.7 * p->rate + 0.3 * r : r;
+	}
+	p->last_done = done;
+	p->last_time = t;
+	if (last) {
+		unsigned long s = (unsigned long)(t - p->start + 0.5);
+		snprintf(eta, sizeof(eta), "in %lu:%02lu:%02lu", s / 3600, s / 60 % 60, s % 60);
+	} else if ((p->rate > 0) && (done <= p->total)) {
+		unsigned long s = (unsigned long)((p->total - done) / p->rate + 0.5);
+		snprintf(eta, sizeof(eta), "ETA %lu:%02lu:%02lu", s / 3600, s / 60 % 60, s % 60);
+	}
+	len = snprintf(line, sizeof(line), "%s%llu/%llu sectors (%u%%), %.1f MB/s, %s",
+		p->tty ? "\r" : "",
+		(unsigned long long)(done / p->sector_len),
+		(unsigned long long)(p->total / p->sector_len),
+		p->total ? (unsigned)(done * 100 / p->total) : 100,
+		p->rate / 1e6, eta);
+	if ((len < 0) || ((size_t)len >= sizeof(line) - 40))
+		return;
+	// Blank out the rest of a longer line before this one.
+	while (p->tty && ((size_t)len < p->last_len + 1))
+		line[len++] = ' ';
+	p->last_len = p->tty ? (size_t)len - 1 : 0;
+	if (!p->tty || last)
+		line[len++] = '\n';
+	// Progress that can't be shown isn't worth failing over.
+	(void)write_full(p->fd, line, len);
+}
+
+static void *ticker(void *arg)
+{
+	struct progress_s *p = arg;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	pthread_mutex_lock(&p->lock);
+	while (!p->stop) {
+		next.tv_nsec += TICK_NS;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		while (!p->stop && (pthread_cond_timedwait(&p->cond, &p->lock, &next) != ETIMEDOUT))
+			;
+		if (p->stop)
+			break;
+		pthread_mutex_unlock(&p->lock);
+		report(p, false);
+		pthread_mutex_lock(&p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	report(p, true);
+	return NULL;
+}
+
+/*
+ * Start reporting on fd for a job that writes total bytes of payload,
+ * sector_len to a sector.
+ */
+struct progress_s *progress_start(int fd, uint64_t total, unsigned sector_len)
+{
+	struct progress_s *p = calloc(1, sizeof(*p));
+	pthread_condattr_t attr;
+	int e;
+
+	if (!p)
+		return NULL;
+	p->total = total;
+	p->sector_len = sector_len ? sector_len : 1;
+	p->fd = fd;
+	p->tty = isatty(fd);
+	p->start = p->last_time = now();
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	e = pthread_create(&p->thread, NULL, ticker, p);
+	if (e) {
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->lock);
+		free(p);
+		errno = e;
+		return NULL;
+	}
+	return p;
+}
+
+/* Where the copy loops add what they write. */
+uint64_t *progress_counter(struct progress_s *p)
+{
+	return p ? &p->done : NULL;
+}
+
+/* Start counting again, as when one backend gives up for another. */
+void progress_reset(struct progress_s *p)
+{
+	if (p)
+		__atomic_store_n(&p->done, 0, __ATOMIC_RELAXED);
+}
+
+/* Stop the ticker after one last report, and free p. */
+void progress_finish(struct progress_s *p)
+{
+	if (!p)
+		return;
+	pthread_mutex_lock(&p->lock);
+	p->stop = true;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+/* Count len more bytes of payload written, if anyone is counting. */
+void progress_add(uint64_t *counter, uint64_t len)
+{
+	if (counter)
+		__atomic_fetch_add(counter, len, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,21 @@
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+#include <stdint.h>
+
+/*
+ * Reports how far an extraction has got. The copy loops only add to a
+ * counter with a relaxed atomic; a ticker thread samples it once a
+ * second and writes sectors done, throughput and ETA to a file
+ * descriptor, overwriting one line if that is a terminal.
+ */
+struct progress_s;
+
+struct progress_s *progress_start(int fd, uint64_t total, unsigned sector_len);
+uint64_t *progress_counter(struct progress_s *p);
+void progress_reset(struct progress_s *p);
+void progress_finish(struct progress_s *p);
+void progress_add(uint64_t *counter, uint64_t len);
+
+/* _PROGRESS_H_ */
+#endif
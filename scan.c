@@ -0,0 +1,340 @@
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "endian.h"
+#include "index.h"
+#include "libmds.h"
+#include "mdsfmt.h"
+#include "scan.h"
+
+/*
+ * Catalogs every image under a directory. The workers share one stack of
+ * things to look at: directories, whose contents are pushed in turn, and
+ * .mds files, which are read along with the one sector of each image
+ * that holds its ISO9660 primary volume descriptor. Nothing else of the
+ * MDF is read.
+ */
+
+// Where the volume descriptors start.
+#define PVD_LBA	16
+
+struct scan_item_s {
+	char *path;
+	bool dir;
+};
+
+struct scan_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct scan_item_s *stack;
+	size_t n;
+	size_t max;
+	unsigned busy;		// workers looking at an item
+	struct index_entry_s *entries;
+	size_t numentries;
+	size_t maxentries;
+	size_t skipped_dirs;
+	int err;		// why the scan has to stop, or 0
+};
+
+static int push(struct scan_s *s, char *path, bool dir)
+{
+	if (s->n == s->max) {
+		size_t max = s->max ? s->max * 2 : 64;
+		struct scan_item_s *stack = realloc(s->stack, max * sizeof(*stack));
+		if (!stack)
+			return -1;
+		s->stack = stack;
+		s->max = max;
+	}
+	s->stack[s->n++] = (struct scan_item_s){ .path = path, .dir = dir };
+	pthread_cond_signal(&s->cond);
+	return 0;
+}
+
+static int scan_dir(struct scan_s *s, const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	size_t dirlen = strlen(dir);
+	int rc = 0;
+
+	if (!d) {
+		pthread_mutex_lock(&s->lock);
+		s->skipped_dirs++;
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+	if (dirlen && (dir[dirlen - 1] == '/'))
+		dirlen--;
+	while (!rc && (de = readdir(d))) {
+		size_t len = strlen(de->d_name);
+		bool is_dir = (de->d_type == DT_DIR);
+		char *path;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		path = malloc(dirlen + 1 + len + 1);
+		if (!path) {
+			rc = -1;
+			break;
+		}
+		sprintf(path, "%.*s/%s", (int)dirlen, dir, de->d_name);
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat sb;
+			is_dir = !lstat(path, &sb) && S_ISDIR(sb.st_mode);
+		}
+		// Links to directories aren't followed, so there are no loops.
+		if (!is_dir && ((len <= 4) || strcasecmp(de->d_name + len - 4, ".mds"))) {
+			free(path);
+			continue;
+		}
+		pthread_mutex_lock(&s->lock);
+		rc = push(s, path, is_dir);
+		pthread_mutex_unlock(&s->lock);
+		if (rc)
+			free(path);
+	}
+	closedir(d);
+	return rc;
+}
+
+/* Fill in what the primary volume descriptor says about the volume. */
+static void read_pvd(struct mds_ctx *ctx, unsigned track, struct index_image_s *image)
+{
+	struct mds_track_info_s info;
+	uint8_t buf[0x930];
+
+	if (mds_get_track(ctx, track, &info) || (info.length <= PVD_LBA) || (info.data_len > sizeof(buf)))
+		return;
+	if (mds_read_sectors(ctx, track, info.lba + PVD_LBA, 1, buf, MDS_READ_COOKED) != 1) {
+		image->flags |= INDEX_NO_MDF;
+		return;
+	}
+	// Mode 2 tracks without a form keep the subheader in front.
+	for (unsigned off = 0; (off <= 8) && (off + 2048 <= info.data_len); off += 8) {
+		const uint8_t *pvd = buf + off;
+		uint32_t blocks;
+		uint16_t blocksize;
+
+		if ((pvd[0] != 1) || memcmp(pvd + 1, "CD001", 5) || (pvd[6] != 1))
+			continue;
+		memcpy(&blocks, pvd + 80, sizeof(blocks));
+		memcpy(&blocksize, pvd + 128, sizeof(blocksize));
+		memcpy(image->volume_id, pvd + 40, sizeof(image->volume_id));
+		image->volume_blocks = le32toh(blocks);
+		image->volume_block_size = le16toh(blocksize);
+		image->flags |= INDEX_PVD;
+		break;
+	}
+}
+
+/* Everything about one image but its name and file times. */
+static int describe(struct mds_ctx *ctx, struct index_entry_s *e)
+{
+	unsigned n = mds_num_tracks(ctx);
+	int data = mds_find_data_track(ctx);
+	unsigned first = (data == -1) ? 0 : data;
+
+	e->image.mediatype = mds_mediatype(ctx);
+	e->image.numsessions = mds_raw_header(ctx)->numsessions;
+	e->image.numtracks = n;
+	e->tracks = calloc(n ? n : 1, sizeof(*e->tracks));
+	if (!e->tracks)
+		return -1;
+	for (unsigned t = 0; t < n; t++) {
+		struct mds_track_info_s info;
+
+		mds_get_track(ctx, t, &info);
+		e->tracks[t] = (struct index_track_s){
+			.session = info.session,
+			.point = info.point,
+			.mode = info.mode,
+			.flags = info.data ? INDEX_TRACK_DATA : 0,
+			.secsize = info.secsize,
+			.data_len = info.data_len,
+			.lba = info.lba,
+			.length = info.length,
+		};
+	}
+
+	for (unsigned i = 0; i < mds_track_num_files(ctx, first); i++) {
+		struct stat sb;
+
+		if (!stat(mds_track_part_filename(ctx, first, i), &sb))
+			e->image.mdf_size += sb.st_size;
+		else
+			e->image.flags |= INDEX_NO_MDF;
+	}
+	if (!n || (e->image.flags & INDEX_NO_MDF))
+		return 0;
+	if (data == -1)
+		return 0;
+	if (mds_open_data(ctx, NULL)) {
+		e->image.flags |= INDEX_NO_MDF;
+		return 0;
+	}
+	read_pvd(ctx, data, &e->image);
+	return 0;
+}
+
+/* Read one image and add it to the catalog, which takes path. */
+static int scan_image(struct scan_s *s, char *path)
+{
+	struct index_entry_s e = { .path = path };
+	struct mds_ctx *ctx;
+	struct stat sb;
+	const char *msg;
+	int rc = 0;
+
+	if (!stat(path, &sb)) {
+		e.image.mds_size = sb.st_size;
+		e.image.mds_mtime = sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+	}
+	ctx = mds_open(path, &msg);
+	if (!ctx) {
+		e.image.flags = INDEX_BAD_MDS;
+	} else {
+		rc = describe(ctx, &e);
+		mds_close(ctx);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if (!rc && (s->numentries == s->maxentries)) {
+		size_t max = s->maxentries ? s->maxentries * 2 : 64;
+		struct index_entry_s *entries = realloc(s->entries, max * sizeof(*entries));
+		if (entries) {
+			s->entries = entries;
+			s->maxentries = max;
+		} else {
+			rc = -1;
+		}
+	}
+	if (!rc)
+		s->entries[s->numentries++] = e;
+	pthread_mutex_unlock(&s->lock);
+	if (rc) {
+		free(e.tracks);
+		free(path);
+	}
+	return rc;
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_s *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		struct scan_item_s item;
+		int rc, e;
+
+		while (!s->n && s->busy && !s->err)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (!s->n || s->err)
+			break;
+		item = s->stack[--s->n];
+		s->busy++;
+		pthread_mutex_unlock(&s->lock);
+
+		if (item.dir) {
+			rc = scan_dir(s, item.path);
+			e = errno;
+			free(item.path);
+		} else {
+			rc = scan_image(s, item.path);
+			e = errno;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		if (rc && !s->err)
+			s->err = e ? e : ENOMEM;
+		s->busy--;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/*
+ * Catalog every .mds file under dir into indexfile, on nthreads threads.
+ * Images that can't be read are cataloged as such; so long as dir
+ * itself can be read, only running out of memory or failing to write
+ * the index makes this fail.
+ */
+int scan_tree(const char *dir, const char *indexfile, unsigned nthreads,
+	struct scan_result_s *result)
+{
+	struct scan_s s = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t *threads;
+	unsigned started;
+	char *root;
+	DIR *d;
+	int rc = -1, e = 0;
+
+	*result = (struct scan_result_s){ 0 };
+	if (nthreads < 1)
+		nthreads = 1;
+	d = opendir(dir);
+	if (!d)
+		return -1;
+	closedir(d);
+	threads = calloc(nthreads, sizeof(*threads));
+	root = strdup(dir);
+	if (!threads || !root || push(&s, root, true)) {
+		free(root);
+		goto out_free;
+	}
+
+	// Any one worker can get through all of it, so carry on with
+	// however many started.
+	for (started = 0; started < nthreads; started++) {
+		e = pthread_create(&threads[started], NULL, scan_worker, &s);
+		if (e)
+			break;
+	}
+	if (!started) {
+		errno = e;
+		goto out_free;
+	}
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	if (s.err) {
+		errno = s.err;
+		goto out_free;
+	}
+
+	rc = index_write(indexfile, s.entries, s.numentries);
+	if (!rc) {
+		result->images = s.numentries;
+		result->skipped_dirs = s.skipped_dirs;
+		for (size_t i = 0; i < s.numentries; i++) {
+			if (s.entries[i].image.flags & INDEX_BAD_MDS)
+				result->bad++;
+		}
+	}
+
+out_free:
+	e = errno;
+	for (size_t i = 0; i < s.n; i++)
+		free(s.stack[i].path);
+	for (size_t i = 0; i < s.numentries; i++) {
+		free(s.entries[i].path);
+		free(s.entries[i].tracks);
+	}
+	free(s.stack);
+	free(s.entries);
+	free(threads);
+	errno = e;
+	return rc;
+}
@@ -0,0 +1,16 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+struct scan_result_s {
+	size_t images;		// .mds files found
+	size_t bad;		// of those, ones that couldn't be read
+	size_t skipped_dirs;	// directories that couldn't be read
+};
+
+int scan_tree(const char *dir, const char *indexfile, unsigned nthreads,
+	struct scan_result_s *result);
+
+/* _SCAN_H_ */
+#endif
@@ -0,0 +1,139 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include "stats.h"
+
+static const char *const phase_names[STATS_NUM_PHASES] = {
+	[STATS_PARSE] = "parse",
+	[STATS_OPEN] = "open",
+	[STATS_EXTRACT] = "extract",
+	[STATS_CLOSE] = "close",
+};
+
+static double tv_seconds(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void sample(struct stats_sample_s *s)
+{
+	struct timespec ts;
+	struct rusage ru;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	getrusage(RUSAGE_SELF, &ru);
+	*s = (struct stats_sample_s){
+		.wall = ts.tv_sec + ts.tv_nsec / 1e9,
+		.user = tv_seconds(ru.ru_utime),
+		.sys = tv_seconds(ru.ru_stime),
+		.majflt = ru.ru_majflt,
+		.minflt = ru.ru_minflt,
+		.nvcsw = ru.ru_nvcsw,
+		.nivcsw = ru.ru_nivcsw,
+		.inblock = ru.ru_inblock,
+		.oublock = ru.ru_oublock,
+	};
+}
+
+/* Add what happened between from and to onto sum. */
+static void accumulate(struct stats_sample_s *sum, const struct stats_sample_s *from,
+	const struct stats_sample_s *to)
+{
+	sum->wall += to->wall - from->wall;
+	sum->user += to->user - from->user;
+	sum->sys += to->sys - from->sys;
+	sum->majflt += to->majflt - from->majflt;
+	sum->minflt += to->minflt - from->minflt;
+	sum->nvcsw += to->nvcsw - from->nvcsw;
+	sum->nivcsw += to->nivcsw - from->nivcsw;
+	sum->inblock += to->inblock - from->inblock;
+	sum->oublock += to->oublock - from->oublock;
+}
+
+void stats_init(struct stats_s *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->current = -1;
+}
+
+/* End the current phase, if there is one, and start another. */
+void stats_phase(struct stats_s *s, enum stats_phase_e phase)
+{
+	struct stats_sample_s now;
+
+	sample(&now);
+	if (s->current != -1)
+		accumulate(&s->phase[s->current], &s->mark, &now);
+	s->mark = now;
+	s->current = phase;
+}
+
+void stats_end(struct stats_s *s)
+{
+	struct stats_sample_s now;
+
+	if (s->current == -1)
+		return;
+	sample(&now);
+	accumulate(&s->phase[s->current], &s->mark, &now);
+	s->current = -1;
+}
+
+static void print_string(FILE *f, const char *str)
+{
+	if (!str) {
+		fputs("null", f);
+		return;
+	}
+	fputc('"', f);
+	for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+		if ((*c == '"') || (*c == '\\'))
+			fprintf(f, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else
+			fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+static void print_sample(FILE *f, const struct stats_sample_s *s)
+{
+	fprintf(f, "\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,"
+		"\"major_faults\":%ld,\"minor_faults\":%ld,"
+		"\"voluntary_switches\":%ld,\"involuntary_switches\":%ld,"
+		"\"storage_read_bytes\":%lld,\"storage_write_bytes\":%lld",
+		s->wall, s->user, s->sys, s->majflt, s->minflt, s->nvcsw, s->nivcsw,
+		s->inblock * 512LL, s->oublock * 512LL);
+}
+
+/* One line of JSON, with totals first and then each phase. */
+void stats_print_json(FILE *f, const struct stats_s *s)
+{
+	struct stats_sample_s zero = { 0 }, total = { 0 };
+	const double extract = s->phase[STATS_EXTRACT].wall;
+
+	for (unsigned i = 0; i < STATS_NUM_PHASES; i++)
+		accumulate(&total, &zero, &s->phase[i]);
+
+	fputs("{\"mds\":", f);
+	print_string(f, s->mdsfile);
+	fputs(",\"output\":", f);
+	print_string(f, s->outfile);
+	fputs(",\"backend\":", f);
+	print_string(f, s->backend);
+	fprintf(f, ",\"threads\":%u,\"bytes_read\":%llu,\"bytes_written\":%llu,\"mb_per_s\":%.1f,",
+		s->nthreads, (unsigned long long)s->bytes_read, (unsigned long long)s->bytes_written,
+		(extract > 0) ? s->bytes_written / extract / 1e6 : 0.0);
+	print_sample(f, &total);
+	fputs(",\"phases\":{", f);
+	for (unsigned i = 0; i < STATS_NUM_PHASES; i++) {
+		fprintf(f, "%s\"%s\":{", i ? "," : "", phase_names[i]);
+		print_sample(f, &s->phase[i]);
+		fputc('}', f);
+	}
+	fputs("}}\n", f);
+}
@@ -0,0 +1,50 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Where a conversion spends its time. Each phase gets the wall clock,
+ * CPU time, page faults and context switches used between its start
+ * and the next phase's, counting every thread of the process.
+ */
+enum stats_phase_e {
+	STATS_PARSE,	// reading the .mds file
+	STATS_OPEN,	// opening the MDF and the output
+	STATS_EXTRACT,
+	STATS_CLOSE,	// closing and flushing the output
+	STATS_NUM_PHASES
+};
+
+struct stats_sample_s {
+	double wall;
+	double user;
+	double sys;
+	long majflt;
+	long minflt;
+	long nvcsw;
+	long nivcsw;
+	long inblock;	// 512-byte blocks read from storage
+	long oublock;
+};
+
+struct stats_s {
+	struct stats_sample_s phase[STATS_NUM_PHASES];
+	struct stats_sample_s mark;	// when the current phase began
+	int current;	// -1 before the first phase
+	const char *mdsfile;
+	const char *outfile;
+	const char *backend;	// how the track was extracted
+	unsigned nthreads;
+	uint64_t bytes_read;	// of the MDF
+	uint64_t bytes_written;
+};
+
+void stats_init(struct stats_s *s);
+void stats_phase(struct stats_s *s, enum stats_phase_e phase);
+void stats_end(struct stats_s *s);
+void stats_print_json(FILE *f, const struct stats_s *s);
+
+/* _STATS_H_ */
+#endif
@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "subchannel.h"
+
+/*
+ * Drives hand back subchannel data interleaved: each of the 96 bytes
+ * holds one bit of each of the channels P to W, P in the top bit. CloneCD
+ * style .sub files want them packed instead: 12 bytes of P, then 12 of Q,
+ * and so on. Going from one to the other is a transpose of twelve 8x8
+ * bit matrices.
+ */
+void sub_deinterleave(uint8_t out[SUB_LEN], const uint8_t in[SUB_LEN])
+{
+#ifdef __SSE2__
+	// movemask collects the top bit of each of 16 bytes, but puts the
+	// first byte's bit lowest, where we want it highest. Reversing each
+	// group of 8 bytes first makes the result come out in order.
+	for (unsigned i = 0; i < SUB_LEN / 16; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i * 16));
+
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		for (unsigned ch = 0; ch < 8; ch++) {
+			unsigned bits = _mm_movemask_epi8(v);
+			out[ch * 12 + i * 2] = bits;
+			out[ch * 12 + i * 2 + 1] = bits >> 8;
+			v = _mm_add_epi8(v, v);
+		}
+	}
+#else
+	memset(out, 0, SUB_LEN);
+	for (unsigned i = 0; i < SUB_LEN; i++) {
+		for (unsigned ch = 0; ch < 8; ch++) {
+			if (in[i] & (0x80 >> ch))
+				out[ch * 12 + i / 8] |= 0x80 >> (i % 8);
+		}
+	}
+#endif
+}
@@ -0,0 +1,12 @@
+#ifndef _SUBCHANNEL_H_
+#define _SUBCHANNEL_H_
+
+#include <stdint.h>
+
+// Subchannel bytes stored after each 2352-byte sector.
+#define SUB_LEN 96
+
+void sub_deinterleave(uint8_t out[SUB_LEN], const uint8_t in[SUB_LEN]);
+
+/* _SUBCHANNEL_H_ */
+#endif
@@ -0,0 +1,357 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "extract.h"
+#include "progress.h"
+
+/*
+ * Just enough of io_uring to keep a fixed number of reads and writes in
+ * flight, talking to the kernel directly so there's nothing extra to
+ * install.
+ */
+struct uring_s {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	unsigned pending;	// queued but not yet taken by the kernel
+	bool submitted;		// the kernel has taken something
+};
+
+static int uring_init(struct uring_s *u, unsigned entries)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -1;
+	u->entries = p.sq_entries;
+
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz)
+			u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = u->sq_ring_sz;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto out_close;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto out_unmap_sq;
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto out_unmap_cq;
+
+	sq = u->sq_ring;
+	cq = u->cq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+out_unmap_cq:
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_sz);
+out_unmap_sq:
+	munmap(u->sq_ring, u->sq_ring_sz);
+out_close:
+	close(u->fd);
+	return -1;
+}
+
+static void uring_free(struct uring_s *u)
+{
+	munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_sz);
+	munmap(u->sq_ring, u->sq_ring_sz);
+	close(u->fd);
+}
+
+/*
+ * There's no SQ polling thread, so the kernel only looks at the ring in
+ * io_uring_enter() and it's safe to publish the entry before filling it.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring_s *u)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	unsigned idx;
+
+	if (tail - head >= u->entries)
+		return NULL;
+	idx = tail & *u->sq_mask;
+	u->sq_array[idx] = idx;
+	memset(&u->sqes[idx], 0, sizeof(u->sqes[idx]));
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->pending++;
+	return &u->sqes[idx];
+}
+
+/*
+ * Hand over everything queued, or nothing if submit is false, then wait
+ * for at least one completion. Just waiting is retried until it works,
+ * since it's how the kernel is made to give the buffers back.
+ */
+static int uring_enter(struct uring_s *u, bool submit)
+{
+	for (;;) {
+		int rc = syscall(__NR_io_uring_enter, u->fd, submit ? u->pending : 0, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			if (!submit && ((errno == EAGAIN) || (errno == EBUSY))) continue;
+			return -1;
+		}
+		if (rc > 0)
+			u->submitted = true;
+		u->pending -= rc;
+		return 0;
+	}
+}
+
+enum slot_state_e {
+	SLOT_IDLE,
+	SLOT_READING,
+	SLOT_WRITING,
+};
+
+struct slot_s {
+	enum slot_state_e state;
+	uint8_t *buf;
+	uint64_t first;		// first block held in buf
+	unsigned count;		// number of blocks held in buf
+	size_t done;		// bytes of the current read/write completed
+};
+
+static int queue_io(struct uring_s *u, const struct extract_job_s *job,
+	struct slot_s *s, unsigned idx, bool fixed)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	if (!sqe) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (s->state == SLOT_READING) {
+		sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->fd = job->in_fd;
+		sqe->off = job->in_off + s->first * job->stride + s->done;
+		sqe->len = s->count * job->stride - s->done;
+	} else {
+		sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->fd = job->out_fd;
+		sqe->off = job->out_off + s->first * job->data_len + s->done;
+		sqe->len = s->count * job->data_len - s->done;
+	}
+	sqe->addr = (uintptr_t)(s->buf + s->done);
+	sqe->buf_index = idx;
+	sqe->user_data = idx;
+	return 0;
+}
+
+/*
+ * Extract with qdepth buffers cycling between the MDF and the output.
+ * Each buffer is read in one large request, its payloads are packed to
+ * the front in place, and the packed run is written back out, so that
+ * up to qdepth requests are with the kernel at any one time. Buffers are
+ * registered with the ring when the kernel allows it.
+ */
+int extract_uring(const struct extract_job_s *job, unsigned qdepth)
+{
+	struct uring_s u;
+	struct slot_s *slots;
+	struct iovec *iov;
+	uint8_t *pool;
+	unsigned chunk, inflight = 0;
+	uint64_t next = 0;
+	bool fixed;
+	int rc = 0, e = 0;
+
+	if (lseek(job->out_fd, 0, SEEK_CUR) == -1)
+		return -1;
+	if (qdepth < 1)
+		qdepth = 1;
+	chunk = (1024*1024) / job->stride;
+	if (chunk < 1)
+		chunk = 1;
+
+	if (uring_init(&u, qdepth))
+		return -1;
+	slots = calloc(qdepth, sizeof(*slots));
+	iov = calloc(qdepth, sizeof(*iov));
+	pool = mmap(NULL, (size_t)qdepth * chunk * job->stride, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (!slots || !iov || (pool == MAP_FAILED)) {
+		e = errno;
+		rc = -1;
+		goto out_free;
+	}
+	for (unsigned i = 0; i < qdepth; i++) {
+		slots[i].buf = pool + (size_t)i * chunk * job->stride;
+		iov[i].iov_base = slots[i].buf;
+		iov[i].iov_len = (size_t)chunk * job->stride;
+	}
+	fixed = !syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_BUFFERS, iov, qdepth);
+
+	for (;;) {
+		// Put every idle buffer back to work. Once something has gone
+		// wrong, stop queueing and just wait for the kernel to finish
+		// with the buffers.
+		for (unsigned i = 0; !rc && (i < qdepth) && (next < job->numblocks); i++) {
+			struct slot_s *s = &slots[i];
+			if (s->state != SLOT_IDLE)
+				continue;
+			s->state = SLOT_READING;
+			s->first = next;
+			s->count = (job->numblocks - next > chunk) ? chunk : job->numblocks - next;
+			s->done = 0;
+			next += s->count;
+			if (queue_io(&u, job, s, i, fixed)) {
+				e = errno;
+				rc = -1;
+				break;
+			}
+			inflight++;
+		}
+		if (!inflight)
+			break;
+		// After a failure, requests the kernel never took are dropped
+		// along with the ring; only the ones it has need waiting for.
+		if (rc && (inflight == u.pending))
+			break;
+
+		if (uring_enter(&u, !rc)) {
+			if (!rc) {
+				e = errno;
+				rc = -1;
+				continue;
+			}
+			// The kernel can't be waited on any more. Closing the
+			// ring before the buffers go is all that's left.
+			break;
+		}
+
+		unsigned head = *u.cq_head;
+		unsigned tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+			unsigned idx = cqe->user_data;
+			struct slot_s *s = &slots[idx];
+			size_t want;
+
+			inflight--;
+			if ((cqe->res <= 0) || rc) {
+				if (!rc) {
+					e = cqe->res ? -cqe->res : EIO;
+					rc = -1;
+				}
+				continue;
+			}
+			s->done += cqe->res;
+			want = (size_t)s->count * (s->state == SLOT_READING ? job->stride : job->data_len);
+			if (s->done < want) {
+				// Short read or write; ask for the rest.
+				if (queue_io(&u, job, s, idx, fixed)) {
+					e = errno;
+					rc = -1;
+				} else {
+					inflight++;
+				}
+				continue;
+			}
+
+			if (s->state == SLOT_READING) {
+				if (job->data_len != job->stride) {
+					for (unsigned k = 0; k < s->count; k++) {
+						memmove(s->buf + (size_t)k * job->data_len,
+							s->buf + (size_t)k * job->stride + job->data_off,
+							job->data_len);
+					}
+				}
+				s->state = SLOT_WRITING;
+				s->done = 0;
+				if (queue_io(&u, job, s, idx, fixed)) {
+					e = errno;
+					rc = -1;
+				} else {
+					inflight++;
+				}
+			} else {
+				progress_add(job->progress, (uint64_t)s->count * job->data_len);
+				s->state = SLOT_IDLE;
+			}
+		}
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+out_free:
+	uring_free(&u);
+	if (pool && (pool != MAP_FAILED))
+		munmap(pool, (size_t)qdepth * chunk * job->stride);
+	free(iov);
+	free(slots);
+	if (rc && u.submitted) {
+		// The caller starts over without io_uring on these, which is
+		// only right if none of the output was written this way.
+		switch (e) {
+		case ENOSYS:
+		case EPERM:
+		case EINVAL:
+		case EOPNOTSUPP:
+		case ESPIPE:
+			e = EIO;
+			break;
+		}
+	}
+	if (rc)
+		errno = e;
+	return rc;
+}
+
+/* __linux__ */
+#else
+#include <errno.h>
+#include "extract.h"
+
+int extract_uring(const struct extract_job_s *job, unsigned qdepth)
+{
+	(void)job;
+	(void)qdepth;
+	errno = ENOSYS;
+	return -1;
+}
+
+/* __linux__ */
+#endif
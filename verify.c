@@ -0,0 +1,395 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crc.h"
+#include "libmds.h"
+#include "mdsfmt.h"
+#include "verify.h"
+
+/*
+ * Checks raw CD-ROM sectors against the error detection and correction
+ * codes of ECMA-130: the EDC, a CRC over the sector, and the P and Q
+ * Reed-Solomon parity, computed over GF(2^8).
+ */
+
+#define RAW_SECTOR	2352
+// Sectors read at a time by each thread.
+#define VERIFY_BATCH	64
+
+#define EDC_POLY	0xd8018001	// x^32 + x^31 + x^16 + x^15 + x^4 + x^3 + x + 1, reflected
+
+static const uint8_t sync_pattern[12] = {
+	0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00,
+};
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static crc32_table_t edc_table;
+static uint8_t ecc_f[256];	// multiply by x
+static uint8_t ecc_b[256];	// divide by x + 1
+
+static void init_tables(void)
+{
+	crc32_table_init(edc_table, EDC_POLY);
+	for (unsigned i = 0; i < 256; i++) {
+		unsigned j = (i << 1) ^ ((i & 0x80) ? 0x11d : 0);
+
+		ecc_f[i] = j;
+		ecc_b[i ^ j] = i;
+	}
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t edc_compute(const uint8_t *p, size_t len)
+{
+	return crc32_update(edc_table, 0, p, len);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*
+ * Compute one set of parity bytes. src is the sector from its header on,
+ * treated as major_count columns of minor_count bytes, and the
+ * 2*major_count parity bytes go to parity.
+ */
+static void ecc_compute(const uint8_t *src, unsigned major_count, unsigned minor_count,
+	unsigned major_mult, unsigned minor_inc, uint8_t *parity)
+{
+	const unsigned size = major_count * minor_count;
+
+	for (unsigned major = 0; major < major_count; major++) {
+		unsigned index = (major >> 1) * major_mult + (major & 1);
+		uint8_t a = 0, b = 0;
+
+		for (unsigned minor = 0; minor < minor_count; minor++) {
+			uint8_t v = src[index];
+
+			index += minor_inc;
+			if (index >= size)
+				index -= size;
+			a = ecc_f[a ^ v];
+			b ^= v;
+		}
+		a = ecc_b[ecc_f[a] ^ b];
+		parity[major] = a;
+		parity[major + major_count] = a ^ b;
+	}
+}
+
+/*
+ * Mode 2 leaves the address out of the parity, as if it were zero, so
+ * a copy is checked instead.
+ */
+static bool ecc_ok(const uint8_t *sector, bool zero_address)
+{
+	uint8_t copy[RAW_SECTOR - 12], p[2 * 86], q[2 * 52];
+	const uint8_t *src = sector + 12;
+
+	if (zero_address) {
+		memcpy(copy, src, sizeof(copy));
+		memset(copy, 0, 4);
+		src = copy;
+	}
+	ecc_compute(src, 86, 24, 2, 86, p);
+	if (memcmp(p, src + 0x810, sizeof(p)))
+		return false;
+	ecc_compute(src, 52, 43, 86, 88, q);
+	return !memcmp(q, src + 0x8bc, sizeof(q));
+}
+
+static void ecc_fill(uint8_t *sector, bool zero_address)
+{
+	uint8_t *src = sector + 12;
+	uint8_t address[4];
+
+	memcpy(address, src, sizeof(address));
+	if (zero_address)
+		memset(src, 0, sizeof(address));
+	ecc_compute(src, 86, 24, 2, 86, src + 0x810);
+	ecc_compute(src, 52, 43, 86, 88, src + 0x8bc);
+	memcpy(src, address, sizeof(address));
+}
+
+static uint8_t bcd(unsigned n)
+{
+	return ((n / 10) << 4) | (n % 10);
+}
+
+/* Tracks stored as whole raw sectors carry something to check. */
+bool verify_can_check(const struct mds_track_info_s *info)
+{
+	return info->data && (info->mode != TM_DVD) && (info->secsize >= RAW_SECTOR);
+}
+
+/* Check one raw sector, which should be at lba of a track in trackmode. */
+enum verify_error_e verify_sector(const uint8_t *sector, int32_t lba, unsigned trackmode)
+{
+	unsigned frames = lba + 150;
+	const uint8_t *subheader = sector + 16;
+
+	pthread_once(&tables_once, init_tables);
+	if (memcmp(sector, sync_pattern, sizeof(sync_pattern)))
+		return VERIFY_SYNC;
+	if ((sector[12] != bcd(frames / (60 * 75)))
+		|| (sector[13] != bcd(frames / 75 % 60))
+		|| (sector[14] != bcd(frames % 75))
+		|| (sector[15] != ((trackmode == TM_MODE1) ? 1 : 2)))
+		return VERIFY_HEADER;
+
+	switch (trackmode) {
+	case TM_MODE1:
+		if (edc_compute(sector, 0x810) != le32(sector + 0x810))
+			return VERIFY_EDC;
+		return ecc_ok(sector, false) ? VERIFY_OK : VERIFY_ECC;
+	case TM_MODE2_FORM1:
+	case TM_MODE2_FORM2:
+	case TM_MODE2_SUB:
+		// The form can change from sector to sector; the subheader
+		// says which this one is. Form 2 has no parity, and its EDC
+		// is optional.
+		if (subheader[2] & 0x20) {
+			uint32_t edc = le32(sector + 0x92c);
+			if (edc && (edc_compute(subheader, 0x91c) != edc))
+				return VERIFY_EDC;
+			return VERIFY_OK;
+		}
+		if (edc_compute(subheader, 0x808) != le32(sector + 0x818))
+			return VERIFY_EDC;
+		return ecc_ok(sector, true) ? VERIFY_OK : VERIFY_ECC;
+	default:
+		// Formless Mode 2 is all user data.
+		return VERIFY_OK;
+	}
+}
+
+/*
+ * The reverse of verify_sector(): fill in the sync pattern, header, EDC
+ * and ECC of a raw sector at lba of a track in trackmode, around the
+ * user data, and for Mode 2 forms the subheader, already in place.
+ */
+void verify_fill_sector(uint8_t *sector, int32_t lba, unsigned trackmode)
+{
+	unsigned frames = lba + 150;
+	uint8_t *subheader = sector + 16;
+
+	pthread_once(&tables_once, init_tables);
+	memcpy(sector, sync_pattern, sizeof(sync_pattern));
+	sector[12] = bcd(frames / (60 * 75));
+	sector[13] = bcd(frames / 75 % 60);
+	sector[14] = bcd(frames % 75);
+	sector[15] = (trackmode == TM_MODE1) ? 1 : 2;
+
+	switch (trackmode) {
+	case TM_MODE1:
+		put_le32(sector + 0x810, edc_compute(sector, 0x810));
+		memset(sector + 0x814, 0, 8);
+		ecc_fill(sector, false);
+		break;
+	case TM_MODE2_FORM1:
+	case TM_MODE2_FORM2:
+	case TM_MODE2_SUB:
+		if (subheader[2] & 0x20) {
+			put_le32(sector + 0x92c, edc_compute(subheader, 0x91c));
+			break;
+		}
+		put_le32(sector + 0x818, edc_compute(subheader, 0x808));
+		ecc_fill(sector, true);
+		break;
+	default:
+		break;
+	}
+}
+
+const char *verify_error_tostring(enum verify_error_e what)
+{
+	switch (what) {
+	case VERIFY_OK:		return "ok";
+	case VERIFY_SYNC:	return "bad sync";
+	case VERIFY_HEADER:	return "bad header";
+	case VERIFY_EDC:	return "bad EDC";
+	case VERIFY_ECC:	return "bad ECC";
+	default:		return "unknown";
+	}
+}
+
+struct verify_worker_s {
+	pthread_t thread;
+	struct mds_ctx *ctx;
+	unsigned track;
+	struct mds_track_info_s info;
+	int32_t lba;
+	uint32_t count;
+	struct verify_bad_s *bad;
+	size_t numbad;
+	size_t maxbad;
+	int rc;
+	int err;
+};
+
+static int add_bad(struct verify_worker_s *w, int32_t lba, enum verify_error_e what)
+{
+	struct verify_bad_s *last = w->numbad ? &w->bad[w->numbad - 1] : NULL;
+
+	if (last && (last->what == what) && (last->lba + (int32_t)last->count == lba)) {
+		last->count++;
+		return 0;
+	}
+	if (w->numbad == w->maxbad) {
+		size_t max = w->maxbad ? w->maxbad * 2 : 16;
+		struct verify_bad_s *bad = realloc(w->bad, max * sizeof(*bad));
+		if (!bad)
+			return -1;
+		w->bad = bad;
+		w->maxbad = max;
+	}
+	w->bad[w->numbad++] = (struct verify_bad_s){ .lba = lba, .count = 1, .what = what };
+	return 0;
+}
+
+static int verify_range(struct verify_worker_s *w)
+{
+	const unsigned secsize = w->info.secsize;
+	uint8_t *buf;
+	int rc = 0;
+
+	buf = malloc((size_t)VERIFY_BATCH * secsize);
+	if (!buf)
+		return -1;
+	for (uint32_t done = 0; !rc && (done < w->count); ) {
+		int32_t lba = w->lba + done;
+		uint32_t want = (w->count - done < VERIFY_BATCH) ? w->count - done : VERIFY_BATCH;
+		ssize_t got = mds_read_sectors(w->ctx, w->track, lba, want, buf, MDS_READ_RAW);
+
+		if (got <= 0) {
+			if (!got)
+				errno = EIO;
+			rc = -1;
+			break;
+		}
+		for (ssize_t i = 0; !rc && (i < got); i++) {
+			enum verify_error_e what = verify_sector(buf + i * secsize, lba + i, w->info.mode);
+			if (what != VERIFY_OK)
+				rc = add_bad(w, lba + i, what);
+		}
+		done += got;
+	}
+	free(buf);
+	return rc;
+}
+
+static void *verify_main(void *arg)
+{
+	struct verify_worker_s *w = arg;
+
+	w->rc = verify_range(w);
+	w->err = w->rc ? errno : 0;
+	return NULL;
+}
+
+/*
+ * Check every sector of a track, split across nthreads threads, and
+ * hand back the runs of bad sectors in order. mds_open_data() must have
+ * been called.
+ */
+int verify_track(struct mds_ctx *ctx, unsigned track, unsigned nthreads,
+	struct verify_bad_s **bad, size_t *numbad)
+{
+	struct mds_track_info_s info;
+	struct verify_worker_s *workers;
+	uint32_t per, first = 0;
+	unsigned started;
+	size_t total = 0;
+	int rc = 0, e = 0;
+
+	*bad = NULL;
+	*numbad = 0;
+	if (mds_get_track(ctx, track, &info))
+		return -1;
+	if (!verify_can_check(&info)) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_once(&tables_once, init_tables);
+	if (nthreads > info.length)
+		nthreads = info.length;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		return -1;
+	per = info.length / nthreads;
+	for (started = 0; started < nthreads; started++) {
+		struct verify_worker_s *w = &workers[started];
+
+		w->ctx = ctx;
+		w->track = track;
+		w->info = info;
+		w->lba = info.lba + first;
+		w->count = (started == nthreads - 1) ? info.length - first : per;
+		first += w->count;
+
+		if (nthreads == 1) {
+			verify_main(w);
+			continue;
+		}
+		e = pthread_create(&w->thread, NULL, verify_main, w);
+		if (e) break;
+	}
+
+	for (unsigned i = 0; i < started; i++) {
+		if (nthreads > 1)
+			pthread_join(workers[i].thread, NULL);
+		if (workers[i].rc && !rc) {
+			rc = -1;
+			e = workers[i].err;
+		}
+		total += workers[i].numbad;
+	}
+	if (started < nthreads)
+		rc = -1;
+
+	// Stitch the workers' lists together, joining runs that were cut
+	// at a boundary between two workers.
+	if (!rc && total) {
+		*bad = malloc(total * sizeof(**bad));
+		if (!*bad) {
+			rc = -1;
+			e = errno;
+		}
+	}
+	for (unsigned i = 0; !rc && (i < started); i++) {
+		for (size_t j = 0; j < workers[i].numbad; j++) {
+			struct verify_bad_s *b = &workers[i].bad[j];
+			struct verify_bad_s *last = *numbad ? &(*bad)[*numbad - 1] : NULL;
+
+			if (last && (last->what == b->what) && (last->lba + (int32_t)last->count == b->lba))
+				last->count += b->count;
+			else
+				(*bad)[(*numbad)++] = *b;
+		}
+	}
+	for (unsigned i = 0; i < nthreads; i++)
+		free(workers[i].bad);
+	free(workers);
+	if (rc) {
+		free(*bad);
+		*bad = NULL;
+		*numbad = 0;
+		errno = e;
+	}
+	return rc;
+}
@@ -0,0 +1,32 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "libmds.h"
+
+enum verify_error_e {
+	VERIFY_OK = 0,
+	VERIFY_SYNC,		// sync pattern missing
+	VERIFY_HEADER,		// address or mode doesn't match the track
+	VERIFY_EDC,
+	VERIFY_ECC,
+};
+
+// A run of consecutive sectors that failed the same way.
+struct verify_bad_s {
+	int32_t lba;
+	uint32_t count;
+	enum verify_error_e what;
+};
+
+bool verify_can_check(const struct mds_track_info_s *info);
+enum verify_error_e verify_sector(const uint8_t *sector, int32_t lba, unsigned trackmode);
+void verify_fill_sector(uint8_t *sector, int32_t lba, unsigned trackmode);
+int verify_track(struct mds_ctx *ctx, unsigned track, unsigned nthreads,
+	struct verify_bad_s **bad, size_t *numbad);
+const char *verify_error_tostring(enum verify_error_e what);
+
+/* _VERIFY_H_ */
+#endif
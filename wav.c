@@ -0,0 +1,29 @@
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include "endian.h"
+#include "wav.h"
+
+/*
+ * Build the header of a canonical WAV file holding data_len bytes of
+ * CD-DA audio: 44.1 kHz, 16-bit, stereo PCM.
+ */
+void wav_header(uint8_t hdr[WAV_HEADER_LEN], uint32_t data_len)
+{
+	uint32_t u32;
+	uint16_t u16;
+
+	memcpy(hdr + 0, "RIFF", 4);
+	u32 = htole32(36 + data_len);	memcpy(hdr + 4, &u32, 4);
+	memcpy(hdr + 8, "WAVE", 4);
+	memcpy(hdr + 12, "fmt ", 4);
+	u32 = htole32(16);		memcpy(hdr + 16, &u32, 4);
+	u16 = htole16(1);		memcpy(hdr + 20, &u16, 2);	// PCM
+	u16 = htole16(2);		memcpy(hdr + 22, &u16, 2);	// channels
+	u32 = htole32(44100);		memcpy(hdr + 24, &u32, 4);	// sample rate
+	u32 = htole32(44100 * 4);	memcpy(hdr + 28, &u32, 4);	// byte rate
+	u16 = htole16(4);		memcpy(hdr + 32, &u16, 2);	// block align
+	u16 = htole16(16);		memcpy(hdr + 34, &u16, 2);	// bits per sample
+	memcpy(hdr + 36, "data", 4);
+	u32 = htole32(data_len);	memcpy(hdr + 40, &u32, 4);
+}
@@ -0,0 +1,11 @@
+#ifndef _WAV_H_
+#define _WAV_H_
+
+#include <stdint.h>
+
+#define WAV_HEADER_LEN 44
+
+void wav_header(uint8_t hdr[WAV_HEADER_LEN], uint32_t data_len);
+
+/* _WAV_H_ */
+#endif